@@ -0,0 +1,87 @@
+#ifndef ANTIENTROPY_H
+#define ANTIENTROPY_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <stdint.h>
+#include "DronePlotDB.h"
+
+// Merkle tree shape: plots are bucketed by timestamp into ae_leaves leaves, and each interior
+// node hashes ae_fanout children, so the tree is ae_fanout^(ae_levels-1) leaves wide
+const unsigned int ae_fanout = 16;
+const unsigned int ae_levels = 3;                  // root, 16 nodes, 256 leaves
+const unsigned int ae_leaves = 256;
+const time_t ae_bucket_secs = 10;                  // sim seconds of plots per time bucket
+
+/********************************************************************************************
+ * MerkleTree - hashes over a set of plot hashes. Each leaf combines the plots in one time
+ *              bucket order-independently, and interior nodes hash their children, so two
+ *              servers holding the same plots have the same root no matter how they got them
+ ********************************************************************************************/
+class MerkleTree
+{
+public:
+   MerkleTree();
+
+   void add(uint64_t plot_hash, unsigned int leaf);
+
+   // Hash of node idx at the given level (0 = root, ae_levels-1 = leaves)
+   uint64_t getNode(unsigned int level, unsigned int idx);
+
+private:
+   void rebuild();
+
+   std::vector<std::vector<uint64_t>> _levels;
+   bool _dirty;
+};
+
+/********************************************************************************************
+ * AntiEntropy - Merkle-tree anti-entropy between replication servers. Each server keeps a
+ *               tree over the plots it originated plus a mirror tree of what it has received
+ *               from each peer. Peers periodically send their root, the receiver compares it
+ *               against its mirror and asks for the children of any node that differs, down
+ *               to the leaves, and only the plots in divergent time buckets are resent.
+ *
+ *               Plots are hashed in their wire form, before skew correction or dedup touch
+ *               them, so the mirror also lets the receiver drop plots it already has.
+ ********************************************************************************************/
+class AntiEntropy
+{
+public:
+   AntiEntropy();
+   ~AntiEntropy();
+
+   // Records a plot this server originated as it goes out on the wire. Returns false if
+   // it was already recorded
+   bool addLocal(DronePlot &plot);
+
+   // Records a plot received from origin. Returns false if it was already received
+   bool addRemote(const std::string &origin, DronePlot &plot);
+
+   // Builds an rm_ae_digest message body carrying the root of our local tree
+   void getRootDigest(std::vector<uint8_t> &body);
+
+   // A peer sent the digest of its local tree. Compares it against our mirror of that peer
+   // and builds an rm_ae_request body for any nodes that differ (false if in sync)
+   bool handleDigest(const std::string &origin, const uint8_t *body, size_t len,
+                                                 std::vector<uint8_t> &request);
+
+   // A peer requested nodes of our local tree. Builds the reply payload: the child digests for
+   // interior nodes or the plots for leaves, as one or more complete messages
+   void handleRequest(const uint8_t *body, size_t len, std::vector<uint8_t> &reply);
+
+private:
+   static uint64_t hashPlot(DronePlot &plot);
+   static unsigned int getLeaf(DronePlot &plot);
+
+   MerkleTree _local;
+   std::vector<std::vector<DronePlot>> _local_plots;    // Plots we originated, by leaf
+   std::unordered_set<uint64_t> _local_seen;
+
+   std::map<std::string, MerkleTree> _mirrors;           // What we hold from each origin
+   std::map<std::string, std::unordered_set<uint64_t>> _remote_seen;
+};
+
+#endif
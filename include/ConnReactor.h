@@ -0,0 +1,69 @@
+#ifndef CONNREACTOR_H
+#define CONNREACTOR_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include "TCPServer.h"
+#include "SPSCRing.h"
+
+// Connections handed between the queue manager and a reactor that can wait to be picked up
+const size_t reactor_handoff_size = 64;
+
+/********************************************************************************************
+ * ConnReactor - One extra network thread for the queue manager. It has its own listening
+ *               socket on the server's address and port (SO_REUSEPORT, so the kernel spreads
+ *               incoming connections across the threads listening) and its own event loop,
+ *               and drives every connection it accepts, or that the queue manager hands it
+ *               after dialing, from then on: handshakes, reads, frame reassembly, acks and
+ *               writes all happen on this thread, so inbound traffic from many peers is
+ *               spread across cores.
+ *
+ *               The queue manager keeps the per-peer queues and decides what to send. It
+ *               hears about sessions that open here through a lock-free ring (takeOpened),
+ *               and exchanges frames, payloads and acks with them through the lock-free rings
+ *               in TCPConn. Either side wakes the other's event loop when it hands something
+ *               over.
+ ********************************************************************************************/
+
+class ConnReactor : public TCPServer
+{
+public:
+   ConnReactor(const std::string &svr_id, EventLoop &mgr_loop, unsigned int verbosity = 1);
+   virtual ~ConnReactor();
+
+   // Binds and listens alongside the queue manager (which must also use SO_REUSEPORT),
+   // then starts the thread
+   void start(const char *ip_addr, unsigned short port);
+   void stop();
+
+   // Queue manager side - hands over a connection it dialed, and picks up sessions that
+   // opened on this thread. Both return false if the ring is full/empty
+   bool adopt(std::shared_ptr<TCPConn> conn);
+   bool takeOpened(std::shared_ptr<TCPConn> &conn);
+
+   // Connections created elsewhere for this reactor log and authenticate with its copies
+   LogMgr &getLog() { return _server_log; };
+   CryptoPP::SecByteBlock &getKey() { return _aes_key; };
+
+protected:
+   void setupConn(TCPConn *conn);
+
+private:
+   void run();
+
+   // Lets the queue manager know about sessions that opened and anything that came in
+   void announce();
+
+   std::string _svr_id;
+   EventLoop &_mgr_loop;
+
+   SPSCRing<std::shared_ptr<TCPConn>> _adopted;    // queue manager -> reactor
+   SPSCRing<std::shared_ptr<TCPConn>> _opened;     // reactor -> queue manager
+
+   std::thread _thread;
+   std::atomic<bool> _shutdown;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <map>
 #include <memory>
+#include <unordered_map>
 #include "DronePlotDB.h"
 #include "QueueMgr.h"
 
@@ -15,6 +16,11 @@ typedef struct sOffset
         
 }sOffset;
 
+// Default tolerances for two plots of the same drone to be considered duplicates. Antennas can
+// quantize the same GPS fix slightly differently, so lat/long are not compared bit-exact
+const time_t default_time_tol = 20;        // seconds
+const float default_latlon_tol = 0.00001;  // degrees (roughly a meter)
+
 /********************************************************************************************
  * Deduplicate - this class handles 4 primary tasks dealing with the duplication
  *             1) find duplicates
@@ -36,9 +42,33 @@ public:
      	void printValues();  
         void correctToLeader(); // this method corrects at the end to make all consistent to leader at the end
         void fixTimeSkew(DronePlot & plot);
+        void setTolerances(time_t time_tol, float lat_tol, float lon_tol); // set the dup match tolerances
         
 
 private:
+        // Plots are hashed into lat/long/time grid cells the size of the tolerances, so any
+        // duplicate of a plot has to be in the same or a neighboring cell
+        typedef struct sGridKey
+        {
+                unsigned int drone_id;
+                long lat_cell;
+                long lon_cell;
+                long time_cell;
+                bool operator==(const sGridKey &other) const;
+        }sGridKey;
+
+        struct GridKeyHash
+        {
+                size_t operator()(const sGridKey &key) const;
+        };
+
+        typedef std::unordered_map<sGridKey, std::vector<size_t>, GridKeyHash> PlotGrid;
+
+        bool dedupPass();
+        sGridKey getCell(DronePlot & plot);
+        void findMatches(PlotGrid &grid, std::vector<std::list<DronePlot>::iterator> &plots,
+                         size_t target, size_t lo, size_t hi,
+                         std::vector<size_t> &matches);
         bool checkDup(DronePlot & plot1, DronePlot & plot2);
         bool findTimeSkew(DronePlot diffPlot, DronePlot mePlot);
         bool findHardSkew(DronePlot knownPlot, DronePlot unknownPlot);
@@ -53,6 +83,11 @@ private:
         unsigned int _leaderSID; // SID of leader
         sOffset _leader; // leader information   
 
+        // Duplicate match tolerances (also the grid cell sizes)
+        time_t _time_tol;
+        float _lat_tol;
+        float _lon_tol;
+
         
 };
 
@@ -3,6 +3,7 @@
 
 #include <list>
 #include <vector>
+#include <functional>
 #include <unistd.h>
 #include <pthread.h>
 #include "exceptions.h"
@@ -17,6 +18,7 @@
 #define DBFLAG_USER2    0x8   // Change as needed
 #define DBFLAG_USER3    0x16  // Change as needed
 #define DBFLAG_USER4    0x32
+#define DBFLAG_TOMBSTONE 0x40 // Marked for deletion, removed at the next compact()
 
 // Manages the drone plot database for a particular node.
 class DronePlot
@@ -65,8 +67,9 @@ public:
    DronePlotDB();
    virtual ~DronePlotDB();
 
-   // Add a plot to the database with the given attributes (mutex'd)
-   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude);
+   // Add a plot to the database with the given attributes and flags (mutex'd)
+   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude,
+                                                                        unsigned short flags = 0);
 
    // Load or write the database to/from a CSV file, 
    int loadCSVFile(const char *filename);
@@ -82,6 +85,12 @@ public:
    // Remove all plotpoints of a particular node (used to generate binary, not for student use)
    void removeNodeID(unsigned int node_id);
 
+   // Bulk deletion - mark plots as tombstoned while iterating, then remove them all in one
+   // linear pass under a single lock with compact. eraseIf removes every plot matching pred
+   void markErased(std::list<DronePlot>::iterator dptr) { dptr->setFlags(DBFLAG_TOMBSTONE); };
+   size_t compact();
+   size_t eraseIf(std::function<bool(DronePlot &)> pred);
+
    // Iterators for simple access to the database. Can use these to modify drone plot points
    // but won't be able to add/delete PlotObjects. Use erase (below) for that as it is mutex'd
    std::list<DronePlot>::iterator begin() { return _dbdata.begin(); };
@@ -99,10 +108,15 @@ public:
    // Wipe the database
    void clear();
 
+   // Set an eventfd to be signaled each time addPlot adds a DBFLAG_NEW plot (-1 to stop)
+   void setNotifyFD(int fd) { _notify_fd = fd; };
+
 private:
    std::list<DronePlot> _dbdata;
 
    pthread_mutex_t _mutex; 
+
+   int _notify_fd;
 };
 
 
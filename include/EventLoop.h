@@ -0,0 +1,76 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include "exceptions.h"
+
+/********************************************************************************************
+ * EventFD - Wraps a nonblocking eventfd counter. signal adds to it from any thread; drain
+ *           reads and resets it. Register getFD with an EventLoop to wait on it.
+ ********************************************************************************************/
+
+class EventFD
+{
+public:
+   EventFD();
+   ~EventFD();
+
+   // Takes over an eventfd made elsewhere (another process's, passed over a Unix socket)
+   explicit EventFD(int fd):_fd(fd) { };
+
+   void signal(uint64_t count = 1);
+   uint64_t drain();
+
+   int getFD() { return _fd; };
+
+private:
+   int _fd;
+};
+
+/********************************************************************************************
+ * EventLoop - Reactor built on epoll. File descriptors are registered once and a single
+ *             wait call sleeps until any of them is ready, a timeout expires, or another
+ *             thread calls wakeup (which signals an eventfd that is always registered).
+ *
+ *             After wait returns, isReady/getEvents report what each FD was flagged with
+ *             until the next wait.
+ ********************************************************************************************/
+
+class EventLoop
+{
+public:
+   EventLoop();
+   ~EventLoop();
+
+   // Register, change or remove a file descriptor (events are EPOLLIN, EPOLLOUT, etc)
+   void addFD(int fd, uint32_t events = EPOLLIN);
+   void modifyFD(int fd, uint32_t events);
+   void removeFD(int fd);
+
+   // Sleep until there are events or timeout_ms passes (-1 = forever). Returns # ready FDs
+   int wait(int timeout_ms);
+
+   // Results of the last wait
+   bool isReady(int fd);
+   uint32_t getEvents(int fd);
+
+   // Thread-safe - interrupts wait from anywhere (other threads, DronePlotDB::addPlot)
+   void wakeup();
+   int getWakeFD() { return _wakefd.getFD(); };
+
+   // How many wakeups were signaled since the previous wait
+   uint64_t getWakeCount() { return _wake_count; };
+
+private:
+   int _epfd;
+   EventFD _wakefd;
+
+   std::vector<epoll_event> _events;
+   std::unordered_map<int, uint32_t> _ready;
+   uint64_t _wake_count;
+};
+
+#endif
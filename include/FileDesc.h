@@ -3,8 +3,10 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <vector>
+#include <string>
 #include <unistd.h>
 #include "exceptions.h"
 
@@ -12,7 +14,8 @@
 // FileDesc provides some limited functionality and could be instantiated, but child
 // classes may provide specialized capability. These include:
 // 
-// SocketFD - Network socket FD with stored IP/port information in sockaddr_in
+// SocketFD - Network socket FD with stored IP/port information in sockaddr_in (or a Unix
+//            domain socket's path)
 // TermFD - Stdin terminal
 // FileFD - non-buffered file FD with ability to write/read binary data
 
@@ -30,9 +33,18 @@ public:
    ssize_t writeFD(const char *data);
    ssize_t writeFD(const char *data, unsigned int len);
 
+   // Gathers several buffers into one write, finishing partial writes on non-blocking FDs
+   ssize_t writeVec(const struct iovec *iov, int iovcnt, int ms_timeout = 5000);
+
+   // One writev of as much as a non-blocking FD will take right now, without waiting
+   ssize_t tryWriteVec(const struct iovec *iov, int iovcnt);
+
    // Basic read function to read all string data off the FD
    ssize_t readFD(std::string &buf);
 
+   // Reads up to len bytes straight into buf
+   ssize_t readFD(uint8_t *buf, size_t len);
+
    // Reads one character from the buffer at a time until it finds a newline
    ssize_t readStr(std::string &buf);
 
@@ -144,14 +156,36 @@ public:
    ~SocketFD();
 
    void bindFD(const char *ip_addr, unsigned short int port);
-   bool connectTo(const char *ip_addr, unsigned short port);
-   bool connectTo(unsigned long ip_addr, unsigned short port);
+   bool connectTo(const char *ip_addr, unsigned short port, bool wait = true);
+   bool connectTo(unsigned long ip_addr, unsigned short port, bool wait = true);
+
+   // Unix domain socket versions, for servers on the same host. bindUnix replaces any stale
+   // socket file left at path
+   void bindUnix(const char *path);
+   bool connectUnix(const char *path, bool wait = true);
+
+   // After a connectTo that didn't wait - 0 once the connect went through, or its errno
+   int getConnectError();
    void listenFD(int backlog = 5);
    bool acceptFD(SocketFD &server);
 
+   // Unix domain sockets: the path, and the user ID of the process on the other end
+   bool isUnix() { return _unix; };
+   const std::string &getUnixPath() { return _unix_path; };
+   bool getPeerUID(uid_t &uid);
+
+   // Unix domain sockets: sends data with file descriptors attached (SCM_RIGHTS), or reads
+   // data and any descriptors that came with it (nfds in: room in fds, out: how many came)
+   ssize_t sendFDs(const void *buf, size_t len, const int *fds, int nfds);
+   ssize_t recvFDs(void *buf, size_t len, int *fds, int &nfds);
+
    // Sets this address to reusable to prevent problems when sockets don't shut down properly
    void setReusable();
 
+   // Lets several sockets bind the same address and port, the kernel spreads incoming
+   // connections across the ones listening
+   void setReusePort();
+
    unsigned long getIPAddr();  // Gets IP in big endian (network) format
    void getIPAddrStr(std::string &buf); // The IP string associated with this socket
    unsigned short getPort();   // Port in little-endian (host) format
@@ -160,6 +194,9 @@ private:
 
    sockaddr_in _fd_addr;
 
+   bool _unix = false;
+   std::string _unix_path;
+
 };
 
 /********************************************************************************************
@@ -193,6 +230,9 @@ public:
 
    bool openFile(fd_file_type ftype, bool create = false);
 
+   // Reads the rest of the file into buf in as few reads as it takes (one, normally)
+   ssize_t readFile(std::vector<uint8_t> &buf);
+
 private:
    std::string _filename; 
 };
@@ -0,0 +1,67 @@
+#ifndef FRAMEPROTOCOL_H
+#define FRAMEPROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/********************************************************************************************
+ * Wire frames - everything sent on a connection between servers (handshake, replication
+ *               data and acks) is a frame with a fixed header, all fields in network byte
+ *               order:
+ *
+ *                  [uint8 version][uint8 type][uint8 header length][uint8 flags]
+ *                  [uint32 payload length][uint64 sequence][uint32 payload CRC32]
+ *                  [payload]
+ *
+ *               so a receiver knows how much to read from the header alone and never scans
+ *               for delimiters. A newer version may lengthen the header; older receivers skip
+ *               the fields they don't know using the header length, and ignore flags they
+ *               don't know, so servers can be upgraded one at a time.
+ *
+ *               Replication frames are numbered per connection by the sender; an ack carries
+ *               the sequence number of the frame it acks and no payload. Replication frames
+ *               and acks are sealed with AES-GCM (ff_sealed, see SessionCipher), with the
+ *               header as associated data, and the GCM tag takes the place of the CRC. An ack
+ *               seals an empty payload, so only the peer holding the session key can send one.
+ ********************************************************************************************/
+
+const uint8_t frame_version = 1;
+const size_t frame_header_size = 20;      // Version 1 header, the shortest accepted
+
+// Frames bigger than this are treated as a corrupt stream
+const uint32_t max_frame_payload = 64 * 1024 * 1024;
+
+enum frame_type : uint8_t {
+   ft_hello = 1,        // Handshake: client's challenge, SID and ticket (see Handshake.h)
+   ft_auth = 2,         // Handshake: server's challenge, proof, SID and ticket
+   ft_rep = 3,          // Replication payload
+   ft_ack = 4,          // Ack of the replication frame with this sequence number
+   ft_proof = 5         // Handshake: client's proof
+};
+
+enum frame_flags : uint8_t {
+   ff_sealed = 0x01     // Payload is [nonce][ciphertext][tag] and the CRC field is 0
+};
+
+struct FrameHeader {
+   uint8_t version = frame_version;
+   uint8_t type = 0;
+   uint8_t header_len = frame_header_size;
+   uint8_t flags = 0;
+   uint32_t length = 0;
+   uint64_t seq = 0;
+   uint32_t crc = 0;
+};
+
+// Writes the header into out (frame_header_size bytes)
+void packFrameHeader(const FrameHeader &hdr, uint8_t *out);
+
+// Reads a header from the start of buf. Returns 1 if a header was read, 0 if buf doesn't hold
+// a whole header yet, -1 if it isn't a valid header
+int parseFrameHeader(const uint8_t *buf, size_t len, FrameHeader &hdr);
+
+// CRC-32 (IEEE, as used by zlib/Ethernet). Pass the previous result as crc to continue a
+// checksum across several buffers
+uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc = 0);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <crypto++/secblock.h>
+
+// Each side's random challenge, and the proofs made over them (HMAC-SHA256)
+const size_t challenge_size = 16;
+const size_t proof_size = 32;
+
+/********************************************************************************************
+ * Handshake - opens a session in one round trip, with both sides proving they hold the
+ *             secret (the shared key, or a resumption ticket's secret - see ResumeTicket.h):
+ *
+ *                client -> server  ft_hello  [challenge][SID][ticket, may be empty]
+ *                server -> client  ft_auth   [flags][challenge][proof][SID][ticket]
+ *                client -> server  ft_proof  [proof]
+ *
+ *             The server answers the hello with its own challenge and its proof in one
+ *             message, and the client's session is open as soon as it has checked that proof
+ *             and sent its own - replication frames can follow right behind it. SIDs are
+ *             [uint8 length][bytes]; the ticket runs to the end of the message.
+ *
+ *             If the hello carried a ticket the server could open, the server resumes with the
+ *             ticket's secret (auth_resumed) rather than the shared key, and either way it
+ *             issues a ticket for the next session. Each proof is an HMAC, keyed with the
+ *             secret, over a label saying which side made it and the transcript (both
+ *             challenges and both SIDs), so a proof can't be replayed on another session,
+ *             reflected back to its sender or bound to another server.
+ ********************************************************************************************/
+
+// ft_auth flags
+const uint8_t auth_resumed = 0x01;     // Proved with the ticket's secret, not the shared key
+
+struct ClientHello {
+   std::vector<uint8_t> challenge;
+   std::string sid;
+   std::vector<uint8_t> ticket;
+};
+
+struct ServerAuth {
+   uint8_t flags = 0;
+   std::vector<uint8_t> challenge;
+   std::vector<uint8_t> proof;
+   std::string sid;
+   std::vector<uint8_t> ticket;
+};
+
+// Lay out or read the handshake messages. The parse functions return false if the message is
+// malformed
+void packClientHello(const ClientHello &hello, std::vector<uint8_t> &buf);
+bool parseClientHello(const std::vector<uint8_t> &buf, ClientHello &hello);
+void packServerAuth(const ServerAuth &auth, std::vector<uint8_t> &buf);
+bool parseServerAuth(const std::vector<uint8_t> &buf, ServerAuth &auth);
+
+// What the proofs cover
+void handshakeTranscript(const std::vector<uint8_t> &client_challenge,
+                         const std::vector<uint8_t> &server_challenge,
+                         const std::string &client_sid, const std::string &server_sid,
+                         std::vector<uint8_t> &transcript);
+
+// Makes or checks (in constant time) a proof_size proof. label says which side made it
+void handshakeProof(const CryptoPP::SecByteBlock &secret, const char *label,
+                    const std::vector<uint8_t> &transcript, uint8_t *proof);
+bool checkHandshakeProof(const CryptoPP::SecByteBlock &secret, const char *label,
+                         const std::vector<uint8_t> &transcript, const uint8_t *proof);
+
+// A string of up to 255 bytes as [uint8 length][bytes]. putShortString returns false if it's
+// too long, getShortString if it runs past the end of buf (pos is moved past it)
+bool putShortString(std::vector<uint8_t> &buf, const std::string &str);
+bool getShortString(const std::vector<uint8_t> &buf, size_t &pos, std::string &str);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include <stdint.h>
+#include <vector>
+#include <utility>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Submission queue size of each thread's ring (operations that can go in one submit)
+const unsigned int io_ring_entries = 256;
+
+/********************************************************************************************
+ * IoRing - An io_uring instance for one thread, driven through the raw syscalls (no
+ *          liburing). Callers queue a batch of socket recvs and writevs, and submitAndWait
+ *          hands them all to the kernel and collects every result with a single
+ *          io_uring_enter, instead of one syscall per operation.
+ *
+ *          epoll still says which sockets are ready (see EventLoop); the ring only replaces
+ *          the reads and writes that follow, so a pass over many connections costs one
+ *          syscall for all of their input and one for all of their output (see
+ *          TCPServer::handleConnections).
+ *
+ *          get returns nullptr where io_uring isn't available (an old kernel, a seccomp
+ *          filter) or has been turned off with setEnabled, and callers fall back to plain
+ *          syscalls.
+ ********************************************************************************************/
+
+class IoRing
+{
+public:
+   ~IoRing();
+
+   // The calling thread's ring, set up on first use, or nullptr if there isn't one
+   static IoRing *get();
+
+   // Turns the ring off (or on) for threads that haven't set theirs up yet
+   static void setEnabled(bool enabled);
+
+   // Operations are queued until submitAndWait, and what they point at must stay put until
+   // then. tag comes back with the result. Both return false if the submission queue is full
+   // (submit what's queued first)
+   bool queueRecv(int fd, void *buf, size_t len, uint64_t tag);
+   bool queueWritev(int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t tag);
+
+   // Submits everything queued and waits for all of it. results gets (tag, result) for each,
+   // result being bytes transferred or -errno
+   void submitAndWait(std::vector<std::pair<uint64_t, int>> &results);
+
+   bool hasQueued() { return _queued > 0; };
+
+private:
+   IoRing();
+   bool setup();
+   struct io_uring_sqe *nextSqe();
+
+   int _ring_fd = -1;
+
+   // Submission queue: the ring of indexes, and the entries they point at
+   void *_sq_ptr = nullptr;
+   size_t _sq_len = 0;
+   unsigned int *_sq_head = nullptr;
+   unsigned int *_sq_tail = nullptr;
+   unsigned int *_sq_mask = nullptr;
+   unsigned int *_sq_array = nullptr;
+   unsigned int _sq_entries = 0;
+   struct io_uring_sqe *_sqes = nullptr;
+   size_t _sqes_len = 0;
+
+   // Completion queue (shares the submission queue's mapping where the kernel allows)
+   void *_cq_ptr = nullptr;
+   size_t _cq_len = 0;
+   unsigned int *_cq_head = nullptr;
+   unsigned int *_cq_tail = nullptr;
+   unsigned int *_cq_mask = nullptr;
+   struct io_uring_cqe *_cqes = nullptr;
+
+   unsigned int _queued = 0;     // Queued but not yet submitted
+   unsigned int _inflight = 0;   // Submitted, result not yet collected
+};
+
+#endif
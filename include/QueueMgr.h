@@ -2,9 +2,48 @@
 #define QUEUEMGR_H
 
 #include <queue>
+#include <deque>
+#include <map>
+#include <set>
 #include <vector>
+#include <random>
 #include <crypto++/secblock.h>
 #include "TCPServer.h"
+#include "ConnReactor.h"
+#include "SharedBuffer.h"
+
+// Per-peer outbound queue limits (in memory). Payloads for a peer that is down or over its
+// limit are spilled to disk, up to max_spill_bytes, past which they are refused and the peer
+// recovers them through replication catch-up
+const size_t default_peer_queue_bytes = 4 * 1024 * 1024;
+const size_t default_peer_queue_msgs = 64;
+const size_t max_spill_bytes = 256 * 1024 * 1024;
+
+// Spill files are drained back into memory in reads this big
+const size_t spill_read_size = 1024 * 1024;
+
+// Pending payloads for the same peer are chained together up to this size (and this many
+// buffers, which all go out in one writev) before sending
+const size_t max_coalesce_bytes = 256 * 1024;
+const size_t max_coalesce_parts = 256;
+
+// Longest a sent payload may go unacked before the session is dropped and the payload resent
+const time_t send_timeout = 30;
+
+// Payloads sent on a session ahead of their acks
+const size_t max_inflight_sends = 8;
+
+// Longest a dialed connect may take to go through before it's abandoned
+const time_t dial_timeout = 5;
+
+// Redialing a peer after a failure waits dial_backoff_min_ms, doubling with each failure in a
+// row up to dial_backoff_max_ms (each wait jittered down by up to half). After
+// breaker_threshold failures in a row (most of a minute) the peer's circuit opens: it's only
+// probed every breaker_cooldown_ms until a session opens again
+const unsigned int dial_backoff_min_ms = 250;
+const unsigned int dial_backoff_max_ms = 5000;
+const unsigned int breaker_threshold = 12;
+const unsigned int breaker_cooldown_ms = 30000;
 
 /*******************************************************************************************
  * QueueMgr - Child class of the TCPServer object, manages a Queue for a middleware/app
@@ -17,9 +56,34 @@
  *            where they store their data until their data is moved into the queue for
  *            retrieval. 
  *            
- *            The pop function does two things. First, it "pops" (sends) incoming data to the
- *            management process and second, it assigns all outgoing data to a "Message
- *            Channel Agent", or TCPConn object.
+ *            The pop function "pops" (sends) incoming data to the management process.
+ *            Outgoing data is held in a bounded queue per peer, with pending payloads for the
+ *            same peer coalesced. Payloads are SharedBuffers, so a payload sent to every peer
+ *            is held once and coalescing chains buffers together rather than copying them.
+ *
+ *            Each peer has one long-lived, authenticated session (a TCPConn) that carries
+ *            frames both ways. The server with the lower SID dials it, the other accepts, so
+ *            there's only ever one per pair, and it's only re-dialed after a failure (resuming
+ *            with the ticket the peer issued on the last session, see ResumeTicket.h). Up to
+ *            max_inflight_sends payloads are sent ahead of their acks; a payload leaves its
+ *            queue once the peer acks it, and is resent on the next session if this one fails.
+ *            Dials never block: the connect finishes in the event loop, failures back off
+ *            exponentially (with jitter, so peers don't redial in lockstep), and a peer that
+ *            keeps failing has its circuit opened and is only probed now and then. Peers
+ *            given a Unix socket path in servers.txt are on this host and are dialed over it
+ *            instead of TCP; everything above the socket (handshake, frames) is the same.
+ *            Those also marked shm move their sessions onto a shared memory ring once the
+ *            socket connects (see ShmChannel), so a frame is copied straight into the peer.
+ *
+ *            While a peer is down, or its queue is full, its payloads are appended to a spill
+ *            file (<SID>spill.<peer SID>, [uint32 length][payload] records) and read back in
+ *            large sequential chunks once it is reachable again. Spill files survive a restart,
+ *            and one is only removed once the peer has acked everything read back from it.
+ *
+ *            With more than one network thread (setNetThreads), the extra threads are
+ *            ConnReactors listening on the same port. Each drives the connections it accepts
+ *            and a share of the ones we dial, and the thread running handleQueue drives the
+ *            rest and keeps the peer queues for all of them.
  *
  *******************************************************************************************/
 class QueueMgr : public TCPServer 
@@ -28,16 +92,27 @@ public:
    QueueMgr(unsigned int verbosity=1);
    virtual ~QueueMgr();
 
-   void handleQueue();
+   // Waits up to timeout_ms (-1 = no limit) for network activity, then services it
+   void handleQueue(int timeout_ms = 0);
 
    void populateQueue();
 
-   // Pops a received queue element off the queue
-   bool pop(std::string &sid, std::vector<uint8_t> &data);
+   // Pops a received queue element off the queue (a view of the frame it arrived in)
+   bool pop(std::string &sid, SharedBuffer &data);
+
+   // Loads replication information into the Queue to transmit to servers. Returns false
+   // (or the number of servers that took it) if a peer's queue is full and it was refused
+   unsigned int sendToAll(const SharedBuffer &data);
+   bool sendToServer(const char *server_id, const SharedBuffer &data);
 
-   // Loads replication information into the Queue to transmit to servers
-   void sendToAll(std::vector<uint8_t> &data);
-   void sendToServer(const char *server_id, std::vector<uint8_t> &data);
+   // Threads handling connections, including the one calling handleQueue. Set before bindSvr
+   void setNetThreads(unsigned int threads) { _net_threads = (threads > 0) ? threads : 1; };
+
+   // Backpressure - a peer is backed up when its queue and spill file are at their limits
+   void setQueueLimits(size_t max_bytes, size_t max_msgs);
+   bool isBackedUp(const char *server_id);
+   bool allBackedUp();
+   bool isPeerUp(const char *server_id);
    
    // Overload simply to remove this server from _server_list. Calls parent funct
    void bindSvr(const char *ip_addr, unsigned short port);
@@ -60,8 +135,23 @@ public:
 
 private:
 
-   // Launches a connection to the other server from queue data
-   void launchDataConn(const char *sid, std::vector<uint8_t> &data);
+   // Dials the session to another server, resuming with the ticket if there is one
+   TCPConn *launchSession(const char *sid, const ResumeTicket &ticket);
+
+   // Accepted connections answer the peer's SID with ours
+   void setupConn(TCPConn *conn);
+
+   // Sessions on other threads that opened since the last call, and cleanup of closed ones
+   void collectSessions();
+
+   // Opens sessions we dial and sends waiting payloads on them, then picks up sessions peers
+   // dialed, releases acked payloads and drops failed sessions
+   void servicePeers();
+   void reapPeerConns();
+   int getPeerTimeout(int timeout_ms);
+
+   // Picks up spill files left from the last run
+   void loadSpillFiles();
 
    // Loads server information from servers.txt
    int loadServerList(const char *filename);
@@ -70,20 +160,79 @@ private:
    enum qe_type {send, recv};
    struct queue_element {
 
-      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data)
-                  : type(in_type), server_id(in_sid), data(in_data) {}
+      queue_element(qe_type in_type, const char *in_sid, SharedBuffer in_data)
+                  : type(in_type), server_id(in_sid), data(std::move(in_data)) {}
 
       qe_type type;
       std::string server_id;
-      std::vector<uint8_t> data;
+      SharedBuffer data;
    };
 
    std::string _server_ID;
 
-   // The queue list
+   // The queue list (received data waiting to be popped)
    std::queue<queue_element> _queue;
 
+   // Outbound queue and accounting for each peer. Each pending entry is one send, made of
+   // one or more coalesced payloads
+   struct out_payload {
+      BufferChain parts;
+      size_t size = 0;
+   };
+   struct peer_queue {
+      std::deque<out_payload> pending;
+      size_t bytes = 0;
+      TCPConn *session = nullptr;      // In _connlist or _remote_conns, may be authenticating
+      size_t inflight = 0;             // The first inflight pending entries are sent, unacked
+      time_t progress = 0;             // Last send or ack while anything was in flight
+      unsigned long long retry = 0;    // Don't dial again before this (monotonic ms)
+      unsigned int failures = 0;       // Dials (or sessions) in a row that failed
+      ResumeTicket ticket;             // From the last session we dialed, to resume the next
+      bool up = true;
+      unsigned long sent = 0;          // Payloads acked
+      unsigned long refused = 0;       // Payloads refused by the limits
+
+      // Spill file - everything after the first spilled payload goes there, to keep the order
+      std::string spill_file;
+      size_t spill_bytes = 0;          // Unread bytes in the spill file
+      std::unique_ptr<FileFD> spill_out;
+      std::unique_ptr<FileFD> spill_in;
+      std::shared_ptr<const std::vector<uint8_t>> spill_buf;  // Last chunk read from the file,
+      size_t spill_pos = 0;                                    // queued up to spill_pos
+      size_t spill_unacked = 0;        // Payloads queued, up to the last read back, to ack
+      unsigned long spilled = 0;
+   };
+   std::map<std::string, peer_queue> _peers;
+   size_t _max_peer_bytes;
+   size_t _max_peer_msgs;
+
+   // Extra network threads, the sessions they drive that we know about, and the thread the
+   // next session we dial goes to (0 = ours)
+   unsigned int _net_threads = 1;
+   std::vector<std::unique_ptr<ConnReactor>> _reactors;
+   std::list<std::shared_ptr<TCPConn>> _remote_conns;
+   unsigned int _next_reactor = 0;
+
+   // Jitters the redial backoff
+   std::mt19937 _rng;
+
+   void setPeerUp(const std::string &sid, peer_queue &peer, bool up);
+   bool dialsPeer(const std::string &sid) { return _server_ID < sid; };
+   void dropSession(const std::string &sid, peer_queue &peer);
+   void scheduleRedial(const std::string &sid, peer_queue &peer);
+   bool hasRoom(peer_queue &peer, size_t size);
+   bool canCoalesce(peer_queue &peer, size_t size);
+   void queuePayload(peer_queue &peer, const SharedBuffer &data);
+   bool spillPayload(const std::string &sid, peer_queue &peer, const SharedBuffer &data);
+   void drainSpill(const std::string &sid, peer_queue &peer);
+   void closeSpill(peer_queue &peer, bool remove);
+
    std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;  
+
+   // Unix socket paths of the servers (ours included) that listen on one, by SID, and the
+   // ones whose sessions go over shared memory
+   std::map<std::string, std::string> _unix_paths;
+   std::set<std::string> _shm_peers;
 };
 
 
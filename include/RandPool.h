@@ -0,0 +1,29 @@
+#ifndef RANDPOOL_H
+#define RANDPOOL_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// How many bytes each thread's pool draws from its generator at a time
+const size_t rand_pool_size = 4096;
+
+/********************************************************************************************
+ * Random bytes for challenges, nonces and IVs - every thread has its own Crypto++
+ *             AutoSeededRandomPool (seeded from the OS once, the first time the thread asks
+ *             for bytes) and a rand_pool_size buffer of its output. Requests are served out of
+ *             the buffer, which is refilled in one call to the generator when it runs dry, so
+ *             a handshake's challenge or a cipher's nonce prefix is a memcpy rather than a
+ *             trip to the OS or a fresh generator.
+ *
+ *             Nothing is shared between threads, so there are no locks, and each byte is
+ *             handed out once and wiped from the buffer as it goes.
+ ********************************************************************************************/
+
+// Fills dest with len cryptographically random bytes
+void randomBytes(uint8_t *dest, size_t len);
+
+// Replaces dest's contents with len random bytes
+void randomBytes(std::vector<uint8_t> &dest, size_t len);
+
+#endif
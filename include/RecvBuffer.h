@@ -0,0 +1,67 @@
+#ifndef RECVBUFFER_H
+#define RECVBUFFER_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include "SharedBuffer.h"
+
+// Size of each receive chunk, and the least free space we'll read into
+const size_t recv_chunk_size = 256 * 1024;
+const size_t min_recv_space = 16 * 1024;
+
+/********************************************************************************************
+ * RecvBuffer - Per-connection receive buffer. The socket is read straight into the free
+ *              space at the end of the current chunk, and the parser walks the unread bytes
+ *              in place. A complete frame is handed out as a SharedBuffer view of the chunk
+ *              it arrived in, so nothing is copied on the way to the consumer.
+ *
+ *              When the chunk runs out of room, only the unread tail (a partial frame) is
+ *              moved into a fresh chunk; the old one lives on as long as frames handed out
+ *              from it do. If no frame was ever handed out from the chunk, the tail is just
+ *              moved to the front instead. Bytes that have been shared are never written
+ *              again, since other threads may be reading them without any synchronization.
+ *              reserve() sizes the next chunk for a large frame once its header says how big
+ *              it is, so it's received contiguously in one place.
+ *
+ *              Unlike a true ring, a frame never wraps around the end of the buffer, which is
+ *              what lets it be shared without being copied out first.
+ ********************************************************************************************/
+
+class RecvBuffer
+{
+public:
+   RecvBuffer(size_t chunk_size = recv_chunk_size);
+
+   // Unread bytes
+   const uint8_t *data() const { return _chunk->data() + _rpos; };
+   size_t size() const { return _wpos - _rpos; };
+   bool empty() const { return _wpos == _rpos; };
+
+   // Unread bytes, to be changed in place (decrypted, say) before any of them are shared
+   uint8_t *mutableData() { return _chunk->data() + _rpos; };
+
+   // Free space to read into, at least min_recv_space. commit() adds what was read
+   uint8_t *space();
+   size_t spaceSize() const { return _chunk->size() - _wpos; };
+   void commit(size_t len) { _wpos += len; };
+
+   // Drops len unread bytes from the front
+   void consume(size_t len);
+
+   // A shared view of len unread bytes starting offset bytes in
+   SharedBuffer share(size_t offset, size_t len);
+
+   // Makes sure the unread bytes plus whatever follows up to need bytes in total will sit
+   // contiguously in one chunk
+   void reserve(size_t need);
+
+private:
+   std::shared_ptr<std::vector<uint8_t>> _chunk;
+   size_t _rpos;
+   size_t _wpos;
+   size_t _chunk_size;
+   bool _shared;        // Views of this chunk have been handed out
+};
+
+#endif
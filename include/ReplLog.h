@@ -0,0 +1,56 @@
+#ifndef REPLLOG_H
+#define REPLLOG_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "DronePlotDB.h"
+
+/********************************************************************************************
+ * ReplLog - sequence log of the plots this server originated, used for per-peer incremental
+ *           catch-up. Each local plot gets the next sequence number (starting at 1) and is
+ *           appended to a journal file, and each peer's "acked up to" watermark is kept in a
+ *           state file, so after a restart a peer is resent only what it never acknowledged.
+ *
+ *           Files are <SID>repl.journal (serialized plots, the seq is the position) and
+ *           <SID>repl.state (one "<peer sid>,<acked seq>" line per peer)
+ ********************************************************************************************/
+class ReplLog
+{
+public:
+   ReplLog();
+   ~ReplLog();
+
+   // Loads the journal and watermarks for this server, creating them if needed
+   void open(const char *sid);
+
+   // Adds a plot to the log, returns its sequence number. Written to disk by flush()
+   uint64_t append(DronePlot &plot);
+   void flush();
+
+   // Sequence number of the newest plot (0 if none)
+   uint64_t getHead() { return _plots.size(); };
+
+   // Copies up to max plots starting at seq from, returns how many were copied
+   unsigned int getRange(uint64_t from, unsigned int max, std::vector<DronePlot> &plots);
+
+   // All plots up through seq upto have been received by peer. Persisted right away
+   void ack(const std::string &peer, uint64_t upto);
+   uint64_t getAcked(const std::string &peer);
+
+   // Journal contents, so callers can rebuild any per-plot state after a restart
+   std::vector<DronePlot> &getPlots() { return _plots; };
+
+private:
+   void saveState();
+
+   std::string _journal_file;
+   std::string _state_file;
+
+   std::vector<DronePlot> _plots;          // _plots[seq-1]
+   size_t _flushed;                        // Plots already written to the journal
+   std::map<std::string, uint64_t> _acked;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef REPLPROTOCOL_H
+#define REPLPROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/********************************************************************************************
+ * Replication messages - a replication payload handed to the QueueMgr is a sequence of one
+ *                        or more messages, each laid out as:
+ *
+ *                           [uint32 length][uint8 type][body, length-1 bytes]
+ *
+ *                        so payloads bound for the same server can simply be concatenated.
+ ********************************************************************************************/
+
+enum repl_msg_type : uint8_t {
+   rm_plots = 1,        // [uint32 count][count serialized DronePlots]
+   rm_ae_digest = 2,    // anti-entropy: Merkle node hashes (see AntiEntropy)
+   rm_ae_request = 3,   // anti-entropy: nodes/buckets the receiver wants expanded
+   rm_seq_plots = 4,    // [uint64 first seq][uint64 sender head seq][uint32 count][plots]
+   rm_ack = 5,          // [uint64 seq] - have every plot from you up through seq
+   rm_catchup_req = 6,  // [uint64 seq] - resend your plots starting at seq
+   rm_gossip = 7        // [uint8 ttl][uint8 origin len][origin SID][rm_seq_plots body]
+};
+
+// Adds one message to the end of buf
+void appendReplMsg(std::vector<uint8_t> &buf, uint8_t type, const uint8_t *body, size_t len);
+void appendReplMsg(std::vector<uint8_t> &buf, uint8_t type, const std::vector<uint8_t> &body);
+
+// Walks the messages in the size bytes at buf starting at pos. Returns false at the end of
+// buf, throws runtime_error if a message runs past the end
+bool nextReplMsg(const uint8_t *buf, size_t size, size_t &pos, uint8_t &type,
+                                                  const uint8_t *&body, size_t &len);
+
+// Little helpers to pack/unpack fixed-size fields in message bodies (host byte order, as
+// with the serialized plots)
+template <typename T>
+void packField(std::vector<uint8_t> &buf, T val) {
+   const uint8_t *ptr = (const uint8_t *) &val;
+   buf.insert(buf.end(), ptr, ptr + sizeof(T));
+}
+
+template <typename T>
+T unpackField(const uint8_t *ptr) {
+   T val;
+   for (unsigned int i=0; i<sizeof(T); i++)
+      ((uint8_t *) &val)[i] = ptr[i];
+   return val;
+}
+
+#endif
@@ -3,9 +3,29 @@
 
 #include <map>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <random>
 #include "QueueMgr.h"
 #include "DronePlotDB.h"
 #include "Deduplicate.h"
+#include "EventLoop.h"
+#include "SPSCRing.h"
+#include "AntiEntropy.h"
+#include "ReplLog.h"
+
+// Streaming mode defaults - a micro-batch goes out once it is this old or this big
+const unsigned int default_stream_delay_ms = 100;
+const unsigned int default_stream_batch = 256;
+
+// Slots in each of the rings between the replication stages
+const size_t stage_ring_size = 256;
+
+// Most plots resent in answer to one catch-up request, the receiver asks for the next window
+const unsigned int catchup_window = 1024;
+
+// Gossip mode default - peers each batch is pushed to (per round)
+const unsigned int default_gossip_fanout = 3;
 
 /***************************************************************************************
  * ReplServer - class that manages replication between servers. The data is automatically
@@ -14,6 +34,25 @@
  *              the communications. This object simply runs management loops and should
  *              do deconfliction of nodes
  *
+ *              Replication runs as a pipeline of three threads connected by lock-free
+ *              single-producer/single-consumer rings, each sleeping on its own EventLoop:
+ *                 network - QueueMgr socket I/O, handshakes and acks
+ *                 decode  - validates and deserializes received replication data
+ *                 apply   - (the replicate thread) DB writes, dedup, queueing new plots
+ *
+ *              Each server only sends the plots it originated, numbered by a local sequence
+ *              (see ReplLog). Receivers acknowledge the highest contiguous sequence they hold
+ *              and pull any gap with a catch-up request, so a reconnecting or restarted peer
+ *              gets exactly the range it missed. Anti-entropy (see AntiEntropy) periodically
+ *              compares Merkle roots with each peer and resends the plots in any time buckets
+ *              that have diverged
+ *
+ *              By default every batch goes to every server (full mesh). In gossip mode each
+ *              round picks a few random peers and all batches go only to them; a server
+ *              forwards a batch the first time it sees it (by origin and sequence number)
+ *              until its TTL runs out, so per-server network cost stays bounded as the cluster
+ *              grows
+ *
  ***************************************************************************************/
 class ReplServer 
 {
@@ -34,13 +73,99 @@ public:
    // attempts to check "simulator time" should use this function
    double getAdjustedTime();
 
+   // How close two plots of the same drone must be to be considered duplicates
+   void setDedupTolerances(time_t time_tol, float latlon_tol);
 
-private:
+   // repl_batch sends new plots every secs_between_repl (sim time). repl_stream pushes them
+   // as they arrive in micro-batches bounded by max_delay_ms (real time) and max_batch plots
+   enum repl_mode { repl_batch, repl_stream };
+   void setReplMode(repl_mode mode, unsigned int max_delay_ms = default_stream_delay_ms,
+                                    unsigned int max_batch = default_stream_batch);
+
+   // fanout > 0 switches to gossip dissemination. ttl is how many hops a batch travels
+   // (0 = pick one from the cluster size)
+   void setGossip(unsigned int fanout, unsigned int ttl = 0);
+
+   // Threads handling peer connections (see QueueMgr::setNetThreads). Set before replicate
+   void setNetThreads(unsigned int threads) { _queue.setNetThreads(threads); };
 
-   void addReplDronePlots(std::vector<uint8_t> &data);
-   void addSingleDronePlot(std::vector<uint8_t> &data);
 
-   unsigned int queueNewPlots();
+private:
+
+   // Items passed between the stages. Outgoing, an empty sid goes to all servers, which share
+   // its buffer; incoming, data is a view of the frame it arrived in
+   struct ReplMsg {
+      std::string sid;
+      SharedBuffer data;
+   };
+   struct PlotRun {
+      std::string origin;     // Server that created these plots
+      uint64_t first_seq;     // Origin's sequence number of plots[start] (0 = unsequenced)
+      uint64_t head;          // Origin's newest sequence number when it sent this
+      size_t start;
+      size_t count;
+      bool gossip;
+      std::vector<uint8_t> forward;   // Gossip message to pass on (empty = TTL ran out)
+   };
+   struct PlotBatch {
+      std::string sid;
+      std::vector<DronePlot> plots;
+      std::vector<PlotRun> runs;
+      std::vector<std::pair<uint8_t, std::vector<uint8_t>>> ctl_msgs;   // (type, body)
+   };
+
+   // What we've received from each peer, by that peer's sequence numbers
+   struct PeerCursor {
+      uint64_t recv_upto = 0;       // Every plot through here has been received
+      uint64_t head = 0;            // Newest seq the peer has told us about
+      uint64_t acked_sent = 0;      // Last watermark we acknowledged
+      uint64_t catchup_from = 0;    // Outstanding catch-up request (0 = none)
+      double catchup_time = 0.0;
+      double gap_since = -1.0;      // When we first saw we were behind (-1 = not behind)
+   };
+
+   // Stage loops
+   void networkStage();
+   void decodeStage();
+   void applyStage();
+
+   void decodeReplData(const SharedBuffer &data, PlotBatch &batch);
+   void decodePlots(const uint8_t *body, size_t len, std::vector<DronePlot> &plots);
+   void decodeSeqPlots(const uint8_t *body, size_t len, const std::string &origin,
+                                                                        PlotBatch &batch);
+   void decodeGossip(const uint8_t *body, size_t len, PlotBatch &batch);
+   void addReplDronePlots(PlotBatch &batch);
+   void addSingleDronePlot(DronePlot &plot);
+
+   unsigned int queueNewPlots(unsigned int max_plots = 0);
+
+   // Per-peer catch-up - tracks the sequence watermarks and requests/resends missing ranges
+   void updateCursor(PlotRun &run);
+   void requestCatchup(const std::string &origin, PeerCursor &cursor);
+   void queueCatchup(const std::string &sid, uint64_t from);
+   void queueAcks();
+
+   // Gossip - picks this round's peers, sends to them, and tracks which batches we've seen
+   void pickGossipTargets();
+   void queueGossip(std::vector<uint8_t> &payload, const std::string &skip1 = "",
+                                                   const std::string &skip2 = "");
+   bool markGossipSeen(PlotRun &run);
+   void pruneGossipSeen();
+
+   // Control messages (anti-entropy, acks, catch-up requests) from a peer
+   void handleControl(PlotBatch &batch);
+   void queueRootDigest();
+   bool queueOut(const std::string &sid, std::vector<uint8_t> &data);
+   bool queueOut(const std::string &sid, const SharedBuffer &data);
+
+   // Streaming mode - counts newly added plots and flushes a micro-batch when it's due
+   void streamNewPlots(uint64_t new_plots);
+
+   // Milliseconds (real time) until the next periodic replication, anti-entropy round or
+   // micro-batch is due
+   int msUntilSimTime(double sim_time);
+   int msUntilStreamFlush();
+   static unsigned long long getMonoMs();
 
 
    QueueMgr _queue;    
@@ -48,7 +173,33 @@ private:
    // Holds our drone plot information
    DronePlotDB &_plotdb;
 
-   bool _shutdown;
+   std::atomic<bool> _shutdown;
+
+   // Pipeline stages: network -> _rx_raw -> decode -> _rx_plots -> apply -> _tx_out -> network
+   std::thread _net_thread;
+   std::thread _decode_thread;
+   EventLoop _decode_loop;
+   EventLoop _apply_loop;
+   EventFD _newplot_fd;         // Signaled by DronePlotDB for each new plot
+   SPSCRing<ReplMsg> _rx_raw;
+   SPSCRing<PlotBatch> _rx_plots;
+   SPSCRing<ReplMsg> _tx_out;
+
+   // Merkle trees of our plots and what we've received from each peer (apply stage only)
+   AntiEntropy _ae;
+
+   // Sequence log of our plots with each peer's acked watermark, and our receive cursors
+   ReplLog _repl_log;
+   std::map<std::string, PeerCursor> _cursors;
+
+   // Gossip settings (_gossip_fanout 0 = full mesh), this round's shuffled peers, and the batches
+   // already seen as (origin, first seq) -> plot count
+   unsigned int _gossip_fanout;
+   unsigned int _gossip_ttl;
+   std::vector<std::string> _peer_ids;
+   std::vector<std::string> _gossip_targets;
+   std::map<std::pair<std::string, uint64_t>, size_t> _gossip_seen;
+   std::mt19937 _rng;
 
    // How fast to run the system clock - 1.0 = normal speed, 2.0 = 2x as fast
    float _time_mult;
@@ -58,6 +209,15 @@ private:
 
    // When the last replication happened so we can know when to do another one
    time_t _last_repl;
+   time_t _last_ae;
+
+   // Streaming mode settings and the micro-batch being built (times are monotonic ms)
+   repl_mode _repl_mode;
+   unsigned int _max_delay_ms;
+   unsigned int _max_batch;
+   uint64_t _pending_new;
+   unsigned long long _pending_since;
+   unsigned long long _last_flush;
 
    // How much to spam stdout with server status
    unsigned int _verbosity;
@@ -72,7 +232,6 @@ private:
    unsigned int mySID; // SID of this server 
    unsigned int _leader; // SID of the leader 
    Deduplicate _dedup; // object to handle dedup
-   int sentInfo = 0; // check to see if sent info to Dedup
    unsigned int _numServers; // number of servers in scenario
 };
 
@@ -0,0 +1,56 @@
+#ifndef RESUMETICKET_H
+#define RESUMETICKET_H
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <cstdint>
+#include <crypto++/secblock.h>
+
+// How long a ticket can be used to resume after it's issued
+const time_t ticket_lifetime = 24 * 60 * 60;
+
+// Secret a ticket carries
+const size_t resume_secret_size = 32;
+
+/********************************************************************************************
+ * Resumption tickets - lets a dialer that has had a session with a peer open the next one
+ *                      without the full challenge-response handshake.
+ *
+ *                      At the end of every handshake both sides derive a resumption secret
+ *                      from the session's secret and challenges. The acceptor seals it, with
+ *                      both SIDs and an expiry time, into a ticket under a key derived from
+ *                      the shared key, and sends the ticket to the dialer, which keeps it with
+ *                      its own copy of the secret. The acceptor keeps nothing: any server with
+ *                      the shared key can open the ticket, so it doesn't matter which thread
+ *                      (or process, after a restart) the next connection lands on.
+ *
+ *                      To resume, the dialer sends the ticket in its hello (see Handshake.h).
+ *                      If the acceptor can open it, both sides prove themselves with the
+ *                      resumption secret, and the session's keys come from it and the fresh
+ *                      challenges rather than from the shared key. If not, the acceptor just
+ *                      uses the shared key, so a stale ticket costs nothing.
+ ********************************************************************************************/
+
+// The dialer's copy of a ticket - the sealed ticket to present, and the secret in it
+struct ResumeTicket {
+   std::vector<uint8_t> blob;
+   CryptoPP::SecByteBlock secret;
+
+   bool empty() const { return blob.empty(); };
+};
+
+// Derives the resumption secret for a session from its secret (the shared key, or the
+// ticket's secret if it was resumed) and its challenges
+void deriveResumeSecret(const CryptoPP::SecByteBlock &session_secret, const uint8_t *salt,
+                        size_t salt_len, CryptoPP::SecByteBlock &secret);
+
+// Seals a ticket for the dialer, or opens one it presented. openTicket returns false if the
+// ticket wasn't sealed with this shared key, was changed or has expired
+void sealTicket(const CryptoPP::SecByteBlock &shared_key, const CryptoPP::SecByteBlock &secret,
+                const std::string &dialer, const std::string &acceptor,
+                std::vector<uint8_t> &blob);
+bool openTicket(const CryptoPP::SecByteBlock &shared_key, const std::vector<uint8_t> &blob,
+                std::string &dialer, std::string &acceptor, CryptoPP::SecByteBlock &secret);
+
+#endif
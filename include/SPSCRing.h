@@ -0,0 +1,73 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <vector>
+#include <utility>
+
+/********************************************************************************************
+ * SPSCRing - Bounded lock-free ring buffer for handing items from exactly one producer
+ *            thread to exactly one consumer thread. Capacity is rounded up to a power of two.
+ *            push/pop never block; they return false when the ring is full/empty and the
+ *            caller decides whether to wait (usually on an EventLoop wakeup).
+ *
+ *            The head index is only written by the consumer and the tail only by the
+ *            producer, so each side just needs acquire/release on the other side's index.
+ ********************************************************************************************/
+
+template <typename T>
+class SPSCRing
+{
+public:
+   SPSCRing(size_t capacity):_head(0), _tail(0) {
+      size_t size = 1;
+      while (size < capacity)
+         size <<= 1;
+      _slots.resize(size);
+      _mask = size - 1;
+   }
+
+   // Producer only - moves the item into the ring, false if the ring is full
+   bool push(T &&item) {
+      size_t tail = _tail.load(std::memory_order_relaxed);
+      if (tail - _head.load(std::memory_order_acquire) > _mask)
+         return false;
+
+      _slots[tail & _mask] = std::move(item);
+      _tail.store(tail + 1, std::memory_order_release);
+      return true;
+   }
+
+   bool push(const T &item) {
+      T copy(item);
+      return push(std::move(copy));
+   }
+
+   // Consumer only - moves the oldest item out into item, false if the ring is empty
+   bool pop(T &item) {
+      size_t head = _head.load(std::memory_order_relaxed);
+      if (head == _tail.load(std::memory_order_acquire))
+         return false;
+
+      item = std::move(_slots[head & _mask]);
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+   }
+
+   // Approximate when called from the other side, exact from the owning side
+   size_t size() const { return _tail.load(std::memory_order_acquire) - 
+                                _head.load(std::memory_order_acquire); };
+   bool empty() const { return size() == 0; };
+   bool full() const { return size() > _mask; };
+   size_t capacity() const { return _mask + 1; };
+
+private:
+   std::vector<T> _slots;
+   size_t _mask;
+
+   // Kept on separate cache lines so the two threads don't fight over them
+   alignas(64) std::atomic<size_t> _head;   // next slot to pop (consumer)
+   alignas(64) std::atomic<size_t> _tail;   // next slot to push (producer)
+};
+
+#endif
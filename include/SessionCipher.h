@@ -0,0 +1,87 @@
+#ifndef SESSIONCIPHER_H
+#define SESSIONCIPHER_H
+
+#include <vector>
+#include <cstdint>
+#include <crypto++/aes.h>
+#include <crypto++/gcm.h>
+#include "SharedBuffer.h"
+
+// A sealed message is [nonce][ciphertext][tag]: the ciphertext is the same length as the
+// plaintext, so sealing adds seal_overhead bytes
+const size_t seal_iv_size = 12;
+const size_t seal_tag_size = 16;
+const size_t seal_overhead = seal_iv_size + seal_tag_size;
+
+// Size of the AES keys derived for each session
+const size_t session_key_size = 16;
+
+/********************************************************************************************
+ * SessionCipher - AES-GCM for one connection. The key schedule (and GCM's multiplication
+ *                 table) is expanded once in setKey and reused for every message after, and
+ *                 messages are encrypted and decrypted in place in the caller's buffer, so
+ *                 sealing a frame costs one pass over it (Crypto++ uses AES-NI and carry-less
+ *                 multiply for it where the CPU has them).
+ *
+ *                 The tag authenticates the message and any associated data (a frame header,
+ *                 say) that travels with it in the clear; a message that was changed, or
+ *                 moved under another header, fails to open.
+ *
+ *                 The handshake runs under the shared key (setKey). Once it's done, each side
+ *                 switches to keys derived for the session alone (deriveSessionKeys), one per
+ *                 direction, so no two sessions - and no two directions of one - ever encrypt
+ *                 under the same key, and a frame can't be reflected back at its sender.
+ *
+ *                 Nonces are a random 8-byte prefix, drawn when the key is set, followed by a
+ *                 4-byte message counter, so they never repeat within a cipher and (with the
+ *                 random prefix) practically never across ciphers sharing a key. A new prefix
+ *                 is drawn if the counter wraps. The nonce goes out with the message, so the
+ *                 receiver doesn't need to know the scheme.
+ *
+ *                 Not thread-safe: each connection's cipher is used by the thread driving it.
+ ********************************************************************************************/
+
+class SessionCipher
+{
+public:
+   SessionCipher();
+
+   // Expands the key schedule that every seal and open after uses
+   void setKey(const uint8_t *key, size_t len);
+   void setKeys(const uint8_t *send_key, const uint8_t *recv_key, size_t len);
+
+   // Derives this session's keys (HKDF-SHA256) from the shared secret and the salt (the
+   // handshake's challenges), and keys each direction with them. The dialer sends with the
+   // key the other side receives with, and vice versa
+   void deriveSessionKeys(const uint8_t *secret, size_t secret_len, const uint8_t *salt,
+                          size_t salt_len, bool dialer);
+
+   // In place: buf holds seal_iv_size bytes of room, then len bytes of plaintext, then
+   // seal_tag_size bytes of room
+   void seal(uint8_t *buf, size_t len, const uint8_t *aad = nullptr, size_t aad_len = 0);
+
+   // Seals a chain of buffers into out (which holds the payload's length plus seal_overhead),
+   // reading each buffer once and leaving it as it was
+   void seal(uint8_t *out, const BufferChain &payload, const uint8_t *aad = nullptr,
+             size_t aad_len = 0);
+
+   // In place: buf holds a sealed message len bytes long. If it's authentic, the plaintext is
+   // left at buf + seal_iv_size (len - seal_overhead bytes) and it returns true
+   bool open(uint8_t *buf, size_t len, const uint8_t *aad = nullptr, size_t aad_len = 0);
+
+   // Seals or opens the whole vector, which ends up as the sealed message or the plaintext
+   void seal(std::vector<uint8_t> &buf);
+   bool open(std::vector<uint8_t> &buf);
+
+private:
+   void nextNonce(uint8_t *nonce);
+   void newPrefix();
+
+   CryptoPP::GCM<CryptoPP::AES>::Encryption _enc;
+   CryptoPP::GCM<CryptoPP::AES>::Decryption _dec;
+
+   uint8_t _prefix[8];
+   uint32_t _counter;
+};
+
+#endif
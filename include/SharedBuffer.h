@@ -0,0 +1,72 @@
+#ifndef SHAREDBUFFER_H
+#define SHAREDBUFFER_H
+
+#include <memory>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+
+/********************************************************************************************
+ * SharedBuffer - Refcounted, immutable view of a byte buffer. Copying a SharedBuffer or
+ *                taking a slice of it shares the underlying bytes instead of copying them,
+ *                so one payload can sit in every peer's outbound queue (and be coalesced
+ *                with others as a chain of slices) while only existing once in memory. The
+ *                bytes are freed when the last view of them goes away.
+ *
+ *                Since the bytes can't change once wrapped, views can be handed between
+ *                threads freely.
+ ********************************************************************************************/
+
+class SharedBuffer
+{
+public:
+   SharedBuffer():_offset(0), _length(0) {}
+
+   // Takes over the vector's contents, leaving it empty
+   explicit SharedBuffer(std::vector<uint8_t> &&data):
+                  _buf(std::make_shared<const std::vector<uint8_t>>(std::move(data))),
+                  _offset(0) {
+      _length = _buf->size();
+   }
+
+   // A view of len bytes at offset into an already-shared buffer
+   SharedBuffer(std::shared_ptr<const std::vector<uint8_t>> buf, size_t offset, size_t len):
+                  _buf(std::move(buf)), _offset(offset), _length(len) {
+      if (!_buf || (offset + len > _buf->size()))
+         throw std::out_of_range("SharedBuffer view past the end of its buffer.");
+   }
+
+   const uint8_t *data() const { return (_length > 0) ? _buf->data() + _offset : nullptr; };
+   size_t size() const { return _length; };
+   bool empty() const { return _length == 0; };
+
+   /*****************************************************************************************
+    * slice - a view of len bytes starting at offset within this view, sharing the bytes
+    *
+    *    Throws: out_of_range if the slice runs past the end of this view
+    *****************************************************************************************/
+   SharedBuffer slice(size_t offset, size_t len) const {
+      if (offset + len > _length)
+         throw std::out_of_range("SharedBuffer slice past the end of the view.");
+      if (len == 0)
+         return SharedBuffer();
+      return SharedBuffer(_buf, _offset + offset, len);
+   }
+
+private:
+   std::shared_ptr<const std::vector<uint8_t>> _buf;
+   size_t _offset;
+   size_t _length;
+};
+
+// A payload made of several views, sent back to back (with writev) without joining them
+typedef std::vector<SharedBuffer> BufferChain;
+
+inline size_t chainSize(const BufferChain &chain) {
+   size_t size = 0;
+   for (auto &part : chain)
+      size += part.size();
+   return size;
+}
+
+#endif
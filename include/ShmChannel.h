@@ -0,0 +1,80 @@
+#ifndef SHMCHANNEL_H
+#define SHMCHANNEL_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+#include "EventLoop.h"
+
+// Bytes each direction of a shared memory channel holds (a power of two)
+const size_t shm_ring_size = 4 * 1024 * 1024;
+
+// What the dialer sends on the socket, with the channel's FDs attached, to switch to it
+const char shm_offer[] = "REPLSHM1";
+const size_t shm_offer_size = sizeof(shm_offer) - 1;
+
+/********************************************************************************************
+ * ShmChannel - A byte pipe between two processes on the same host, for a connection to use
+ *              instead of its socket. A memfd holds two lock-free single-producer/
+ *              single-consumer byte rings, one each way, and each side has an eventfd the
+ *              other signals when it has written to it, or made room it was waiting for.
+ *
+ *              The dialer creates the channel and passes the memfd and both eventfds to the
+ *              acceptor over their Unix socket (SCM_RIGHTS, see TCPConn::offerSharedMemory).
+ *              From then on the connection's bytes (the handshake and sealed frames, exactly
+ *              as they'd go on the socket) are copied straight into the peer's memory and
+ *              out of it, without a trip through the kernel. Only the eventfd signals are
+ *              syscalls, and the socket is left open only so each side notices the other
+ *              going away.
+ *
+ *              As with SPSCRing, each index is only written by one side, so each just needs
+ *              acquire/release on the other's. A writer that finds its ring full flags it,
+ *              and the reader signals it once it makes room.
+ ********************************************************************************************/
+
+class ShmChannel
+{
+public:
+   ~ShmChannel();
+
+   // Dialer - creates the memfd and eventfds. The FDs to send the acceptor go in fds
+   static std::unique_ptr<ShmChannel> create(int fds[3]);
+
+   // Acceptor - maps the channel the dialer sent (takes over the FDs, closing them if it
+   // can't). nullptr if they aren't a channel this version understands
+   static std::unique_ptr<ShmChannel> attach(const int fds[3]);
+
+   // Copies as much of the buffers as fits into the peer's ring, and signals it. Returns the
+   // bytes written, less than asked if the ring filled (we're signaled when it empties)
+   size_t write(const struct iovec *iov, int iovcnt);
+
+   // Copies up to len bytes of what the peer wrote into buf. Returns the bytes read (0 if
+   // there was nothing), or -1 if the peer left the ring in a state it can't be in
+   ssize_t read(uint8_t *buf, size_t len);
+
+   // The eventfd the peer signals us on (register it with the event loop), and clearing it
+   int getWaitFD() { return _wait->getFD(); };
+   void drainWakeups() { _wait->drain(); };
+
+private:
+   struct ring_ctl;
+
+   ShmChannel();
+   bool map(int memfd);
+
+   int _memfd = -1;
+   void *_map = nullptr;
+   size_t _map_len = 0;
+
+   ring_ctl *_tx = nullptr;
+   ring_ctl *_rx = nullptr;
+   uint8_t *_tx_data = nullptr;
+   uint8_t *_rx_data = nullptr;
+
+   std::unique_ptr<EventFD> _wait;     // Signaled by the peer
+   std::unique_ptr<EventFD> _peer;     // We signal the peer
+};
+
+#endif
@@ -1,14 +1,39 @@
 #ifndef TCPCONN_H
 #define TCPCONN_H
 
+#include <deque>
+#include <atomic>
 #include <crypto++/secblock.h>
 #include "FileDesc.h"
 #include "LogMgr.h"
+#include "SharedBuffer.h"
+#include "FrameProtocol.h"
+#include "RecvBuffer.h"
+#include "SPSCRing.h"
+#include "EventLoop.h"
+#include "SessionCipher.h"
+#include "ResumeTicket.h"
+#include "Handshake.h"
+#include "ShmChannel.h"
 
 const int max_attempts = 2;
 
+// Received frames a session hands to the queue manager, and payloads the queue manager hands
+// to the session, that can wait for the other side to take them
+const size_t rx_frame_ring_size = 1024;
+const size_t tx_payload_ring_size = 64;
+
 // Methods and attributes to manage a network connection, including tracking the username
 // and a buffer for user input. Status tracks what "phase" of login the user is currently in
+//
+// The connection is driven by the thread whose event loop watches its socket (see
+// ConnReactor), which may not be the queue manager's. The queue manager only touches it
+// through the session calls (isSession, sendPayload, takeAcks, the input data calls and
+// requestClose), which go through lock-free rings and atomics so they're safe from either
+//
+// Between servers on the same host, the dialer can move the connection off its Unix socket
+// onto a shared memory channel as soon as it connects (see ShmChannel). Only where the bytes
+// go changes; the handshake and frames are the same either way
 class TCPConn 
 {
 public:
@@ -16,8 +41,14 @@ public:
    ~TCPConn();
 
    // The current status of the connection
-   // Voltz add states for proper authentication (s_schallenge, s_cproof, s_scheck, s_cchallenge, s_sproof, s_ccheck)
-   enum statustype { s_none, s_connecting, s_connected, s_datatx, s_datarx, s_waitack, s_hasdata, s_schallenge, s_cproof, s_scheck, s_cchallenge, s_sproof, s_ccheck };
+   // The client's connect doesn't block: it waits in s_dialing for the socket to turn
+   // writable. The handshake (see Handshake.h) then takes one round trip: the client sends its
+   // hello (s_connecting) and waits for the server's answer (s_waitauth); the server waits for
+   // the hello (s_waithello) and then the client's proof (s_waitproof). Once both sides have
+   // authenticated the connection stays in s_session, carrying replication frames and acks in
+   // both directions until it fails
+   enum statustype { s_none, s_dialing, s_connecting, s_waitauth, s_waithello, s_waitproof,
+                     s_session };
 
 
    statustype getStatus() { return _status; };
@@ -28,30 +59,33 @@ public:
    // depending on the state of the connection
    void handleConnection();
 
-   // connect - second version uses ip_addr in network format (big endian)
+   // connect - second version uses ip_addr in network format (big endian). Returns once the
+   // connect is underway; handleConnection finishes it when the event loop flags the socket
    void connect(const char *ip_addr, unsigned short port);
    void connect(unsigned long ip_addr, unsigned short port);
+   void connectUnix(const char *path);
 
-   // Send data to the other end of the connection without encryption
-   bool getData(std::vector<uint8_t> &buf);
-   bool sendData(std::vector<uint8_t> &buf);
+   // Dialer: once a Unix socket connect goes through, move the connection's bytes onto
+   // shared memory (see ShmChannel). Set before connecting
+   void useSharedMemory() { _shm_offer = true; };
 
-   // Calls encryptData or decryptData before send or after receive
-   bool getEncryptedData(std::vector<uint8_t> &buf);
-   bool sendEncryptedData(std::vector<uint8_t> &buf);
+   // Queues one frame (see FrameProtocol.h) for the socket, written at the end of the pass
+   bool sendFrame(uint8_t type, const BufferChain &payload, uint64_t seq = 0);
+   bool sendFrame(uint8_t type, const std::vector<uint8_t> &buf, uint64_t seq = 0);
 
-   // Simply encrypts or decrypts a buffer
-   void encryptData(std::vector<uint8_t> &buf);
-   void decryptData(std::vector<uint8_t> &buf);
+   // The same, but the payload is encrypted and authenticated (with the header) on the way
+   bool sendSealedFrame(uint8_t type, const BufferChain &payload, uint64_t seq = 0);
 
-   // Input data received on the socket
-   bool isInputDataReady() { return _data_ready; };
-   void getInputData(std::vector<uint8_t> &buf);
+   // Replication frames received on the session, oldest first
+   bool isInputDataReady() { return !_rx_frames.empty(); };
+   bool getInputData(SharedBuffer &buf);
 
    // Data about the connection (NodeID = other end's Server Node ID string)
    unsigned long getIPAddr() { return _connfd.getIPAddr(); }; // Network format
    const char *getIPAddrStr(std::string &buf);
    unsigned short getPort() { return _connfd.getPort(); }; // host format
+   bool isUnix() { return _connfd.isUnix(); };
+   bool getPeerUID(uid_t &uid) { return _connfd.getPeerUID(uid); };
    const char *getNodeID() { return _node_id.c_str(); };
 
    // Connections can set the node or server ID of this connection
@@ -64,71 +98,188 @@ public:
    // Checks if the socket FD is marked as open
    bool isConnected();
 
-   // When should we try to reconnect (prevents spam)
-   time_t reconnect;
-
-   // Assign outgoing data and sets up the socket to manage the transmission
-   void assignOutgoingData(std::vector<uint8_t> &data);
-
-   // Voltz added methods
-   // Method to create random bits and pass them in to passed in vector
-   void getRandBits(std::vector<uint8_t> &dest);
-   // Method to send Challenge 
-   void sAuthChallenge(std::vector<uint8_t> &dest);
-   void cAuthChallenge(std::vector<uint8_t> &dest);
-   // Method to make sure the challenge is correctly responded to
-   void sAuthResponse();
-   void cAuthResponse();
-   // Method to check response  
-   void sAuthCheck();
-   void cAuthCheck();
-   // Method called to do the authentication
-   void handleAuthentication();
-   
+   // The event loop tells the connection when its socket has data waiting or room to write
+   int getFD() { return _connfd.getFD(); };
+   void setReadable(bool readable) { _readable = readable; };
+   void setWritable(bool writable) { _writable = writable; };
+   void setNonBlocking() { _connfd.setNonBlocking(); };
+
+   // The event loop the connection's FDs are registered with, by the thread driving it
+   void setEventLoop(EventLoop *loop) { _loop = loop; };
+
+   // On shared memory, the eventfd the peer signals (-1 if not), and what the event loop
+   // flagged: the eventfd (data, or room to write) and the socket (only ever the peer leaving)
+   int getShmFD() { return _shm ? _shm->getWaitFD() : -1; };
+   void setShmEvents(bool sock_ready, bool shm_ready);
+
+   // Frames waiting for room in the socket, or a connect waiting to finish. The event loop
+   // only watches for writability while there are, and remembers whether it's watching in
+   // watch_writes (on shared memory, the peer signals us when there's room instead)
+   bool hasPendingOutput() { return (!_txq.empty() && !_shm) || (_status == s_dialing); };
+   size_t getPendingOutput() { return _tx_bytes; };
+   bool watch_writes = false;
+
+   // True if handleConnection has work that isn't waiting on socket input
+   bool hasPendingWork();
+
+   // Socket I/O can be done for the connection by its server, batched with every other
+   // connection's (see TCPServer::handleConnections). Before handleConnection, a socket epoll
+   // flagged readable is read into the receive buffer (prepareRead, then finishRead with what
+   // the recv returned, or -errno). Frames sent during handleConnection are only queued, and
+   // written after it (prepareFlush fills iov for one writev, finishFlush takes its result)
+   bool wantsRead();
+   uint8_t *prepareRead(size_t &len);
+   void finishRead(ssize_t results);
+   bool wantsFlush();
+   const std::vector<struct iovec> &prepareFlush();
+   void finishFlush(ssize_t results);
+
+   // Writes the queued frames with plain writev calls (or into shared memory), for servers
+   // without a ring and connections on shared memory
+   void flushOutput();
+
+   // True until the connect goes through
+   bool isDialing() { return _status == s_dialing; };
+
+   // True once the handshake is done and the connection can carry replication frames
+   bool isSession() { return _connected && (_status == s_session) && !_close_req; };
+
+   // Acks received for frames we sent since the last call (acks arrive in send order)
+   unsigned int takeAcks();
+
+   // Asks the thread driving the connection to close it
+   void requestClose();
+
+   // The event loop of the thread driving the connection, woken when the queue manager hands
+   // it work from another thread (nullptr when they're the same thread)
+   void setOwnerLoop(EventLoop *loop) { _owner_loop = loop; };
+
+   // Wakes that thread after the queue manager has taken frames, to pass on ones held back
+   // for room in the ring or drop the connection once it's closed and drained
+   void wakeOwner();
+
+   // True if frames, acks or a session state change came in since the last call, so the
+   // driving thread knows to wake the queue manager
+   bool takeNews();
+
+   // Resumption tickets (see ResumeTicket.h). Set the ticket to resume with before handing
+   // the connection to another thread; takeTicket gets the one the server issued for next time
+   // once the session is open
+   void setTicket(const ResumeTicket &ticket) { _ticket = ticket; };
+   bool takeTicket(ResumeTicket &ticket);
+
+   // Set once the queue manager knows about this session (see ConnReactor)
+   bool announced = false;
+
+   // Hands a replication payload to the session to send. The chain's buffers are written
+   // straight from the caller's shared buffers (held until written), not copied
+   bool sendPayload(const BufferChain &data);
 
 protected:
    // Functions to execute various stages of a connection 
-   void sendSID();
-   void waitForSID();
-   void transmitData();
-   void waitForData();
-   void awaitAck();
+   bool finishConnect();
+   void sendHello();
+   void sAuthAnswer();
+   void cAuthCheck();
+   void sProofCheck();
+   void handleSession();
 
-   // Looks for commands in the data stream
-   std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf,
-                                                   std::vector<uint8_t> &cmd);
-   bool hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd);
+   // Switches to the session's own keys and opens it
+   void startSession(bool dialer);
+   std::vector<uint8_t> sessionSalt();
+   std::vector<uint8_t> handshakeTranscript(bool dialer);
 
-   // Gets the data between startcmd and endcmd strings and places in buf
-   bool getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   // Hands out (server) or keeps (client) the ticket for the next session
+   void issueTicket(std::vector<uint8_t> &blob);
+   void keepTicket(const std::vector<uint8_t> &blob);
 
-   // Places startcmd and endcmd strings around the data in buf and returns it in buf
-   void wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   // Switches the connection onto shared memory - the dialer sets the channel up and sends
+   // it over the socket, the acceptor takes it from its first read
+   bool startSharedMemory();
+   bool takeSharedMemory(const uint8_t *buf, ssize_t len, int *fds, int nfds);
+   void attachChannel(std::unique_ptr<ShmChannel> chan);
 
+   // Reads whatever is on the socket into the receive buffer and pulls out the complete frames
+   bool readStream();
+   bool readShm();
+   void connectionLost();
+   void parseStream();
+   int nextFrame(FrameHeader &hdr);
 
-private:
+   // Moves received frames to the queue manager's ring while it has room, acking each one
+   void passFrames();
 
-   bool _connected = false;
+   // Handshake steps - takes the next frame, which must be of the type given
+   int getFrame(uint8_t type, std::vector<uint8_t> &buf);
 
-   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid;
 
-   statustype _status = s_none;
+private:
+
+   // Read by the queue manager from its own thread
+   std::atomic<bool> _connected{false};
+
+   std::atomic<statustype> _status{s_none};
 
    SocketFD _connfd;
+   bool _readable;      // Event loop flagged the socket as having data
+   bool _writable;      // Event loop flagged the socket as having room to write
  
    std::string _node_id; // The username this connection is associated with
    std::string _svr_id;  // The server ID that hosts this connection object
 
-   // Store incoming data to be read by the queue manager
-   std::vector<uint8_t> _inputbuf;
-   bool _data_ready;    // Is the input buffer full and data ready to be read?
-
-   // Store outgoing data to be sent over the network
-   std::vector<uint8_t> _outputbuf;
+   // Bytes read off the connection but not yet parsed, the complete frames (views of the
+   // receive buffer, with their sequence numbers) waiting for room in the ring, and the ring
+   // the queue manager reads them from. A frame is acked once it's in the ring
+   RecvBuffer _rxbuf;
+   std::deque<std::pair<uint64_t, SharedBuffer>> _rx_waiting;
+   SPSCRing<SharedBuffer> _rx_frames;
+   std::atomic<unsigned int> _acks{0};
+
+   // Payloads from the queue manager waiting to be framed and sent, and its close request
+   SPSCRing<BufferChain> _tx_payloads;
+   std::atomic<bool> _close_req{false};
+
+   EventLoop *_owner_loop = nullptr;
+   bool _news = false;
+
+   // Outbound queue: buffers (headers and payload views) not yet fully written, how far the
+   // last short write got into the front one, and the bytes still to go. The iovecs of the
+   // write in progress, how much it asked for, and whether the last one found the socket full
+   std::deque<SharedBuffer> _txq;
+   size_t _tx_offset = 0;
+   size_t _tx_bytes = 0;
+   std::vector<struct iovec> _tx_iov;
+   size_t _tx_asked = 0;
+   bool _tx_full = false;
+
+   // A recv done for us before handleConnection (see finishRead), how much room it had, and
+   // what it returned
+   bool _rx_done = false;
+   size_t _rx_asked = 0;
+   ssize_t _rx_result = 0;
+
+   // Shared memory: whether to offer it (dialer) or look for it on the first read (acceptor),
+   // the channel once we're on it, and whether the socket has flagged the peer leaving
+   bool _shm_offer = false;
+   bool _shm_accept = false;
+   std::unique_ptr<ShmChannel> _shm;
+   bool _shm_hup = false;
+   EventLoop *_loop = nullptr;
+
+   // Sequence numbers of the last replication frame we sent and the last one acked
+   uint64_t _sent_seq = 0;
+   uint64_t _acked_seq = 0;
 
    CryptoPP::SecByteBlock &_aes_key; // Read from a file, our shared key
+   SessionCipher _cipher;            // Shared key for the handshake, then the session's keys
+
+   // What the session's keys are derived from: the shared key, or a ticket's resumption
+   // secret. The ticket we were given to resume with, and the one issued on this session for
+   // the next (client)
+   CryptoPP::SecByteBlock _session_secret;
+   ResumeTicket _ticket;
+   ResumeTicket _new_ticket;
+   bool _has_new_ticket = false;
    std::string _authstr;   // remembers the random authorization string sent
 
    unsigned int _verbosity;
@@ -136,6 +287,7 @@ private:
    LogMgr &_server_log;
 
    // Voltz added variables
+   // Both challenges, which the proofs cover and which salt the session keys
    std::vector<uint8_t> _auth_challenge_s; // challenge from the server to the client 
    std::vector<uint8_t> _auth_challenge_c; // challenge from the client to the server 
 
@@ -7,6 +7,8 @@
 #include "FileDesc.h"
 #include "TCPConn.h"
 #include "LogMgr.h"
+#include "EventLoop.h"
+#include "IoRing.h"
 #include <crypto++/secblock.h>
 
 /********************************************************************************************
@@ -14,10 +16,15 @@
  *             Includes functionality to manage an AES encryption key loaded from file.
  *
  *             handleConnection is the primary maintenance function. Calls all the TCPConn
- *             handleConnection functions. 
+ *             handleConnection functions. The server socket and every connection are
+ *             registered with an epoll EventLoop, so waitForEvents sleeps until one of them
+ *             has data, room for queued output or a finished connect, or wakeup is called.
+ *             The reads and writes that follow are batched into one io_uring submission each
+ *             per pass where the kernel supports it (see IoRing).
  ********************************************************************************************/
 
-const time_t reconnect_delay = 5;
+// Pending connections the listen socket holds - every peer may be connecting at once
+const int listen_backlog = 128;
 
 class TCPServer : public Server 
 {
@@ -26,14 +33,32 @@ public:
    virtual ~TCPServer();
 
    virtual void bindSvr(const char *ip_addr, unsigned short port);
+
+   // Also listen on a Unix domain socket at path, for servers on the same host
+   void bindUnix(const char *path);
+
    void listenSvr();
    virtual void runServer();
 
    void shutdown();
 
-   TCPConn *handleSocket();
+   // Accepts every connection waiting on the server sockets, returns how many
+   unsigned int handleSocket();
    virtual void handleConnections();
 
+   // Bind with SO_REUSEPORT, so other servers (threads) can listen on the same port
+   void setReusePort(bool reuse) { _reuse_port = reuse; };
+
+   // Blocks until sockets have events, a connection needs servicing or timeout_ms passes
+   void waitForEvents(int timeout_ms);
+
+   // Interrupts waitForEvents from another thread, or via the FD (eventfd) directly
+   void wakeup() { _evloop.wakeup(); };
+   int getWakeFD() { return _evloop.getWakeFD(); };
+
+   // Number of wakeups signaled during the last waitForEvents
+   uint64_t getWakeCount() { return _evloop.getWakeCount(); };
+
    unsigned long getIPAddr() { return _sockfd.getIPAddr(); };
    unsigned short getPort() { return _sockfd.getPort(); };
 
@@ -44,8 +69,29 @@ protected:
 
    void loadAESKey(const char *filename);
 
-   // List of TCPConn objects to manage connections
-   std::list<std::unique_ptr<TCPConn>> _connlist;
+   // Accepts every connection waiting on one server socket
+   unsigned int acceptConns(SocketFD &listener);
+
+   // Sets a newly connected/accepted connection nonblocking and adds it to the event loop
+   void watchConn(TCPConn *conn);
+
+   // Called for each connection accepted (and allowed by the whitelist) before it's handled
+   virtual void setupConn(TCPConn *conn) { (void) conn; };
+
+   // Watches for writability on the connections with output queued, and only those
+   void watchWrites();
+
+   // Batched socket I/O for handleConnections: reads before the connections are handled, and
+   // writes what they queued after
+   void readConnections(IoRing &ring);
+   void flushConnections(IoRing &ring);
+
+   // 0 if some connection needs attention without socket input, otherwise timeout_ms
+   int getConnTimeout(int timeout_ms);
+
+   // List of TCPConn objects to manage connections. Shared, since the queue manager holds
+   // on to sessions driven by other threads' servers (see ConnReactor)
+   std::list<std::shared_ptr<TCPConn>> _connlist;
 
    CryptoPP::SecByteBlock _aes_key;
 
@@ -53,9 +99,15 @@ protected:
 
    unsigned int _verbosity;
 
+   EventLoop _evloop;
+
 private:
    // Class to manage the server socket
    SocketFD _sockfd;
+   bool _reuse_port = false;
+
+   // Unix domain server socket, if bindUnix was called
+   std::unique_ptr<SocketFD> _unixfd;
 
 };
 
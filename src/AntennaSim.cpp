@@ -130,10 +130,9 @@ void AntennaSim::simulate() {
                   diter->drone_id << ", Time: " << diter->timestamp << " Lat: " << 
                   diter->latitude << ", Long: " << diter->longitude << "\n";
 
-         _to_db.addPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, diter->longitude);
-         diter = _to_db.end();
-         diter--;
-         diter->setFlags(DBFLAG_NEW);
+         // Flag it new as it's added, so the replication server never sees it unflagged
+         _to_db.addPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude,
+                                                               diter->longitude, DBFLAG_NEW);
 
          _source_db.popFront();
          diter = _source_db.begin();
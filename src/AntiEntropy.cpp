@@ -0,0 +1,240 @@
+#include <stdexcept>
+#include "AntiEntropy.h"
+#include "ReplProtocol.h"
+
+// splitmix64 finalizer - spreads bits so summed leaf hashes don't cancel out
+static uint64_t mix64(uint64_t x) {
+   x += 0x9e3779b97f4a7c15ULL;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+   return x ^ (x >> 31);
+}
+
+/*********************************************************************************************
+ * MerkleTree (constructor) - all levels start zeroed (the empty set)
+ *********************************************************************************************/
+
+MerkleTree::MerkleTree():
+                  _levels(ae_levels),
+                  _dirty(false)
+{
+   unsigned int width = 1;
+   for (unsigned int i=0; i<ae_levels; i++, width *= ae_fanout)
+      _levels[i].assign(width, 0);
+
+   if (_levels[ae_levels-1].size() != ae_leaves)
+      throw std::runtime_error("Merkle tree shape does not match ae_leaves");
+}
+
+/*********************************************************************************************
+ * add - adds a plot hash to a leaf. Leaves are a sum of their plot hashes so the order plots
+ *       arrive in doesn't matter. Interior nodes are recomputed lazily
+ *********************************************************************************************/
+
+void MerkleTree::add(uint64_t plot_hash, unsigned int leaf) {
+   _levels[ae_levels-1][leaf % ae_leaves] += plot_hash;
+   _dirty = true;
+}
+
+/*********************************************************************************************
+ * getNode - gets the hash of a node, rebuilding the interior levels if leaves have changed
+ *
+ *    Throws: runtime_error if the level or index is out of range
+ *********************************************************************************************/
+
+uint64_t MerkleTree::getNode(unsigned int level, unsigned int idx) {
+   if ((level >= ae_levels) || (idx >= _levels[level].size()))
+      throw std::runtime_error("Merkle node out of range");
+
+   if (_dirty)
+      rebuild();
+   return _levels[level][idx];
+}
+
+void MerkleTree::rebuild() {
+   for (int level = ae_levels-2; level >= 0; level--) {
+      for (unsigned int i=0; i<_levels[level].size(); i++) {
+         uint64_t h = level;
+         for (unsigned int c=0; c<ae_fanout; c++)
+            h = mix64(h ^ _levels[level+1][i * ae_fanout + c]);
+         _levels[level][i] = h;
+      }
+   }
+   _dirty = false;
+}
+
+AntiEntropy::AntiEntropy():
+                  _local_plots(ae_leaves)
+{
+}
+
+AntiEntropy::~AntiEntropy() {
+}
+
+/*********************************************************************************************
+ * hashPlot - hashes the wire form of a plot (drone, node, timestamp, lat/long bits)
+ *********************************************************************************************/
+
+uint64_t AntiEntropy::hashPlot(DronePlot &plot) {
+   std::vector<uint8_t> buf;
+   plot.serialize(buf);
+
+   uint64_t h = 0;
+   size_t i = 0;
+   for ( ; i + sizeof(uint64_t) <= buf.size(); i += sizeof(uint64_t))
+      h = mix64(h ^ unpackField<uint64_t>(buf.data() + i));
+   for ( ; i < buf.size(); i++)
+      h = mix64(h ^ buf[i]);
+   return h;
+}
+
+unsigned int AntiEntropy::getLeaf(DronePlot &plot) {
+   return static_cast<unsigned int>((plot.timestamp / ae_bucket_secs) % ae_leaves);
+}
+
+/*********************************************************************************************
+ * addLocal - adds a plot this server originated to the local tree and keeps a copy so a
+ *            divergent bucket can be resent
+ *
+ *    Returns: true if the plot is new, false if it was already recorded
+ *********************************************************************************************/
+
+bool AntiEntropy::addLocal(DronePlot &plot) {
+   uint64_t h = hashPlot(plot);
+   if (!_local_seen.insert(h).second)
+      return false;
+
+   unsigned int leaf = getLeaf(plot);
+   _local.add(h, leaf);
+   _local_plots[leaf].push_back(plot);
+   return true;
+}
+
+/*********************************************************************************************
+ * addRemote - adds a received plot to the mirror tree for its origin server
+ *
+ *    Returns: true if this is the first time we've seen the plot from that origin
+ *********************************************************************************************/
+
+bool AntiEntropy::addRemote(const std::string &origin, DronePlot &plot) {
+   uint64_t h = hashPlot(plot);
+   if (!_remote_seen[origin].insert(h).second)
+      return false;
+
+   _mirrors[origin].add(h, getLeaf(plot));
+   return true;
+}
+
+/*********************************************************************************************
+ * getRootDigest - digest body is [uint8 level][uint16 count][count x (uint16 idx, uint64 hash)]
+ *********************************************************************************************/
+
+void AntiEntropy::getRootDigest(std::vector<uint8_t> &body) {
+   body.clear();
+   packField<uint8_t>(body, 0);
+   packField<uint16_t>(body, 1);
+   packField<uint16_t>(body, 0);
+   packField<uint64_t>(body, _local.getNode(0, 0));
+}
+
+/*********************************************************************************************
+ * handleDigest - compares a peer's node hashes against our mirror of that peer. The request
+ *                body is [uint8 level][uint16 count][count x uint16 idx] naming the nodes at
+ *                that level that differ
+ *
+ *    Returns: true if a request was built, false if everything matched
+ *
+ *    Throws: runtime_error if the digest is malformed
+ *********************************************************************************************/
+
+bool AntiEntropy::handleDigest(const std::string &origin, const uint8_t *body, size_t len,
+                                                       std::vector<uint8_t> &request) {
+   if (len < sizeof(uint8_t) + sizeof(uint16_t))
+      throw std::runtime_error("Anti-entropy digest truncated");
+
+   uint8_t level = body[0];
+   uint16_t count = unpackField<uint16_t>(body + 1);
+   const size_t entry_size = sizeof(uint16_t) + sizeof(uint64_t);
+   if ((level >= ae_levels) || (len != 3 + count * entry_size))
+      throw std::runtime_error("Anti-entropy digest malformed");
+
+   MerkleTree &mirror = _mirrors[origin];
+   std::vector<uint16_t> differ;
+   const uint8_t *ptr = body + 3;
+   for (unsigned int i=0; i<count; i++, ptr += entry_size) {
+      uint16_t idx = unpackField<uint16_t>(ptr);
+      uint64_t hash = unpackField<uint64_t>(ptr + sizeof(uint16_t));
+      if (mirror.getNode(level, idx) != hash)
+         differ.push_back(idx);
+   }
+
+   if (differ.empty())
+      return false;
+
+   request.clear();
+   packField<uint8_t>(request, level);
+   packField<uint16_t>(request, static_cast<uint16_t>(differ.size()));
+   for (auto idx : differ)
+      packField<uint16_t>(request, idx);
+   return true;
+}
+
+/*********************************************************************************************
+ * handleRequest - a peer wants nodes of our local tree expanded. Interior nodes are answered
+ *                 with a digest of their children, leaves with the plots in those buckets
+ *
+ *    Params:  reply - complete messages (with headers) are appended here
+ *
+ *    Throws: runtime_error if the request is malformed
+ *********************************************************************************************/
+
+void AntiEntropy::handleRequest(const uint8_t *body, size_t len, std::vector<uint8_t> &reply) {
+   if (len < sizeof(uint8_t) + sizeof(uint16_t))
+      throw std::runtime_error("Anti-entropy request truncated");
+
+   uint8_t level = body[0];
+   uint16_t count = unpackField<uint16_t>(body + 1);
+   if ((level >= ae_levels) || (len != 3 + count * sizeof(uint16_t)))
+      throw std::runtime_error("Anti-entropy request malformed");
+
+   std::vector<uint8_t> msg;
+   uint32_t num_plots = 0;
+   if (level == ae_levels-1)
+      packField<uint32_t>(msg, 0);   // plot count, filled in below
+   else {
+      packField<uint8_t>(msg, level + 1);
+      packField<uint16_t>(msg, static_cast<uint16_t>(count * ae_fanout));
+   }
+
+   const uint8_t *ptr = body + 3;
+   for (unsigned int i=0; i<count; i++, ptr += sizeof(uint16_t)) {
+      uint16_t idx = unpackField<uint16_t>(ptr);
+
+      // Leaf - resend every plot in the bucket, the peer drops the ones it already has
+      if (level == ae_levels-1) {
+         if (idx >= ae_leaves)
+            throw std::runtime_error("Anti-entropy request leaf out of range");
+         for (auto &plot : _local_plots[idx]) {
+            plot.serialize(msg);
+            num_plots++;
+         }
+         continue;
+      }
+
+      for (unsigned int c=0; c<ae_fanout; c++) {
+         uint16_t child = static_cast<uint16_t>(idx * ae_fanout + c);
+         packField<uint16_t>(msg, child);
+         packField<uint64_t>(msg, _local.getNode(level + 1, child));
+      }
+   }
+
+   if (level == ae_levels-1) {
+      if (num_plots == 0)
+         return;
+      for (unsigned int i=0; i<sizeof(uint32_t); i++)
+         msg[i] = ((uint8_t *) &num_plots)[i];
+      appendReplMsg(reply, rm_plots, msg);
+   } else {
+      appendReplMsg(reply, rm_ae_digest, msg);
+   }
+}
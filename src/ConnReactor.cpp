@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <iostream>
+#include <sstream>
+#include "ConnReactor.h"
+
+/*********************************************************************************************
+ * ConnReactor (constructor) - loads the shared key and opens the log the queue manager uses
+ *
+ *    Params:  svr_id - our server ID, which accepted connections answer the peer's with
+ *             mgr_loop - the queue manager's event loop, woken when there's news for it
+ *             verbosity - stdout verbosity - 3 = max
+ *********************************************************************************************/
+
+ConnReactor::ConnReactor(const std::string &svr_id, EventLoop &mgr_loop, unsigned int verbosity):
+                                    TCPServer(verbosity),
+                                    _svr_id(svr_id),
+                                    _mgr_loop(mgr_loop),
+                                    _adopted(reactor_handoff_size),
+                                    _opened(reactor_handoff_size),
+                                    _shutdown(false)
+{
+   loadAESKey("sharedkey.bin");
+
+   std::string logname = svr_id + "server.log";
+   changeLogfile(logname.c_str());
+}
+
+ConnReactor::~ConnReactor() {
+   stop();
+}
+
+/*********************************************************************************************
+ * start - binds a listening socket to the server's address and port next to the queue
+ *         manager's and starts the reactor thread
+ *
+ *    Throws: socket_error if the socket can't be bound (the queue manager's socket must also
+ *            have been bound with SO_REUSEPORT)
+ *********************************************************************************************/
+
+void ConnReactor::start(const char *ip_addr, unsigned short port) {
+   setReusePort(true);
+   bindSvr(ip_addr, port);
+   listenSvr();
+
+   _thread = std::thread(&ConnReactor::run, this);
+}
+
+/*********************************************************************************************
+ * stop - ends the reactor thread and waits for it
+ *********************************************************************************************/
+
+void ConnReactor::stop() {
+   if (!_thread.joinable())
+      return;
+
+   _shutdown = true;
+   wakeup();
+   _thread.join();
+}
+
+/*********************************************************************************************
+ * adopt - hands a connection the queue manager dialed (connecting, not yet authenticated) to
+ *         this thread, which drives it from then on
+ *
+ *    Returns: false if the handoff ring is full (the caller drops the connection and retries)
+ *********************************************************************************************/
+
+bool ConnReactor::adopt(std::shared_ptr<TCPConn> conn) {
+   conn->setOwnerLoop(&_evloop);
+   conn->announced = true;
+   if (!_adopted.push(std::move(conn)))
+      return false;
+
+   wakeup();
+   return true;
+}
+
+/*********************************************************************************************
+ * takeOpened - gets the next session a peer dialed to us that opened on this thread
+ *
+ *    Returns: false if there are none waiting
+ *********************************************************************************************/
+
+bool ConnReactor::takeOpened(std::shared_ptr<TCPConn> &conn) {
+   return _opened.pop(conn);
+}
+
+/*********************************************************************************************
+ * setupConn - accepted connections answer the peer's SID with ours, and are driven by this
+ *             thread's event loop
+ *********************************************************************************************/
+
+void ConnReactor::setupConn(TCPConn *conn) {
+   conn->setSvrID(_svr_id.c_str());
+   conn->setOwnerLoop(&_evloop);
+}
+
+/*********************************************************************************************
+ * run - the reactor thread. Sleeps until a socket is ready or the queue manager hands it
+ *       something, then accepts, takes over dialed connections and services its connections
+ *********************************************************************************************/
+
+void ConnReactor::run() {
+   pthread_setname_np(pthread_self(), "repl-reactor");
+
+   while (!_shutdown) {
+      waitForEvents(-1);
+
+      handleSocket();
+
+      std::shared_ptr<TCPConn> conn;
+      while (_adopted.pop(conn)) {
+         watchConn(conn.get());
+         _connlist.push_back(std::move(conn));
+      }
+
+      handleConnections();
+      announce();
+   }
+}
+
+/*********************************************************************************************
+ * announce - passes sessions that opened here to the queue manager (including ones that have
+ *            already failed, which may still hold frames for it) and wakes it if they, or
+ *            frames, acks or closes on the sessions it knows about, need its attention. If
+ *            the ring is full the rest wait for the next pass, which we make sure comes soon
+ *********************************************************************************************/
+
+void ConnReactor::announce() {
+   bool news = false;
+
+   for (auto &conn : _connlist) {
+      if (!conn->announced && (conn->getStatus() == TCPConn::s_session)) {
+         if (!_opened.push(conn)) {
+            wakeup();
+            break;
+         }
+         conn->announced = true;
+         news = true;
+      }
+
+      if (conn->takeNews())
+         news = true;
+   }
+
+   if (news)
+      _mgr_loop.wakeup();
+}
@@ -3,12 +3,16 @@
 #include <unistd.h>
 #include <cstring>
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include "strfuncts.h"
 #include "Deduplicate.h"
 
-Deduplicate::Deduplicate(DronePlotDB &plotdb) : _plotdb(plotdb)
+Deduplicate::Deduplicate(DronePlotDB &plotdb) : _plotdb(plotdb),
+                                                 _time_tol(default_time_tol),
+                                                 _lat_tol(default_latlon_tol),
+                                                 _lon_tol(default_latlon_tol)
 {
 }
 
@@ -37,81 +41,212 @@ void Deduplicate::setValues(unsigned int sSID, unsigned int lead, unsigned int n
 }
 
 /********************************************************************************************
- * removeDuplicates - This method loops through everything in the DronePlotdb and removes
+ * setTolerances - Sets how far apart two plots of the same drone can be and still be
+ *                 considered duplicates. These are also the grid cell sizes
+ *
+ *      Params: time_tol - max seconds between the plots
+ *              lat_tol/lon_tol - max degrees between the plots (0 = must match exactly)
+ *             
+ *******************************************************************************************/
+void Deduplicate::setTolerances(time_t time_tol, float lat_tol, float lon_tol)
+{
+        _time_tol = time_tol;
+        _lat_tol = lat_tol;
+        _lon_tol = lon_tol;
+}
+
+/********************************************************************************************
+ * removeDuplicates - This method goes through everything in the DronePlotdb and removes
  *                   duplicates in the list   
  *                   called in ReplSvr after any replication
  *             
  *******************************************************************************************/
 void Deduplicate::removeDuplicates()
 {
-        // check if we have the time skew 
-        // 2-step for loop through all of the list 
+        // A pass stops early when it finds a new time skew, as correcting the skew moves
+        // timestamps of plots that are already in the grid. Only happens once per server
+        while(!dedupPass());
+
+        // sort by timestamp
+	_plotdb.sortByTime();
+}
+
+/********************************************************************************************
+ * dedupPass - Hashes every plot into the grid, then walks the list in order and tombstones
+ *             any plot that matches an earlier surviving plot. Each plot only probes the
+ *             neighboring grid cells instead of every other plot in the database, and all
+ *             the tombstoned plots are compacted out in one sweep at the end
+ *             
+ * Returns: true if the pass finished, false if a time skew was found and it needs rerun 
+ *             
+ *******************************************************************************************/
+bool Deduplicate::dedupPass()
+{
+        std::vector<std::list<DronePlot>::iterator> plots;
+        PlotGrid grid;
+
+        // index all the plots by their cell
         for(auto i = _plotdb.begin(); i != _plotdb.end(); i++)
         {
-                for(auto j = i; j != _plotdb.end(); j++)
+                grid[getCell(*i)].push_back(plots.size());
+                plots.push_back(i);
+        }
+        std::vector<size_t> matches;
+        bool skewFound = false;
+
+        for(size_t j = 0; j < plots.size(); j++)
+        {
+                // look for an earlier plot that j is a duplicate of
+                findMatches(grid, plots, j, 0, j, matches);
+                if(matches.size() == 0)
+                {
+                        continue;
+                }
+                // the earliest surviving match is the one that gets kept
+                auto i = plots[*std::min_element(matches.begin(), matches.end())];
+                auto dup = plots[j];
+
+                if(((*i).node_id) == _mySID) // i has localSID
+                {
+                        skewFound |= findTimeSkew((*dup), (*i));
+                }
+                else if(((*dup).node_id) == _mySID) // j has localSID
+                {
+                        skewFound |= findTimeSkew((*i), (*dup));
+                        // also compare against all others, have to because j gets erased
+                        if(_diffs.size() < _totalServers) // haven't found all entries
+                        {
+                                // compare j against everything after it and if a match is found get time skew
+                                findMatches(grid, plots, j, j + 1, plots.size(), matches);
+                                for(auto f : matches)
+                                {
+                                        skewFound |= findTimeSkew((*plots[f]), (*dup));
+                                }
+                        }
+                }
+                else if(_diffs.size() < _totalServers) // j and i have nonlocal SIDs
                 {
-                        if((i != j) && checkDup(*i, *j)) // found a duplicate
+                        for(auto k : _diffs)
                         {
-                                if(((*i).node_id) == _mySID) // i has localSID
+                                if(k.SID == ((*i).node_id)) //i offset was prev found so it is corrected to local
                                 {
-                                    findTimeSkew((*j), (*i));
+                                        skewFound |= findHardSkew((*i),(*dup));
+                                        break;
                                 }
-                                else if(((*j).node_id) == _mySID) // j has localSID
+                                else if(k.SID == ((*dup).node_id)) //j offset was prev found so it is now local time
                                 {
-                                    findTimeSkew((*i), (*j));
-				    // also compare against all others, have to because j gets erased
-                                    if(_diffs.size() < _totalServers) // haven't found all entries
-			            {
-                                    	// compare j against everything else and if a match is found get time skew
-                                        for(auto f = j; f!= _plotdb.end(); f++)
-					{
-						if((f != j) && checkDup(*f, *j))
-						{
-							findTimeSkew((*f), (*j));
-							f = j;	
-						}
-					}
-                                    }
+                                        skewFound |= findHardSkew((*dup),(*i));
+                                        break;
                                 }
-///*
-				else if(_diffs.size() < _totalServers) // j and i have nonlocal SIDs
-				{
-					for(auto k : _diffs)
-       					{
-                				if(k.SID == ((*i).node_id)) //i offset was prev found so it is corrected to local
-                				{
-                        				findHardSkew((*i),(*j));
-							break;
-                				}
-						else if(k.SID == ((*j).node_id)) //j offset was prev found so it is now local time
-                				{
-                        				findHardSkew((*j),(*i));
-							break;
-                				}
-        				}
-				}
-//*/
-                                // erase the duplciate
-                                _plotdb.erase(j);
-				// reset j to make sure don't miss any
-				j = i;
                         }
-                } 
+                }
+
+                // mark the duplicate, it gets removed with the rest at the end of the pass
+                _plotdb.markErased(dup);
+
+                // timestamps moved, so the grid is stale
+                if(skewFound)
+                {
+                        _plotdb.compact();
+                        return false;
+                }
         }
-        // sort by timestamp
-	_plotdb.sortByTime();
+        _plotdb.compact();
+        return true;
+}
+
+/********************************************************************************************
+ * getCell - Finds the grid cell a plot hashes into. Cells are the size of the tolerances
+ *             
+ *******************************************************************************************/
+Deduplicate::sGridKey Deduplicate::getCell(DronePlot & plot)
+{
+        // a zero tolerance means an exact match, but the cell still needs a size
+        double lat_size = (_lat_tol > 0) ? _lat_tol : default_latlon_tol;
+        double lon_size = (_lon_tol > 0) ? _lon_tol : default_latlon_tol;
+        time_t time_size = (_time_tol > 0) ? _time_tol : 1;
+
+        sGridKey key;
+        key.drone_id = plot.drone_id;
+        key.lat_cell = static_cast<long>(std::floor(plot.latitude / lat_size));
+        key.lon_cell = static_cast<long>(std::floor(plot.longitude / lon_size));
+        key.time_cell = static_cast<long>(std::floor(static_cast<double>(plot.timestamp) / time_size));
+        return key;
+}
+
+/********************************************************************************************
+ * findMatches - Probes the cell of the target plot and its neighbors for duplicates
+ *
+ *      Params: grid/plots - the indexed plots from dedupPass (tombstoned plots are skipped)
+ *              target - index of the plot to find duplicates of
+ *              lo/hi - only plots with an index in [lo, hi) are considered
+ *              matches - filled with the indexes of the duplicates found
+ *             
+ *******************************************************************************************/
+void Deduplicate::findMatches(PlotGrid &grid, std::vector<std::list<DronePlot>::iterator> &plots,
+                              size_t target, size_t lo, size_t hi,
+                              std::vector<size_t> &matches)
+{
+        matches.clear();
+        sGridKey center = getCell(*plots[target]);
+        sGridKey probe = center;
+
+        for(long dlat = -1; dlat <= 1; dlat++)
+        {
+                for(long dlon = -1; dlon <= 1; dlon++)
+                {
+                        for(long dtime = -1; dtime <= 1; dtime++)
+                        {
+                                probe.lat_cell = center.lat_cell + dlat;
+                                probe.lon_cell = center.lon_cell + dlon;
+                                probe.time_cell = center.time_cell + dtime;
+
+                                auto cell = grid.find(probe);
+                                if(cell == grid.end())
+                                {
+                                        continue;
+                                }
+                                for(auto idx : cell->second)
+                                {
+                                        if((idx >= lo) && (idx < hi) && (idx != target) &&
+                                           !plots[idx]->isFlagSet(DBFLAG_TOMBSTONE) &&
+                                           checkDup(*plots[idx], *plots[target]))
+                                        {
+                                                matches.push_back(idx);
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+bool Deduplicate::sGridKey::operator==(const sGridKey &other) const
+{
+        return (drone_id == other.drone_id) && (lat_cell == other.lat_cell) &&
+               (lon_cell == other.lon_cell) && (time_cell == other.time_cell);
+}
+
+size_t Deduplicate::GridKeyHash::operator()(const sGridKey &key) const
+{
+        // mix the fields with large odd multipliers so neighboring cells spread out
+        size_t h = key.drone_id;
+        h = h * 0x9E3779B97F4A7C15ULL + static_cast<size_t>(key.lat_cell);
+        h = h * 0x9E3779B97F4A7C15ULL + static_cast<size_t>(key.lon_cell);
+        h = h * 0x9E3779B97F4A7C15ULL + static_cast<size_t>(key.time_cell);
+        return h ^ (h >> 29);
 }
 
 /********************************************************************************************
- * checkDup - This method compares 2 plots and returns if it is a duplicate 
+ * checkDup - This method compares 2 plots and returns if it is a duplicate (within the
+ *            time and lat/long tolerances)
  *             
  * Returns: true if it is a duplicate and false if it is not 
  *             
  *******************************************************************************************/
 bool Deduplicate::checkDup(DronePlot & plot1, DronePlot & plot2)
 {
-	// check timestamp (if greater difference than 20 not the same point)
-	if(plot1.timestamp > plot2.timestamp + 20 || plot1.timestamp < plot2.timestamp - 20)
+	// check timestamp (if greater difference than the tolerance not the same point)
+	if(plot1.timestamp > plot2.timestamp + _time_tol || plot1.timestamp < plot2.timestamp - _time_tol)
 	{
 		return false;
 	}
@@ -119,11 +254,11 @@ bool Deduplicate::checkDup(DronePlot & plot1, DronePlot & plot2)
         {
                 return false;
         }
-        if(plot1.latitude != plot2.latitude)
+        if(std::fabs(plot1.latitude - plot2.latitude) > _lat_tol)
         {
                 return false;
         }
-        if(plot1.longitude != plot2.longitude)
+        if(std::fabs(plot1.longitude - plot2.longitude) > _lon_tol)
         {
                 return false;
         }
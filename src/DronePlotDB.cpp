@@ -206,10 +206,10 @@ bool DronePlot::isFlagSet(unsigned short flags) {
 }
 
 /*****************************************************************************************
- * DronePlotDB - Constructor, currently initializes the mutex only
+ * DronePlotDB - Constructor, initializes the mutex and no notify FD
  *
  *****************************************************************************************/
-DronePlotDB::DronePlotDB() {
+DronePlotDB::DronePlotDB():_notify_fd(-1) {
 
    // Initialize our mutex for thread protection
    pthread_mutex_init(&_mutex, NULL);
@@ -222,24 +222,35 @@ DronePlotDB::~DronePlotDB() {
 
 
 /*****************************************************************************************
- * addPlot - Adds a plot object at the end of the doubly-linked list
+ * addPlot - Adds a plot object at the end of the doubly-linked list. New plots (DBFLAG_NEW)
+ *           also signal the notify eventfd, if one is set
  *
  *    Params:  drone_id - the unique integer ID of this particular drone
  *             node_id - the unique integer ID of the receiving site
  *             timestamp - the plot's time in seconds
  *             latitude - floating point latitude coordinate of this plot point
  *             longitude - floating point longitude coordinate of this plot point
+ *             flags - flags to set on the plot before it becomes visible (i.e. DBFLAG_NEW)
  *             
  *****************************************************************************************/
 
-void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude) {
+void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude,
+                                                                           unsigned short flags) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
    _dbdata.emplace_back(drone_id, node_id, timestamp, latitude, longitude);
+   _dbdata.back().setFlags(flags);
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
+
+   // Wake up anyone waiting on new plots
+   if ((_notify_fd >= 0) && (flags & DBFLAG_NEW)) {
+      uint64_t one = 1;
+      ssize_t results = write(_notify_fd, &one, sizeof(one));
+      (void) results;
+   }
 }
 
 /*****************************************************************************************
@@ -374,27 +385,27 @@ int DronePlotDB::loadBinaryFile(const char *filename) {
    if (!infile.openFile(FileFD::readfd))
       return -1;
 
-   // Loop through grabbing the bytes of each plotpt
-   unsigned int size = 0;
+   // Read the whole file in at once, then carve the plotpts out of it
+   if (infile.readFile(buf) < 0)
+      return -1;
+   infile.closeFD();
+
+   // A partial plotpt at the end means this may be a corrupted file
    unsigned int ppsize = DronePlot::getDataSize();
-   while ((size = infile.readBytes<uint8_t>(buf, ppsize)) == ppsize) {
+   if (buf.size() % ppsize != 0)
+      return -1;
+
+   for (unsigned int pos = 0; pos < buf.size(); pos += ppsize) {
       _dbdata.emplace_back();
       dptr = _dbdata.end();
       dptr--;
 
       // Deserialize
-      dptr->deserialize(buf);
-      buf.clear();
+      dptr->deserialize(buf, pos);
 
       count++;
    }
-   
-   // Final read should be size = 0 or this may be a corrupted file
-   if (size != 0) {
-      return -1;
-   }
 
-   infile.closeFD();
    return count; 
 }
 
@@ -425,12 +436,12 @@ void DronePlotDB::popFront() {
  *****************************************************************************************/
 
 void DronePlotDB::erase(unsigned int i) {
+   if (i >= _dbdata.size())
+      throw std::runtime_error("erase function called with index out of scope for std::list.");
+
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   if (i > _dbdata.size())
-      throw std::runtime_error("erase function called with index out of scope for std::list.");
-
    std::list<DronePlot>::iterator diter = _dbdata.begin();
    for (unsigned int x=0; x<i; x++, diter++);
 
@@ -465,17 +476,44 @@ std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator
 
 // Removes all of a particular node (not for student use)
 void DronePlotDB::removeNodeID(unsigned int node_id) {
+   eraseIf([node_id](DronePlot &plot) { return plot.node_id == node_id; });
+}
+
+/*****************************************************************************************
+ * compact - removes every plot marked with markErased in a single pass through the list
+ *
+ *    Returns: the number of plots removed
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::compact() {
+   return eraseIf([](DronePlot &) { return false; });
+}
+
+/*****************************************************************************************
+ * eraseIf - removes every plot the predicate returns true for, along with any plots
+ *           already tombstoned, in a single pass through the list
+ *
+ *    Params:  pred - called once per plot, returns true if the plot should be removed
+ *
+ *    Returns: the number of plots removed
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::eraseIf(std::function<bool(DronePlot &)> pred) {
    pthread_mutex_lock(&_mutex);
 
-   auto del_iter = _dbdata.begin();
-   while (del_iter != _dbdata.end()) {
-      if (del_iter->node_id == node_id)
-         del_iter = _dbdata.erase(del_iter);
-      else
-         del_iter++;
-   }
+   size_t before = _dbdata.size();
+   _dbdata.remove_if([&pred](DronePlot &plot) {
+                        return plot.isFlagSet(DBFLAG_TOMBSTONE) || pred(plot); });
+   size_t count = before - _dbdata.size();
 
    pthread_mutex_unlock(&_mutex);
+   return count;
 }
 
 /*****************************************************************************************
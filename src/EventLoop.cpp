@@ -0,0 +1,148 @@
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "EventLoop.h"
+
+const unsigned int max_events = 64;
+
+/*********************************************************************************************
+ * EventFD (constructor) - creates the nonblocking eventfd
+ *
+ *    Throws: socket_error if it could not be created
+ *********************************************************************************************/
+
+EventFD::EventFD() {
+   if ((_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      throw socket_error("Unable to create eventfd.");
+}
+
+EventFD::~EventFD() {
+   close(_fd);
+}
+
+// Adds count to the eventfd, waking anything waiting on it
+void EventFD::signal(uint64_t count) {
+   ssize_t results = write(_fd, &count, sizeof(count));
+   (void) results;
+}
+
+// Reads and resets the counter - returns the sum of all signals since the last drain
+uint64_t EventFD::drain() {
+   uint64_t val;
+   if (read(_fd, &val, sizeof(val)) != sizeof(val))
+      return 0;
+   return val;
+}
+
+/*********************************************************************************************
+ * EventLoop (constructor) - creates the epoll instance and the eventfd used for wakeups
+ *
+ *    Throws: socket_error if either could not be created
+ *********************************************************************************************/
+
+EventLoop::EventLoop():_events(max_events),
+                       _wake_count(0)
+{
+   if ((_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+      throw socket_error("Unable to create epoll instance.");
+
+   addFD(_wakefd.getFD(), EPOLLIN);
+}
+
+EventLoop::~EventLoop() {
+   close(_epfd);
+}
+
+/*********************************************************************************************
+ * addFD - registers a file descriptor with epoll, or updates it if already registered
+ *
+ *    Params:  fd - the file descriptor to watch
+ *             events - epoll event mask to watch for
+ *
+ *    Throws: socket_error if epoll refuses the FD
+ *********************************************************************************************/
+
+void EventLoop::addFD(int fd, uint32_t events) {
+   epoll_event ev;
+   ev.events = events;
+   ev.data.fd = fd;
+
+   if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+      return;
+
+   if ((errno != EEXIST) || (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) != 0))
+      throw socket_error("Unable to add file descriptor to epoll.");
+}
+
+void EventLoop::modifyFD(int fd, uint32_t events) {
+   epoll_event ev;
+   ev.events = events;
+   ev.data.fd = fd;
+
+   if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) != 0)
+      throw socket_error("Unable to modify file descriptor in epoll.");
+}
+
+// Closed FDs are removed by the kernel automatically, so failures here are not an error
+void EventLoop::removeFD(int fd) {
+   epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+   _ready.erase(fd);
+}
+
+/*********************************************************************************************
+ * wait - blocks until at least one FD has events, the timeout expires or wakeup is called.
+ *        Drains the wakeup eventfd and records the ready FDs for isReady/getEvents
+ *
+ *    Params:  timeout_ms - max milliseconds to block, 0 to poll, -1 to wait forever
+ *
+ *    Returns: number of ready FDs (not counting wakeups)
+ *
+ *    Throws: socket_error if epoll fails
+ *********************************************************************************************/
+
+int EventLoop::wait(int timeout_ms) {
+   _ready.clear();
+   _wake_count = 0;
+
+   int n = epoll_wait(_epfd, _events.data(), _events.size(), timeout_ms);
+   if (n == -1) {
+      if (errno == EINTR)
+         return 0;
+      throw socket_error("epoll_wait failed in event loop.");
+   }
+
+   int count = 0;
+   for (int i=0; i<n; i++) {
+      if (_events[i].data.fd == _wakefd.getFD()) {
+         _wake_count += _wakefd.drain();
+         continue;
+      }
+      _ready[_events[i].data.fd] = _events[i].events;
+      count++;
+   }
+   return count;
+}
+
+/*********************************************************************************************
+ * isReady - true if the FD came back from the last wait readable, or hung up/errored (so the
+ *           next read sees the problem)
+ *********************************************************************************************/
+
+bool EventLoop::isReady(int fd) {
+   return (getEvents(fd) & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+}
+
+uint32_t EventLoop::getEvents(int fd) {
+   auto rptr = _ready.find(fd);
+   if (rptr == _ready.end())
+      return 0;
+   return rptr->second;
+}
+
+/*********************************************************************************************
+ * wakeup - signals the eventfd so a thread blocked in wait returns
+ *********************************************************************************************/
+
+void EventLoop::wakeup() {
+   _wakefd.signal();
+}
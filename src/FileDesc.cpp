@@ -4,7 +4,14 @@
 #include <cstring>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <climits>
+#include <cerrno>
+#include <algorithm>
 #include <unistd.h>
 
 #include "FileDesc.h"
@@ -89,9 +96,11 @@ bool FileDesc::hasData(long ms_timeout) {
 }
 
 /*****************************************************************************************
- * readFD - simply reads all available string data (up to bufsize) from the FD
+ * readFD - simply reads all available string data (up to bufsize) from the FD, or up to
+ *          len bytes into a buffer
  *
- *    Params: buf - string to store the data in
+ *    Params: buf - string (or buffer) to store the data in
+ *            len - size of buf
  *
  *    Returns: returns the amount of data read or -1 for failure
  *****************************************************************************************/
@@ -110,8 +119,13 @@ ssize_t FileDesc::readFD(std::string &buf) {
    return amt_read;
 }
 
+ssize_t FileDesc::readFD(uint8_t *buf, size_t len) {
+   return read(_fd, buf, len);
+}
+
 /*****************************************************************************************
- * writeFD - writes all the string data provided in str to the FD
+ * writeFD - writes all the string data provided in str to the FD, carrying on after a
+ *           short write until it's all gone (see writeVec)
  *
  *    Params: str/data - the string data to write to the FD
  *
@@ -127,7 +141,71 @@ ssize_t FileDesc::writeFD(const char *data) {
 }
 
 ssize_t FileDesc::writeFD(const char *data, unsigned int len) {
-   return write(_fd, data, len);
+   struct iovec iov = {(void *) data, len};
+   return writeVec(&iov, 1);
+}
+
+/*****************************************************************************************
+ * writeVec - writes the buffers in iov back to back with writev, without joining them. If
+ *            the FD is non-blocking and only takes part of the data, waits (up to ms_timeout
+ *            each time) until it can take more and carries on from where it left off
+ *
+ *    Params: iov/iovcnt - the buffers to write, in order
+ *            ms_timeout - longest to wait for the FD to become writable
+ *
+ *    Returns: total bytes written, or -1 for a write error or timeout
+ *****************************************************************************************/
+
+ssize_t FileDesc::writeVec(const struct iovec *iov, int iovcnt, int ms_timeout) {
+   std::vector<struct iovec> left(iov, iov + iovcnt);
+   size_t first = 0;
+   ssize_t total = 0;
+
+   while (first < left.size()) {
+      int count = std::min<size_t>(left.size() - first, IOV_MAX);
+      ssize_t results = writev(_fd, &left[first], count);
+      if (results < 0) {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            return -1;
+
+         struct pollfd pfd = {_fd, POLLOUT, 0};
+         if ((errno != EINTR) && (poll(&pfd, 1, ms_timeout) <= 0))
+            return -1;
+         continue;
+      }
+      total += results;
+
+      // Skip what went out, including part of the buffer it stopped in
+      size_t written = results;
+      while ((first < left.size()) && (written >= left[first].iov_len))
+         written -= left[first++].iov_len;
+      if (written > 0) {
+         left[first].iov_base = (uint8_t *) left[first].iov_base + written;
+         left[first].iov_len -= written;
+      }
+   }
+   return total;
+}
+
+/*****************************************************************************************
+ * tryWriteVec - a single writev of the buffers in iov. Never waits: on a non-blocking FD
+ *               that's full it writes nothing, and the caller tries again once the FD
+ *               polls writable
+ *
+ *    Params: iov/iovcnt - the buffers to write, in order (only the first IOV_MAX are tried)
+ *
+ *    Returns: bytes written (possibly fewer than asked, or 0 if the FD is full), -1 for a
+ *             write error
+ *****************************************************************************************/
+
+ssize_t FileDesc::tryWriteVec(const struct iovec *iov, int iovcnt) {
+   ssize_t results = writev(_fd, iov, std::min(iovcnt, IOV_MAX));
+   if (results < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+         return 0;
+      return -1;
+   }
+   return results;
 }
 
 /*************************************************************************************
@@ -184,6 +262,20 @@ void SocketFD::setReusable() {
 
 }
 
+/*****************************************************************************************
+ * setReusePort - sets SO_REUSEPORT so several listening sockets (one per thread) can bind
+ *                the same address and port. Must be set on all of them before binding
+ *
+ *****************************************************************************************/
+
+void SocketFD::setReusePort() {
+
+   int enable = 1;
+   if (setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+      throw socket_error("setsockopt failure setting SO_REUSEPORT");
+
+}
+
 /*****************************************************************************************
  * bindFD - Binds the FD to the given network ip address and port, making it available to
  *          accept connections.
@@ -212,19 +304,22 @@ void SocketFD::bindFD(const char *ip_addr, short unsigned int port) {
  *
  *    Params:  ip_addr - the IP address string of the server to connect to in std format
  *             port - the port of the server to connect to
+ *             wait - false to make the socket nonblocking first and return as soon as the
+ *                    connect is underway. The socket turns writable when it finishes, and
+ *                    getConnectError says whether it worked
  *
- *    Returns: true if the connect worked, false otherwise
+ *    Returns: true if the connect worked (or is underway), false otherwise
  *****************************************************************************************/
 
-bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
+bool SocketFD::connectTo(const char *ip_addr, unsigned short port, bool wait) {
 
    unsigned long n_ip_addr;
 
    inet_pton(AF_INET, ip_addr, &n_ip_addr);
-   return connectTo(n_ip_addr, htons(port));
+   return connectTo(n_ip_addr, htons(port), wait);
 }
 
-bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
+bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port, bool wait) {
    if ((_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
       throw socket_error("Socket creation failed.");
 
@@ -234,13 +329,93 @@ bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
    _fd_addr.sin_addr.s_addr = ip_addr;
    _fd_addr.sin_port = port;
 
+   if (!wait)
+      setNonBlocking();
+
    if (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0)
-      return false;
+      return !wait && (errno == EINPROGRESS);
 
    return true;
 
 }
 
+/*****************************************************************************************
+ * connectUnix - attempts to connect to a Unix domain socket, for a server on the same host
+ *
+ *    Params:  path - the path the server's socket is bound to
+ *             wait - as connectTo
+ *
+ *    Returns: true if the connect worked (or is underway), false otherwise
+ *
+ *    Throws: socket_error if the socket can't be created or the path is too long
+ *****************************************************************************************/
+
+bool SocketFD::connectUnix(const char *path, bool wait) {
+   struct sockaddr_un addr;
+   bzero(&addr, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr.sun_path))
+      throw socket_error("Unix socket path too long.");
+   strcpy(addr.sun_path, path);
+
+   // Swap the TCP socket the constructor made for a Unix one
+   close(_fd);
+   if ((_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+      throw socket_error("Socket creation failed.");
+   bzero(&_fd_addr, sizeof(_fd_addr));
+   _unix = true;
+   _unix_path = path;
+
+   if (!wait)
+      setNonBlocking();
+
+   // A Unix connect normally finishes at once. One the server's backlog can't take fails with
+   // EAGAIN rather than going on in the background, and is treated like a refusal
+   if (connect(_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+      return !wait && (errno == EINPROGRESS);
+
+   return true;
+}
+
+int SocketFD::getConnectError() {
+   int err = 0;
+   socklen_t len = sizeof(err);
+
+   if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+      return errno;
+   return err;
+}
+
+/*****************************************************************************************
+ * bindUnix - Binds the FD to a Unix domain socket at path, only reachable by this user,
+ *            replacing the socket file a previous run left there
+ *
+ *    Params: path - where to create the socket
+ *
+ *    Throws: socket_error for issues creating or binding the socket
+ *****************************************************************************************/
+
+void SocketFD::bindUnix(const char *path) {
+   struct sockaddr_un addr;
+   bzero(&addr, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr.sun_path))
+      throw socket_error("Unix socket path too long.");
+   strcpy(addr.sun_path, path);
+
+   close(_fd);
+   if ((_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+      throw socket_error("Socket creation failed.");
+   bzero(&_fd_addr, sizeof(_fd_addr));
+   _unix = true;
+   _unix_path = path;
+
+   unlink(path);
+   if ((bind(_fd, (struct sockaddr *) &addr, sizeof(addr))) != 0)
+      throw socket_error("Unix socket bind failed.");
+   chmod(path, S_IRUSR | S_IWUSR);
+}
+
 /*****************************************************************************************
  * listenFD - starts listening for connections on a bound socket FD
  *
@@ -265,15 +440,37 @@ void SocketFD::listenFD(int backlog) {
  *****************************************************************************************/
 
 bool SocketFD::acceptFD(SocketFD &server) {
-   socklen_t len = sizeof(_fd_addr);
-
-   _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
+   // Unix peers have no address worth keeping, just the path they came in on
+   if (server.isUnix()) {
+      _fd = accept(server.getFD(), NULL, NULL);
+      _unix = true;
+      _unix_path = server.getUnixPath();
+   } else {
+      socklen_t len = sizeof(_fd_addr);
+      _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
+   }
    if (_fd == -1)
       return false;
 
    return true;
 }
 
+/*****************************************************************************************
+ * getPeerUID - for a Unix domain socket, the user ID of the process on the other end
+ *
+ *    Returns: false if it isn't a Unix socket or the kernel won't say
+ *****************************************************************************************/
+
+bool SocketFD::getPeerUID(uid_t &uid) {
+   struct ucred cred;
+   socklen_t len = sizeof(cred);
+   if (!_unix || (getsockopt(_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0))
+      return false;
+
+   uid = cred.uid;
+   return true;
+}
+
 /*****************************************************************************************
  * getIPAddr - returns the IP address of this FD in big endian format
  *
@@ -283,6 +480,78 @@ unsigned long SocketFD::getIPAddr() {
    return _fd_addr.sin_addr.s_addr;
 }
 
+/*****************************************************************************************
+ * sendFDs - sends len bytes with copies of the file descriptors attached, which the process
+ *           at the other end of a Unix domain socket receives as its own (see recvFDs)
+ *
+ *    Returns: bytes sent, or -1 for error (errno set)
+ *****************************************************************************************/
+
+ssize_t SocketFD::sendFDs(const void *buf, size_t len, const int *fds, int nfds) {
+   struct iovec iov = {(void *) buf, len};
+   std::vector<uint8_t> cbuf(CMSG_SPACE(nfds * sizeof(int)));
+
+   struct msghdr msg;
+   bzero(&msg, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf.data();
+   msg.msg_controllen = cbuf.size();
+
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+   memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+   return sendmsg(_fd, &msg, MSG_NOSIGNAL);
+}
+
+/*****************************************************************************************
+ * recvFDs - reads up to len bytes, and any file descriptors sent with them (see sendFDs).
+ *           Descriptors beyond the room in fds are closed, and the read stops where a
+ *           message carrying descriptors starts or ends, so they can't be mixed up with
+ *           the bytes around them
+ *
+ *    Params:  nfds - in: the room in fds, out: how many were received
+ *
+ *    Returns: bytes read, 0 if the socket closed, or -1 for error (errno set)
+ *****************************************************************************************/
+
+ssize_t SocketFD::recvFDs(void *buf, size_t len, int *fds, int &nfds) {
+   struct iovec iov = {buf, len};
+   std::vector<uint8_t> cbuf(CMSG_SPACE(nfds * sizeof(int)));
+   int room = nfds;
+   nfds = 0;
+
+   struct msghdr msg;
+   bzero(&msg, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf.data();
+   msg.msg_controllen = cbuf.size();
+
+   ssize_t results = recvmsg(_fd, &msg, MSG_CMSG_CLOEXEC);
+   if (results < 0)
+      return results;
+
+   for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+         continue;
+
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (int i=0; i<count; i++) {
+         int fd;
+         memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+         if (nfds < room)
+            fds[nfds++] = fd;
+         else
+            close(fd);
+      }
+   }
+   return results;
+}
+
 /******************************************************************************************
  * getPort - gets the port of this socket in host byte order (little endian, or regular int)
  *
@@ -297,6 +566,11 @@ unsigned short SocketFD::getPort() {
  *
  ******************************************************************************************/
 void SocketFD::getIPAddrStr(std::string &buf) {
+   if (_unix) {
+      buf = "unix:" + _unix_path;
+      return;
+   }
+
    char ipaddr_str[16];
    inet_ntop(AF_INET, (void *) &_fd_addr.sin_addr.s_addr, ipaddr_str, 16);
    buf = ipaddr_str;
@@ -357,6 +631,49 @@ bool FileFD::openFile(fd_file_type ftype, bool create) {
    return true;
 }
 
+/*****************************************************************************************
+ * readFile - reads from the current position to the end of the file. The buffer is sized
+ *            from fstat up front, so a whole dump comes in with one read rather than one
+ *            per record
+ *
+ *    Params:  buf - replaced with the file's contents
+ *
+ *    Returns: number of bytes read, or -1 for error
+ *
+ *****************************************************************************************/
+
+ssize_t FileFD::readFile(std::vector<uint8_t> &buf) {
+   buf.clear();
+
+   struct stat st;
+   if (fstat(_fd, &st) == -1)
+      return -1;
+
+   off_t pos = lseek(_fd, 0, SEEK_CUR);
+   size_t want = ((pos >= 0) && (st.st_size > pos)) ? (size_t) (st.st_size - pos) : 0;
+
+   // Keep going past the size we were told in case the file grew, until read says it's done
+   buf.resize(want + 1);
+   size_t got = 0;
+   while (true) {
+      if (got == buf.size())
+         buf.resize(buf.size() * 2);
+
+      ssize_t results = readFD(buf.data() + got, buf.size() - got);
+      if (results < 0) {
+         if (errno == EINTR)
+            continue;
+         buf.clear();
+         return -1;
+      }
+      if (results == 0)
+         break;
+      got += results;
+   }
+   buf.resize(got);
+   return got;
+}
+
 /*****************************************************************************************
  * readStr - For a file FD, reads in characters until it hits a newline char. Not set up to
  *          work with sockets as it does not buffer and could lose data if partial data
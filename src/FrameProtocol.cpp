@@ -0,0 +1,100 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <cstring>
+#include "FrameProtocol.h"
+
+/*********************************************************************************************
+ * packFrameHeader - lays a frame header out in network byte order
+ *
+ *    Params:  hdr - the header to write
+ *             out - where to write it, must hold frame_header_size bytes
+ *********************************************************************************************/
+
+void packFrameHeader(const FrameHeader &hdr, uint8_t *out) {
+   uint32_t length = htonl(hdr.length);
+   uint64_t seq = htobe64(hdr.seq);
+   uint32_t crc = htonl(hdr.crc);
+
+   out[0] = hdr.version;
+   out[1] = hdr.type;
+   out[2] = frame_header_size;
+   out[3] = hdr.flags;
+   memcpy(out + 4, &length, sizeof(length));
+   memcpy(out + 8, &seq, sizeof(seq));
+   memcpy(out + 16, &crc, sizeof(crc));
+}
+
+/*********************************************************************************************
+ * parseFrameHeader - reads a frame header in place. The header may be longer than ours if the
+ *                    sender runs a newer version; header_len says where the payload starts
+ *
+ *    Params:  buf/len - the received bytes, starting at a frame boundary
+ *             hdr - loaded with the header found
+ *
+ *    Returns: 1 if a whole header was read, 0 if more bytes are needed, -1 if the bytes can't
+ *             be a frame header (bad version, length or header size)
+ *********************************************************************************************/
+
+int parseFrameHeader(const uint8_t *buf, size_t len, FrameHeader &hdr) {
+   if (len < 4)
+      return 0;
+
+   hdr.version = buf[0];
+   hdr.type = buf[1];
+   hdr.header_len = buf[2];
+   hdr.flags = buf[3];
+   if ((hdr.version == 0) || (hdr.header_len < frame_header_size))
+      return -1;
+
+   if (len < hdr.header_len)
+      return 0;
+
+   uint32_t length;
+   uint64_t seq;
+   uint32_t crc;
+   memcpy(&length, buf + 4, sizeof(length));
+   memcpy(&seq, buf + 8, sizeof(seq));
+   memcpy(&crc, buf + 16, sizeof(crc));
+   hdr.length = ntohl(length);
+   hdr.seq = be64toh(seq);
+   hdr.crc = ntohl(crc);
+
+   if (hdr.length > max_frame_payload)
+      return -1;
+   return 1;
+}
+
+// CRC lookup table, built the first time crc32 is called
+namespace {
+   struct CRCTable {
+      uint32_t entries[256];
+
+      CRCTable() {
+         for (uint32_t i=0; i<256; i++) {
+            uint32_t c = i;
+            for (int k=0; k<8; k++)
+               c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            entries[i] = c;
+         }
+      }
+   };
+}
+
+/*********************************************************************************************
+ * crc32 - table-driven CRC-32 with the reflected IEEE polynomial
+ *
+ *    Params:  data/len - the bytes to checksum
+ *             crc - the result for the bytes before these (0 to start)
+ *
+ *    Returns: the CRC of everything so far
+ *********************************************************************************************/
+
+uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc) {
+   static const CRCTable crc_table;
+   const uint32_t *table = crc_table.entries;
+
+   crc = ~crc;
+   for (size_t i=0; i<len; i++)
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+   return ~crc;
+}
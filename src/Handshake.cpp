@@ -0,0 +1,138 @@
+#include <cstring>
+#include <stdexcept>
+#include <crypto++/sha.h>
+#include <crypto++/hmac.h>
+#include <crypto++/misc.h>
+#include "Handshake.h"
+
+using namespace CryptoPP;
+
+/*********************************************************************************************
+ * packClientHello - lays out [challenge][SID][ticket]
+ *
+ *    Throws: runtime_error if the SID is too long to send
+ *********************************************************************************************/
+
+void packClientHello(const ClientHello &hello, std::vector<uint8_t> &buf) {
+   buf = hello.challenge;
+   if (!putShortString(buf, hello.sid))
+      throw std::runtime_error("Server ID too long to send in a handshake.");
+   buf.insert(buf.end(), hello.ticket.begin(), hello.ticket.end());
+}
+
+/*********************************************************************************************
+ * parseClientHello - reads a client's hello
+ *
+ *    Returns: false if it's too short for the challenge and SID
+ *********************************************************************************************/
+
+bool parseClientHello(const std::vector<uint8_t> &buf, ClientHello &hello) {
+   if (buf.size() < challenge_size)
+      return false;
+
+   size_t pos = challenge_size;
+   hello.challenge.assign(buf.begin(), buf.begin() + pos);
+   if (!getShortString(buf, pos, hello.sid))
+      return false;
+   hello.ticket.assign(buf.begin() + pos, buf.end());
+   return true;
+}
+
+/*********************************************************************************************
+ * packServerAuth - lays out [flags][challenge][proof][SID][ticket]
+ *
+ *    Throws: runtime_error if the SID is too long to send
+ *********************************************************************************************/
+
+void packServerAuth(const ServerAuth &auth, std::vector<uint8_t> &buf) {
+   buf.assign(1, auth.flags);
+   buf.insert(buf.end(), auth.challenge.begin(), auth.challenge.end());
+   buf.insert(buf.end(), auth.proof.begin(), auth.proof.end());
+   if (!putShortString(buf, auth.sid))
+      throw std::runtime_error("Server ID too long to send in a handshake.");
+   buf.insert(buf.end(), auth.ticket.begin(), auth.ticket.end());
+}
+
+/*********************************************************************************************
+ * parseServerAuth - reads the server's answer to our hello
+ *
+ *    Returns: false if it's too short for the flags, challenge, proof and SID
+ *********************************************************************************************/
+
+bool parseServerAuth(const std::vector<uint8_t> &buf, ServerAuth &auth) {
+   if (buf.size() < 1 + challenge_size + proof_size)
+      return false;
+
+   auth.flags = buf[0];
+   size_t pos = 1;
+   auth.challenge.assign(buf.begin() + pos, buf.begin() + pos + challenge_size);
+   pos += challenge_size;
+   auth.proof.assign(buf.begin() + pos, buf.begin() + pos + proof_size);
+   pos += proof_size;
+   if (!getShortString(buf, pos, auth.sid))
+      return false;
+   auth.ticket.assign(buf.begin() + pos, buf.end());
+   return true;
+}
+
+/*********************************************************************************************
+ * handshakeTranscript - [client challenge][server challenge][client SID][server SID], SIDs
+ *                       with their lengths so no two transcripts run together the same way
+ *
+ *    Throws: runtime_error if a SID is too long
+ *********************************************************************************************/
+
+void handshakeTranscript(const std::vector<uint8_t> &client_challenge,
+                         const std::vector<uint8_t> &server_challenge,
+                         const std::string &client_sid, const std::string &server_sid,
+                         std::vector<uint8_t> &transcript) {
+   transcript = client_challenge;
+   transcript.insert(transcript.end(), server_challenge.begin(), server_challenge.end());
+   if (!putShortString(transcript, client_sid) || !putShortString(transcript, server_sid))
+      throw std::runtime_error("Server ID too long to send in a handshake.");
+}
+
+/*********************************************************************************************
+ * handshakeProof - HMAC-SHA256, keyed with the secret, of label then the transcript
+ *
+ *    Params:  secret - the shared key or a resumption secret
+ *             label - which side is proving (so one side's proof can't be sent back as the
+ *                     other's)
+ *             transcript - from handshakeTranscript
+ *             proof - loaded with proof_size bytes
+ *********************************************************************************************/
+
+void handshakeProof(const SecByteBlock &secret, const char *label,
+                    const std::vector<uint8_t> &transcript, uint8_t *proof) {
+   HMAC<SHA256> hmac(secret, secret.size());
+   hmac.Update((const byte *) label, strlen(label));
+   hmac.Update(transcript.data(), transcript.size());
+   hmac.Final(proof);
+}
+
+bool checkHandshakeProof(const SecByteBlock &secret, const char *label,
+                         const std::vector<uint8_t> &transcript, const uint8_t *proof) {
+   uint8_t expected[proof_size];
+   handshakeProof(secret, label, transcript, expected);
+   return VerifyBufsEqual(expected, proof, proof_size);
+}
+
+/*********************************************************************************************
+ * putShortString/getShortString - [uint8 length][bytes]
+ *********************************************************************************************/
+
+bool putShortString(std::vector<uint8_t> &buf, const std::string &str) {
+   if (str.size() > UINT8_MAX)
+      return false;
+   buf.push_back(str.size());
+   buf.insert(buf.end(), str.begin(), str.end());
+   return true;
+}
+
+bool getShortString(const std::vector<uint8_t> &buf, size_t &pos, std::string &str) {
+   if ((pos >= buf.size()) || (pos + 1 + buf[pos] > buf.size()))
+      return false;
+   str.assign(buf.begin() + pos + 1, buf.begin() + pos + 1 + buf[pos]);
+   pos += 1 + buf[pos];
+   return true;
+}
@@ -0,0 +1,234 @@
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "IoRing.h"
+
+namespace {
+   std::atomic<bool> ring_enabled{true};
+
+   // Each thread's ring, and whether it has tried to set one up
+   thread_local std::unique_ptr<IoRing> thread_ring;
+   thread_local bool ring_tried = false;
+
+   int ringSetup(unsigned int entries, struct io_uring_params *params) {
+      return (int) syscall(__NR_io_uring_setup, entries, params);
+   }
+
+   int ringEnter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+      return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+   }
+}
+
+/*********************************************************************************************
+ * IoRing (constructor) - nothing is set up until setup is called (see get)
+ *********************************************************************************************/
+
+IoRing::IoRing() {
+}
+
+IoRing::~IoRing() {
+   if (_sqes != nullptr)
+      munmap(_sqes, _sqes_len);
+   if ((_cq_ptr != nullptr) && (_cq_ptr != _sq_ptr))
+      munmap(_cq_ptr, _cq_len);
+   if (_sq_ptr != nullptr)
+      munmap(_sq_ptr, _sq_len);
+   if (_ring_fd >= 0)
+      close(_ring_fd);
+}
+
+/*********************************************************************************************
+ * get - the calling thread's ring. The first call on each thread tries to set one up, and
+ *       if the kernel won't give us one, that thread falls back to plain syscalls for good
+ *
+ *    Returns: the ring, or nullptr if io_uring is unavailable or turned off
+ *********************************************************************************************/
+
+IoRing *IoRing::get() {
+   if (!ring_tried) {
+      ring_tried = true;
+      if (ring_enabled) {
+         std::unique_ptr<IoRing> ring(new IoRing());
+         if (ring->setup())
+            thread_ring = std::move(ring);
+      }
+   }
+   return thread_ring.get();
+}
+
+void IoRing::setEnabled(bool enabled) {
+   ring_enabled = enabled;
+}
+
+/*********************************************************************************************
+ * setup - creates the ring and maps its queues. Only one thread ever submits to it, which
+ *         lets newer kernels skip some locking (older ones refuse the flags and we go
+ *         without)
+ *
+ *    Returns: false if io_uring isn't available, or lacks something we rely on
+ *********************************************************************************************/
+
+bool IoRing::setup() {
+   struct io_uring_params params;
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+
+   _ring_fd = ringSetup(io_ring_entries, &params);
+   if ((_ring_fd < 0) && (errno == EINVAL)) {
+      memset(&params, 0, sizeof(params));
+      _ring_fd = ringSetup(io_ring_entries, &params);
+   }
+   if (_ring_fd < 0)
+      return false;
+
+   // IORING_OP_RECV came in with this feature flag (5.6)
+   if (!(params.features & IORING_FEAT_RW_CUR_POS))
+      return false;
+
+   _sq_entries = params.sq_entries;
+   _sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+   _cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+   if (single_mmap)
+      _sq_len = _cq_len = std::max(_sq_len, _cq_len);
+
+   _sq_ptr = mmap(NULL, _sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd,
+                  IORING_OFF_SQ_RING);
+   if (_sq_ptr == MAP_FAILED) {
+      _sq_ptr = nullptr;
+      return false;
+   }
+
+   if (single_mmap) {
+      _cq_ptr = _sq_ptr;
+   } else {
+      _cq_ptr = mmap(NULL, _cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd,
+                     IORING_OFF_CQ_RING);
+      if (_cq_ptr == MAP_FAILED) {
+         _cq_ptr = nullptr;
+         return false;
+      }
+   }
+
+   _sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+   void *sqes = mmap(NULL, _sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     _ring_fd, IORING_OFF_SQES);
+   if (sqes == MAP_FAILED)
+      return false;
+   _sqes = (struct io_uring_sqe *) sqes;
+
+   uint8_t *sq = (uint8_t *) _sq_ptr;
+   _sq_head = (unsigned int *) (sq + params.sq_off.head);
+   _sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+   _sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+   _sq_array = (unsigned int *) (sq + params.sq_off.array);
+
+   uint8_t *cq = (uint8_t *) _cq_ptr;
+   _cq_head = (unsigned int *) (cq + params.cq_off.head);
+   _cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+   _cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+   _cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+   return true;
+}
+
+/*********************************************************************************************
+ * nextSqe - claims the next submission queue entry, cleared. The kernel doesn't look at it
+ *           until the next io_uring_enter
+ *
+ *    Returns: nullptr if everything since the last submit has filled the queue
+ *********************************************************************************************/
+
+struct io_uring_sqe *IoRing::nextSqe() {
+   if (_queued + _inflight >= _sq_entries)
+      return nullptr;
+
+   unsigned int tail = *_sq_tail;
+   unsigned int idx = tail & *_sq_mask;
+   struct io_uring_sqe *sqe = &_sqes[idx];
+   memset(sqe, 0, sizeof(*sqe));
+   _sq_array[idx] = idx;
+
+   __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+   _queued++;
+   return sqe;
+}
+
+/*********************************************************************************************
+ * queueRecv/queueWritev - queue a recv into buf, or a writev of the buffers in iov, on a
+ *                         socket. The ring ignores O_NONBLOCK (an operation that can't finish
+ *                         at once goes to a kernel worker that waits for the socket), so both
+ *                         are flagged not to wait: a socket with nothing (or no room) gives
+ *                         -EAGAIN, rather than holding up submitAndWait
+ *********************************************************************************************/
+
+bool IoRing::queueRecv(int fd, void *buf, size_t len, uint64_t tag) {
+   struct io_uring_sqe *sqe = nextSqe();
+   if (sqe == nullptr)
+      return false;
+
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = fd;
+   sqe->addr = (uint64_t) (uintptr_t) buf;
+   sqe->len = len;
+   sqe->msg_flags = MSG_DONTWAIT;
+   sqe->user_data = tag;
+   return true;
+}
+
+bool IoRing::queueWritev(int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t tag) {
+   struct io_uring_sqe *sqe = nextSqe();
+   if (sqe == nullptr)
+      return false;
+
+   sqe->opcode = IORING_OP_WRITEV;
+   sqe->fd = fd;
+   sqe->off = (uint64_t) -1;
+   sqe->addr = (uint64_t) (uintptr_t) iov;
+   sqe->len = iovcnt;
+   sqe->rw_flags = RWF_NOWAIT;
+   sqe->user_data = tag;
+   return true;
+}
+
+/*********************************************************************************************
+ * submitAndWait - hands the kernel everything queued and collects every result, normally
+ *                 with one io_uring_enter (more only if a signal interrupts it)
+ *
+ *    Params:  results - loaded with (tag, bytes or -errno) for each operation, in the order
+ *                       they finished
+ *
+ *    Throws: runtime_error if the kernel refuses the ring
+ *********************************************************************************************/
+
+void IoRing::submitAndWait(std::vector<std::pair<uint64_t, int>> &results) {
+   results.clear();
+
+   while ((_queued > 0) || (_inflight > 0)) {
+      int submitted = ringEnter(_ring_fd, _queued, _queued + _inflight, IORING_ENTER_GETEVENTS);
+      if (submitted < 0) {
+         if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+            throw std::runtime_error("io_uring_enter failed.");
+         submitted = 0;
+      }
+      _queued -= submitted;
+      _inflight += submitted;
+
+      unsigned int head = *_cq_head;
+      unsigned int tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+         struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+         results.emplace_back(cqe->user_data, cqe->res);
+         head++;
+         _inflight--;
+      }
+      __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+   }
+}
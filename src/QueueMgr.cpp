@@ -1,6 +1,11 @@
 #include <fstream>
+#include <cstdio>
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <cstring>
 #include <tuple>
+#include <algorithm>
 #include <sstream>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
@@ -9,13 +14,23 @@
 #include "ReplServer.h"
 #include "TCPConn.h"
 
+// Monotonic clock in milliseconds, for redial timing
+static unsigned long long monoMs() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return static_cast<unsigned long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 /********************************************************************************************
  * QueueMgr (constructor) - loads a hard-coded server.txt that contains a comma-separated list
  *                          of server info (including this one)
  *
  ********************************************************************************************/
 
-QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity)
+QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity),
+                                            _max_peer_bytes(default_peer_queue_bytes),
+                                            _max_peer_msgs(default_peer_queue_msgs),
+                                            _rng(std::random_device{}())
                
 {
    if (loadServerList("servers.txt") <= 0)
@@ -24,9 +39,10 @@ QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity)
    loadAESKey("sharedkey.bin");
 }
 
-// Destructor - does nothing right now
+// Destructor - stops the extra network threads
 QueueMgr::~QueueMgr() {
-
+   for (auto &reactor : _reactors)
+      reactor->stop();
 }
 
 // Should not be called, overloaded to crash if it is
@@ -39,7 +55,10 @@ void QueueMgr::runServer() {
  *                  the parameter. Deconflicts the local server
  *
  *    Params:  filename - the path/filename to the server file in the following format:
- *                   <server_id>, <ip_addr>, <port>
+ *                   <server_id>, <ip_addr>, <port>[, <unix socket path>[, shm]]
+ *                   A server with a Unix socket path also listens there, and servers dial it
+ *                   there rather than over TCP (so only give one to servers on the same host).
+ *                   With shm, sessions dialed to it move onto shared memory once connected
  *
  *    Returns: -1 for failure, # of servers opened for success
  *
@@ -72,12 +91,34 @@ int QueueMgr::loadServerList(const char *filename) {
 
       clrSpaces(left);
       clrSpaces(right);
+
+      // The port may be followed by a Unix socket path, and that by the shm transport
+      std::string port_str = right, path, transport;
+      if (split(right, port_str, path, ',')) {
+         clrSpaces(port_str);
+
+         // Not split(), which lowercases the path
+         std::string::size_type comma = path.find(',');
+         if (comma != std::string::npos) {
+            transport = path.substr(comma + 1);
+            path.erase(comma);
+            clrSpaces(transport);
+            lower(transport);
+            if (transport == "shm")
+               _shm_peers.insert(svrid);
+            else if (transport.size() > 0)
+               return -1;
+         }
+         clrSpaces(path);
+         if (path.size() > 0)
+            _unix_paths[svrid] = path;
+      }
    
       in_addr ipaddr;
       inet_pton(AF_INET, left.c_str(), &ipaddr);
 
       unsigned short port;
-      port = (unsigned short) strtol(right.c_str(), NULL, 10);
+      port = (unsigned short) strtol(port_str.c_str(), NULL, 10);
       port = htons(port);
       
       _server_list.push_back(std::tuple<std::string, unsigned long, 
@@ -115,7 +156,8 @@ const char *QueueMgr::getClientID(unsigned long ip_addr, short unsigned int port
  **********************************************************************************************/
 
 void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
-   // Call the parent function
+   // Call the parent function. Other network threads listen on the same port
+   setReusePort(_net_threads > 1);
    TCPServer::bindSvr(ip_addr, port);
    bool found = false;
 
@@ -145,6 +187,45 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
    logname += "server.log";
    changeLogfile(logname.c_str()); 
    _server_log.writeLog("Server started.");
+
+   // Servers on this host reach us through our Unix socket, if we have one
+   auto unix_path = _unix_paths.find(_server_ID);
+   if (unix_path != _unix_paths.end())
+      bindUnix(unix_path->second.c_str());
+
+   loadSpillFiles();
+
+   for (unsigned int i=1; i<_net_threads; i++) {
+      _reactors.emplace_back(new ConnReactor(_server_ID, _evloop, _verbosity));
+      _reactors.back()->start(ip_addr, port);
+   }
+   if (_net_threads > 1) {
+      std::stringstream msg;
+      msg << "Handling connections on " << _net_threads << " network threads.";
+      _server_log.writeLog(msg.str().c_str());
+   }
+}
+
+/**********************************************************************************************
+ * loadSpillFiles - names each peer's spill file and picks up any left over from the last run,
+ *                  so payloads queued for a down peer survive a restart
+ **********************************************************************************************/
+
+void QueueMgr::loadSpillFiles() {
+   for (auto &server : _server_list) {
+      const std::string &sid = std::get<0>(server);
+      peer_queue &peer = _peers[sid];
+      peer.spill_file = _server_ID + "spill." + sid;
+
+      struct stat st;
+      if ((stat(peer.spill_file.c_str(), &st) == 0) && (st.st_size > 0)) {
+         peer.spill_bytes = st.st_size;
+
+         std::stringstream msg;
+         msg << "Found " << st.st_size << " bytes spilled for peer " << sid << " on a previous run.";
+         _server_log.writeLog(msg.str().c_str());
+      }
+   }
 }
 
 
@@ -153,15 +234,30 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
  *               any data read from the connections, storing it in the connection buffer
  *               for later retrieval. 
  *
+ *    Params:  timeout_ms - how long to sleep waiting for network activity or a wakeup
+ *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-void QueueMgr::handleQueue() {
+void QueueMgr::handleQueue(int timeout_ms) {
+
+   // Sleep until a socket is ready, a connection needs servicing, a peer retry is due or
+   // we're woken up
+   waitForEvents(getPeerTimeout(timeout_ms));
 
    // Accept new connections, if any
    handleSocket();
 
+   // Pick up sessions that opened on the other network threads
+   collectSessions();
+
+   // Start sends to any peers with data waiting
+   servicePeers();
+
    // Handle any open connections, reading from and writing to the socket
    handleConnections();
+
+   // Finished sends release their data (or keep it for a retry)
+   reapPeerConns();
    
    // Get data from input buffers on connections and add to the queue
    populateQueue();
@@ -176,28 +272,37 @@ void QueueMgr::handleQueue() {
  **********************************************************************************************/
 void QueueMgr::populateQueue() {
 
-   // Loop through the connections, handling each one
-   auto conn_it = _connlist.begin();
-   for ( ; conn_it != _connlist.end(); conn_it++) {
-      
-      // If the connection has data marked ready, get it and handle it based on the
-      // command at the beginning
-      if (((*conn_it)->getStatus() == TCPConn::s_hasdata) && (*conn_it)->isInputDataReady()) {
-         std::vector<uint8_t> buf;
-
-         (*conn_it)->getInputData(buf);
-         if (buf.size() == 0) {
-            // Handle this better later on
-            throw std::runtime_error("TCPConn claimed replication data but none existed.");
+   // Loop through the connections, ours and the other threads', handling each one
+   for (auto *conns : {&_connlist, &_remote_conns}) {
+      for (auto conn_it = conns->begin(); conn_it != conns->end(); conn_it++) {
+
+         // Take every frame the session has received, in order
+         SharedBuffer buf;
+         bool took = false;
+         while ((*conn_it)->getInputData(buf)) {
+            took = true;
+            if (buf.size() == 0) {
+               // Handle this better later on
+               throw std::runtime_error("TCPConn claimed replication data but none existed.");
+            }
+
+            // Add this data to the queue
+            _queue.emplace(recv, (*conn_it)->getNodeID(), buf);
+            if (_verbosity >= 3) {
+               std::cout << "Replication info pulled off connection and placed into queue w/ " <<
+                                 buf.size() << " bytes.\n";
+            }
          }
-        
-         // Add this data to the queue
-         _queue.emplace(recv, (*conn_it)->getNodeID(), buf);
-         if (_verbosity >= 3) {
-            std::cout << "Replication info pulled off connection and placed into queue w/ " <<
-                              (buf.size()-4) / DronePlot::getDataSize() << " potential plots.\n";
-         }   
-      }      
+
+         // The room we made may let through frames the session held back, or let a closed one
+         // go, so have the thread driving it take another pass (ours, if it's one of ours)
+         if (took) {
+            if (conns == &_connlist)
+               wakeup();
+            else
+               (*conn_it)->wakeOwner();
+         }
+      }
    }
 }
 
@@ -205,75 +310,539 @@ void QueueMgr::populateQueue() {
  * replToAll - places data into the queue for each server (calls replToServer). Replication 
                will happen on its own
  *
- *    Params:  data - the data in binary form to send to the server
+ *    Params:  data - the data in binary form to send to the server, shared by every peer's
+ *                    queue rather than copied
+ *
+ *    Returns: number of servers whose queue accepted the data
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-void QueueMgr::sendToAll(std::vector<uint8_t> &data) {
+unsigned int QueueMgr::sendToAll(const SharedBuffer &data) {
+   unsigned int accepted = 0;
    for (unsigned int i=0; i<_server_list.size(); i++) {
-      sendToServer(std::get<0>(_server_list[i]).c_str(), data);
+      if (sendToServer(std::get<0>(_server_list[i]).c_str(), data))
+         accepted++;
    }
-
+   return accepted;
 }
 
 /*********************************************************************************************
  * sendToServer - places data into the queue to be sent to the server indicated by
- *                server_id. Transmission will happen on its own
+ *                server_id. Transmission will happen on its own. If the last payload waiting
+ *                for this server hasn't gone out yet, the data is coalesced into it
  *
  *    Params:  server_id - string of the server's name (will be mapped automatically to IP)
  *             data - the data in binary form to send to the server
  *
- *    Throws: socket_error for any network issues
+ *    Returns: true if queued, false if the server's queue is at its limits (data dropped)
+ *
+ *    Throws: runtime_error if the server ID is not in the server list
  *********************************************************************************************/
-void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
-   _queue.emplace(send, server_id, data);
+bool QueueMgr::sendToServer(const char *server_id, const SharedBuffer &data) {
+   bool found = false;
+   for (auto &server : _server_list)
+      found = found || !std::get<0>(server).compare(server_id);
+   if (!found)
+      throw std::runtime_error("Attempt to send data to server ID not in the server list.");
+
+   peer_queue &peer = _peers[server_id];
 
+   // Down or full peers go to disk, as does everything behind something already spilled
+   if (!peer.up || (peer.spill_bytes > 0) || !hasRoom(peer, data.size()))
+      return spillPayload(server_id, peer, data);
+
+   queuePayload(peer, data);
+   return true;
 }
 
 /*********************************************************************************************
- * pop - removes the next received data element sitting in the queue and returns the data 
- *       loaded into the parameters. Also assigns outgoing queue elements to a connection
- *       automatically and starts that connection going
- *
- *    Params:  sid - pop action places the first recv'd pop server id into this attribute
- *             data - data received gets loaded into this vector
+ * hasRoom - true if a payload of size bytes fits in the peer's in-memory queue. An empty queue
+ *           takes anything, so a payload bigger than the byte limit still goes out on its own
+ *           (otherwise it would stay spilled, and hold up everything spilled behind it, forever)
+ *********************************************************************************************/
+bool QueueMgr::hasRoom(peer_queue &peer, size_t size) {
+   if (peer.pending.empty())
+      return true;
+
+   if (peer.bytes + size > _max_peer_bytes)
+      return false;
+
+   if (canCoalesce(peer, size))
+      return true;
+   return peer.pending.size() < _max_peer_msgs;
+}
+
+/*********************************************************************************************
+ * canCoalesce - true if a payload of size bytes can be chained onto the newest pending entry,
+ *               which must not be in flight yet
+ *********************************************************************************************/
+bool QueueMgr::canCoalesce(peer_queue &peer, size_t size) {
+   size_t waiting = peer.pending.size() - peer.inflight;
+   if (waiting == 0)
+      return false;
+
+   out_payload &last = peer.pending.back();
+   return (last.size + size <= max_coalesce_bytes) && (last.parts.size() < max_coalesce_parts);
+}
+
+/*********************************************************************************************
+ * queuePayload - adds a payload to the peer's in-memory queue, chaining it onto the newest
+ *                entry unless that one is already in flight or full. Caller checks hasRoom
+ *                first
+ *********************************************************************************************/
+void QueueMgr::queuePayload(peer_queue &peer, const SharedBuffer &data) {
+   if (!canCoalesce(peer, data.size()))
+      peer.pending.emplace_back();
+
+   out_payload &last = peer.pending.back();
+   last.parts.push_back(data);
+   last.size += data.size();
+   peer.bytes += data.size();
+}
+
+/*********************************************************************************************
+ * spillPayload - appends a payload to the peer's spill file as a [uint32 length][payload]
+ *                record
  *
- *    Returns: true for an incoming element found, false otherwise. Returns false even if
- *             outgoing connections are found in the process 
+ *    Returns: false if the spill file is full or can't be written (payload dropped)
+ *********************************************************************************************/
+bool QueueMgr::spillPayload(const std::string &sid, peer_queue &peer, const SharedBuffer &data) {
+   if (peer.spill_bytes + sizeof(uint32_t) + data.size() > max_spill_bytes) {
+      peer.refused++;
+      return false;
+   }
+
+   if (peer.spill_file.empty())
+      peer.spill_file = _server_ID + "spill." + sid;
+
+   if (!peer.spill_out) {
+      peer.spill_out.reset(new FileFD(peer.spill_file.c_str()));
+      if (!peer.spill_out->openFile(FileFD::appendfd, true)) {
+         peer.spill_out.reset();
+         _server_log.strerrLog("Unable to open spill file, dropping payload.");
+         peer.refused++;
+         return false;
+      }
+   }
+
+   uint32_t len = data.size();
+   struct iovec record[2] = {{&len, sizeof(uint32_t)}, {(void *) data.data(), data.size()}};
+   if (peer.spill_out->writeVec(record, 2) != (ssize_t) (sizeof(uint32_t) + len)) {
+      _server_log.strerrLog("Write to spill file failed, dropping payload.");
+      peer.refused++;
+      return false;
+   }
+
+   peer.spill_bytes += sizeof(uint32_t) + len;
+   peer.spilled++;
+   return true;
+}
+
+/*********************************************************************************************
+ * drainSpill - reads the peer's spill file back into its in-memory queue in spill_read_size
+ *              chunks until the queue is full or the file is used up. Payloads are queued as
+ *              slices of the chunk they were read in. The file is only removed once everything
+ *              read back from it is acked (see reapPeerConns), so a restart before then sends
+ *              it again rather than losing it. Until then the handles stay open, and anything
+ *              spilled meanwhile is appended and read on from where we left off
+ *********************************************************************************************/
+void QueueMgr::drainSpill(const std::string &sid, peer_queue &peer) {
+   if (!peer.spill_in) {
+      peer.spill_in.reset(new FileFD(peer.spill_file.c_str()));
+      if (!peer.spill_in->openFile(FileFD::readfd)) {
+         peer.spill_in.reset();
+         _server_log.strerrLog("Unable to open spill file for reading.");
+         return;
+      }
+   }
+
+   bool queued = false;
+   while (peer.spill_bytes > 0) {
+
+      // Queue every complete record we have, as long as there is room
+      size_t avail = peer.spill_buf ? peer.spill_buf->size() - peer.spill_pos : 0;
+      if (avail >= sizeof(uint32_t)) {
+         uint32_t len;
+         memcpy(&len, peer.spill_buf->data() + peer.spill_pos, sizeof(uint32_t));
+
+         if ((avail >= sizeof(uint32_t) + len) && hasRoom(peer, len)) {
+            queuePayload(peer, SharedBuffer(peer.spill_buf, peer.spill_pos + sizeof(uint32_t), len));
+            peer.spill_pos += sizeof(uint32_t) + len;
+            peer.spill_bytes -= sizeof(uint32_t) + len;
+            queued = true;
+            continue;
+         }
+         if (avail >= sizeof(uint32_t) + len)
+            break;
+      }
+
+      // Need more - start a new chunk with the partial record and read in behind it. The old
+      // chunk stays alive as long as payloads queued from it do
+      std::vector<uint8_t> chunk;
+      if (avail > 0)
+         chunk.assign(peer.spill_buf->begin() + peer.spill_pos, peer.spill_buf->end());
+
+      std::vector<uint8_t> readbuf;
+      if (peer.spill_in->readBytes<uint8_t>(readbuf, spill_read_size) <= 0) {
+         std::stringstream msg;
+         msg << "Spill file for " << sid << " ended with " << peer.spill_bytes << 
+                " bytes unread, discarding them.";
+         _server_log.writeLog(msg.str().c_str());
+         peer.spill_bytes = 0;
+         break;
+      }
+      chunk.insert(chunk.end(), readbuf.begin(), readbuf.end());
+
+      peer.spill_buf = std::make_shared<const std::vector<uint8_t>>(std::move(chunk));
+      peer.spill_pos = 0;
+   }
+
+   // Everything in the queue up to here has to be acked before the file can go
+   if (queued) {
+      peer.spill_unacked = 0;
+      for (auto &entry : peer.pending)
+         peer.spill_unacked += entry.parts.size();
+   }
+
+   // Everything spilled is queued and nothing read back is still waiting on an ack, start
+   // fresh with the next spill
+   if ((peer.spill_bytes == 0) && (peer.spill_unacked == 0))
+      closeSpill(peer, true);
+}
+
+/*********************************************************************************************
+ * closeSpill - closes the peer's spill file handles, deleting the file if remove is set
+ *********************************************************************************************/
+void QueueMgr::closeSpill(peer_queue &peer, bool remove) {
+   if (peer.spill_out)
+      peer.spill_out->closeFD();
+   if (peer.spill_in)
+      peer.spill_in->closeFD();
+   peer.spill_out.reset();
+   peer.spill_in.reset();
+   peer.spill_buf.reset();
+   peer.spill_pos = 0;
+
+   if (remove)
+      std::remove(peer.spill_file.c_str());
+}
+
+/*********************************************************************************************
+ * setQueueLimits - sets the most bytes and separate payloads held for any one peer
+ *********************************************************************************************/
+void QueueMgr::setQueueLimits(size_t max_bytes, size_t max_msgs) {
+   _max_peer_bytes = max_bytes;
+   _max_peer_msgs = (max_msgs > 0) ? max_msgs : 1;
+}
+
+/*********************************************************************************************
+ * isBackedUp - true if the peer's queue is at its limits, so new data may be refused
+ * allBackedUp - true if every peer is backed up
+ * isPeerUp - false if the last attempt to reach the peer failed
+ *********************************************************************************************/
+bool QueueMgr::isBackedUp(const char *server_id) {
+   auto it = _peers.find(server_id);
+   if (it == _peers.end())
+      return false;
+   return ((it->second.pending.size() >= _max_peer_msgs) ||
+           (it->second.bytes >= _max_peer_bytes)) &&
+          (it->second.spill_bytes >= max_spill_bytes);
+}
+
+bool QueueMgr::allBackedUp() {
+   for (auto &server : _server_list) {
+      if (!isBackedUp(std::get<0>(server).c_str()))
+         return false;
+   }
+   return !_server_list.empty();
+}
+
+bool QueueMgr::isPeerUp(const char *server_id) {
+   auto it = _peers.find(server_id);
+   return (it == _peers.end()) || it->second.up;
+}
+
+/*********************************************************************************************
+ * servicePeers - dials the session to each peer we're responsible for dialing (once its
+ *                backoff is up if the last one failed), and sends waiting payloads on every
+ *                open session, up to max_inflight_sends ahead of the acks
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
-   while (_queue.size() > 0) {
-      auto next_qe = _queue.front();
+void QueueMgr::servicePeers() {
+   time_t now = time(NULL);
+   unsigned long long now_ms = monoMs();
+
+   for (auto &entry : _peers) {
+      peer_queue &peer = entry.second;
+
+      // Reachable peers (or ones we have nothing else to try with) get their spill read back
+      if ((peer.spill_bytes > 0) && (peer.up || peer.pending.empty()))
+         drainSpill(entry.first, peer);
+
+      if ((peer.session == nullptr) && dialsPeer(entry.first) && (peer.retry <= now_ms)) {
+         peer.session = launchSession(entry.first.c_str(), peer.ticket);
+         peer.progress = now;
+         if (peer.session == nullptr) {
+            scheduleRedial(entry.first, peer);
+            setPeerUp(entry.first, peer, false);
+         }
+      }
 
-      // If this a send item, create a connection and start sending
-      if (next_qe.type == send) {
+      if ((peer.session == nullptr) || !peer.session->isSession())
+         continue;
 
-         // Set up the connection and attempt to establish link (will retry if failure)
-         launchDataConn(next_qe.server_id.c_str(), next_qe.data);
+      while ((peer.inflight < peer.pending.size()) && (peer.inflight < max_inflight_sends)) {
+         if (!peer.session->sendPayload(peer.pending[peer.inflight].parts)) {
+            dropSession(entry.first, peer);
+            break;
+         }
+         if (peer.inflight == 0)
+            peer.progress = now;
+         peer.inflight++;
+      }
+   }
+}
 
-         _queue.pop();
-         continue;  
+/*********************************************************************************************
+ * reapPeerConns - picks up sessions that peers dialed to us, releases payloads the peer acked
+ *                 and drops sessions that failed or have sat on unacked payloads for longer
+ *                 than send_timeout. Unacked payloads stay queued and go out again on the
+ *                 next session
+ *********************************************************************************************/
+void QueueMgr::reapPeerConns() {
+   time_t now = time(NULL);
+
+   // A session a peer dialed replaces any we had (it must have restarted)
+   for (auto *conns : {&_connlist, &_remote_conns}) {
+      for (auto &conn : *conns) {
+         if (!conn->isSession())
+            continue;
+
+         auto it = _peers.find(conn->getNodeID());
+         if ((it == _peers.end()) || (it->second.session == conn.get()) || dialsPeer(it->first))
+            continue;
+
+         if (it->second.session != nullptr)
+            dropSession(it->first, it->second);
+         it->second.session = conn.get();
+         it->second.progress = now;
       }
+   }
 
-      sid = next_qe.server_id;
-      data = std::move(next_qe.data);
-      _queue.pop();
-      return true;
+   for (auto &entry : _peers) {
+      peer_queue &peer = entry.second;
+      if (peer.session == nullptr)
+         continue;
+
+      if (peer.session->isSession()) {
+         unsigned int acks = std::min<size_t>(peer.session->takeAcks(), peer.inflight);
+         for (unsigned int i=0; i<acks; i++) {
+            peer.bytes -= peer.pending.front().size;
+            peer.spill_unacked -= std::min(peer.spill_unacked, peer.pending.front().parts.size());
+            peer.pending.pop_front();
+            peer.inflight--;
+            peer.sent++;
+         }
+         if (acks > 0)
+            peer.progress = now;
+
+         // The peer has everything we read back from the spill file, so it can go
+         if ((acks > 0) && (peer.spill_unacked == 0) && (peer.spill_bytes == 0) && peer.spill_in)
+            closeSpill(peer, true);
+
+         peer.session->takeTicket(peer.ticket);
+         peer.failures = 0;
+         setPeerUp(entry.first, peer, true);
+
+         if ((peer.inflight == 0) || (now - peer.progress < send_timeout))
+            continue;
+
+         std::stringstream msg;
+         msg << "Session to " << entry.first << " sat on unacked data for " << send_timeout <<
+                "s, dropping it.";
+         _server_log.writeLog(msg.str().c_str());
+      } else if (peer.session->isConnected() &&
+                 (now - peer.progress < (peer.session->isDialing() ? dial_timeout : send_timeout))) {
+         continue;      // Still connecting or authenticating
+      }
+
+      dropSession(entry.first, peer);
    }
-   return false;
 }
 
 /*********************************************************************************************
- * launchDataConn - launches a connection and starts the process of sending the queue data to
- *                  the target server
+ * dropSession - closes the peer's session and takes it out of the connection list (unless it
+ *               still holds received frames for populateQueue, then TCPServer cleans it up).
+ *               A session on another thread is closed by that thread, and collectSessions
+ *               lets go of it once it's closed and drained. Anything in flight is resent on
+ *               the next session, dialed once the backoff is up
+ *********************************************************************************************/
+void QueueMgr::dropSession(const std::string &sid, peer_queue &peer) {
+   TCPConn *session = peer.session;
+   peer.session = nullptr;
+   peer.inflight = 0;
+   scheduleRedial(sid, peer);
+   setPeerUp(sid, peer, false);
+
+   for (auto conn_it = _connlist.begin(); conn_it != _connlist.end(); conn_it++) {
+      if (conn_it->get() == session) {
+         session->disconnect();
+         if (!session->isInputDataReady())
+            _connlist.erase(conn_it);
+         return;
+      }
+   }
+   session->requestClose();
+}
+
+/*********************************************************************************************
+ * scheduleRedial - counts a failed dial (or a session that failed) and sets when to dial the
+ *                  peer again: an exponential backoff, or the breaker's cooldown once it has
+ *                  failed breaker_threshold times in a row. The wait is cut by a random amount
+ *                  of up to half, so peers that lost each other together don't redial together
+ *********************************************************************************************/
+void QueueMgr::scheduleRedial(const std::string &sid, peer_queue &peer) {
+   peer.failures++;
+
+   unsigned long long delay;
+   if (peer.failures < breaker_threshold) {
+      delay = std::min<unsigned long long>(dial_backoff_max_ms,
+                                           (unsigned long long) dial_backoff_min_ms <<
+                                           std::min(peer.failures - 1, 16u));
+   } else {
+      delay = breaker_cooldown_ms;
+      if ((peer.failures == breaker_threshold) && dialsPeer(sid)) {
+         std::stringstream msg;
+         msg << "Peer " << sid << " failed " << breaker_threshold << " times in a row, only " <<
+                "trying it every " << breaker_cooldown_ms / 1000 << "s until it answers.";
+         _server_log.writeLog(msg.str().c_str());
+      }
+   }
+
+   delay -= std::uniform_int_distribution<unsigned long long>(0, delay / 2)(_rng);
+   peer.retry = monoMs() + delay;
+}
+
+/*********************************************************************************************
+ * collectSessions - takes the sessions that peers dialed and opened on the other network
+ *                   threads, so reapPeerConns can adopt them, and lets go of the ones that have
+ *                   closed with nothing left to read and that no peer is using
+ *********************************************************************************************/
+void QueueMgr::collectSessions() {
+   for (auto &reactor : _reactors) {
+      std::shared_ptr<TCPConn> conn;
+      while (reactor->takeOpened(conn))
+         _remote_conns.push_back(std::move(conn));
+   }
+
+   auto conn_it = _remote_conns.begin();
+   while (conn_it != _remote_conns.end()) {
+      bool in_use = false;
+      for (auto &entry : _peers)
+         in_use = in_use || (entry.second.session == conn_it->get());
+
+      if (in_use || (*conn_it)->isConnected() || (*conn_it)->isInputDataReady())
+         conn_it++;
+      else
+         conn_it = _remote_conns.erase(conn_it);
+   }
+}
+
+/*********************************************************************************************
+ * setupConn - connections we accept answer the peer's SID with ours
+ *********************************************************************************************/
+void QueueMgr::setupConn(TCPConn *conn) {
+   conn->setSvrID(getServerID());
+}
+
+/*********************************************************************************************
+ * getPeerTimeout - shortens timeout_ms so we wake up when a dial, send, or connect, handshake or
+ *                  send timeout is due
+ *********************************************************************************************/
+int QueueMgr::getPeerTimeout(int timeout_ms) {
+   time_t now = time(NULL);
+   unsigned long long now_ms = monoMs();
+
+   for (auto &entry : _peers) {
+      peer_queue &peer = entry.second;
+      time_t due;
+      if ((peer.session != nullptr) && peer.session->isSession()) {
+         if ((peer.inflight < peer.pending.size()) && (peer.inflight < max_inflight_sends))
+            due = now;
+         else if (peer.inflight > 0)
+            due = peer.progress + send_timeout;
+         else
+            continue;
+      } else if (peer.session != nullptr) {
+         // Connect or handshake timeout
+         due = peer.progress + (peer.session->isDialing() ? dial_timeout : send_timeout);
+      } else if (dialsPeer(entry.first)) {
+         int retry_ms = (peer.retry > now_ms) ? peer.retry - now_ms : 0;
+         if ((timeout_ms < 0) || (retry_ms < timeout_ms))
+            timeout_ms = retry_ms;
+         continue;
+      } else {
+         continue;
+      }
+
+      int peer_ms = (due > now) ? (due - now) * 1000 : 0;
+      if ((timeout_ms < 0) || (peer_ms < timeout_ms))
+         timeout_ms = peer_ms;
+   }
+   return timeout_ms;
+}
+
+/*********************************************************************************************
+ * setPeerUp - tracks whether a peer is reachable, logging when that changes
+ *********************************************************************************************/
+void QueueMgr::setPeerUp(const std::string &sid, peer_queue &peer, bool up) {
+   if (peer.up == up)
+      return;
+   peer.up = up;
+
+   std::stringstream msg;
+   msg << "Peer " << sid << (up ? " is back up" : " is down") << " (" << peer.pending.size() <<
+          " payloads, " << peer.bytes << " bytes queued, " << peer.spill_bytes << 
+          " bytes spilled, " << peer.refused << " refused).";
+   _server_log.writeLog(msg.str().c_str());
+   if (_verbosity >= 2)
+      std::cout << msg.str() << "\n";
+}
+
+/*********************************************************************************************
+ * pop - removes the next received data element sitting in the queue and returns the data 
+ *       loaded into the parameters. Outgoing data is sent from the per-peer queues
  *
  *    Params:  sid - pop action places the first recv'd pop server id into this attribute
- *             data - data received gets loaded into this vector
+ *             data - data received gets loaded into this buffer, which shares the
+ *                    connection's receive chunk instead of copying it
+ *
+ *    Returns: true for an incoming element found, false otherwise
  *
  *********************************************************************************************/
-void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
+bool QueueMgr::pop(std::string &sid, SharedBuffer &data) {
+   if (_queue.empty())
+      return false;
+
+   sid = _queue.front().server_id;
+   data = std::move(_queue.front().data);
+   _queue.pop();
+   return true;
+}
+
+/*********************************************************************************************
+ * launchSession - connects to the target server and starts the handshake that opens the
+ *                 session. Data goes out once it's open
+ *
+ *    Params:  sid - the server to connect to
+ *             ticket - the peer's ticket from our last session with it, if any
+ *
+ *    Returns: the new connection (in _connlist, or _remote_conns if it went to another network
+ *             thread) with its connect underway, or nullptr if the connect failed right away
+ *
+ *********************************************************************************************/
+TCPConn *QueueMgr::launchSession(const char *sid, const ResumeTicket &ticket) {
 
    unsigned long ip_addr;
    unsigned short port;
@@ -292,24 +861,50 @@ void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
       throw std::runtime_error("Attempt to send data to server ID not in the server list.");
    }
 
+   // Dialed sessions take turns between the network threads (0 is ours)
+   ConnReactor *reactor = nullptr;
+   if (!_reactors.empty()) {
+      _next_reactor = (_next_reactor + 1) % (_reactors.size() + 1);
+      if (_next_reactor > 0)
+         reactor = _reactors[_next_reactor - 1].get();
+   }
+
    // Try to connect to the server and if there's an issue, delete and re-throw socket_error
-   TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+   std::shared_ptr<TCPConn> new_conn;
+   if (reactor == nullptr)
+      new_conn.reset(new TCPConn(_server_log, _aes_key, _verbosity));
+   else
+      new_conn.reset(new TCPConn(reactor->getLog(), reactor->getKey(), _verbosity));
    new_conn->setNodeID(sid);
    new_conn->setSvrID(getServerID());
+   new_conn->setTicket(ticket);
 
+   // Peers with a Unix socket are on this host, so skip the TCP stack, and maybe the kernel
+   auto unix_path = _unix_paths.find(sid);
    try {
-      new_conn->connect(ip_addr, port);
+      if (unix_path != _unix_paths.end()) {
+         if (_shm_peers.count(sid) > 0)
+            new_conn->useSharedMemory();
+         new_conn->connectUnix(unix_path->second.c_str());
+      } else
+         new_conn->connect(ip_addr, port);
    } catch (socket_error &e) {
       std::stringstream msg;
-      msg << "Connect to SID " << sid << " failed when trying to send data. Retrying. Msg: " <<
+      msg << "Connect to SID " << sid << " failed when opening a session. Retrying. Msg: " <<
                         e.what();
       _server_log.writeLog(msg.str().c_str());
-      new_conn->disconnect();
-      new_conn->reconnect = time(NULL) + reconnect_delay;  // Try again in 5 seconds, real-world
+      return nullptr;   // Data stays queued, servicePeers retries after a backoff
    }
 
-
-   new_conn->assignOutgoingData(data);
-   _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
+   if (reactor == nullptr) {
+      watchConn(new_conn.get());
+      _connlist.push_back(new_conn);
+   } else {
+      if (!reactor->adopt(new_conn)) {
+         new_conn->disconnect();
+         return nullptr;
+      }
+      _remote_conns.push_back(new_conn);
+   }
+   return new_conn.get();
 }
-
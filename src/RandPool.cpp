@@ -0,0 +1,64 @@
+#include <cstring>
+#include <algorithm>
+#include <crypto++/osrng.h>
+#include "RandPool.h"
+
+using namespace CryptoPP;
+
+namespace {
+
+   /******************************************************************************************
+    * RandPool - one thread's generator and the unused part of its last block of output
+    ******************************************************************************************/
+
+   class RandPool
+   {
+   public:
+      RandPool():_pos(rand_pool_size) { };
+      ~RandPool() { memset(_buf, 0, sizeof(_buf)); };
+
+      void get(uint8_t *dest, size_t len) {
+         // Big requests skip the buffer rather than draining it for nothing
+         if (len >= rand_pool_size / 4) {
+            _rng.GenerateBlock(dest, len);
+            return;
+         }
+
+         while (len > 0) {
+            if (_pos == rand_pool_size) {
+               _rng.GenerateBlock(_buf, rand_pool_size);
+               _pos = 0;
+            }
+
+            size_t n = std::min(len, rand_pool_size - _pos);
+            memcpy(dest, _buf + _pos, n);
+            memset(_buf + _pos, 0, n);
+            _pos += n;
+            dest += n;
+            len -= n;
+         }
+      }
+
+   private:
+      AutoSeededRandomPool _rng;
+      uint8_t _buf[rand_pool_size];
+      size_t _pos;
+   };
+
+   thread_local RandPool pool;
+}
+
+/*********************************************************************************************
+ * randomBytes - serves len bytes from this thread's pool, refilling it as needed
+ *
+ *    Params:  dest/len - where the random bytes go
+ *********************************************************************************************/
+
+void randomBytes(uint8_t *dest, size_t len) {
+   pool.get(dest, len);
+}
+
+void randomBytes(std::vector<uint8_t> &dest, size_t len) {
+   dest.resize(len);
+   pool.get(dest.data(), len);
+}
@@ -0,0 +1,90 @@
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include "RecvBuffer.h"
+
+/*********************************************************************************************
+ * RecvBuffer (constructor) - starts with one empty chunk
+ *
+ *    Params:  chunk_size - size of each chunk (frames bigger than this get a chunk their size)
+ *********************************************************************************************/
+
+RecvBuffer::RecvBuffer(size_t chunk_size):
+                  _chunk(std::make_shared<std::vector<uint8_t>>(chunk_size)),
+                  _rpos(0),
+                  _wpos(0),
+                  _chunk_size(chunk_size),
+                  _shared(false)
+{
+}
+
+/*********************************************************************************************
+ * space - returns where the next read should go, making room first if less than
+ *         min_recv_space is left at the end of the chunk
+ *********************************************************************************************/
+
+uint8_t *RecvBuffer::space() {
+   if (spaceSize() < min_recv_space)
+      reserve(size() + min_recv_space);
+   return _chunk->data() + _wpos;
+}
+
+/*********************************************************************************************
+ * consume - drops unread bytes from the front, starting over at the front of the chunk when
+ *           everything is read and none of it was ever shared
+ *
+ *    Throws: out_of_range if len is more than is unread
+ *********************************************************************************************/
+
+void RecvBuffer::consume(size_t len) {
+   if (len > size())
+      throw std::out_of_range("RecvBuffer consume past the end of the data.");
+
+   _rpos += len;
+   if ((_rpos == _wpos) && !_shared)
+      _rpos = _wpos = 0;
+}
+
+/*********************************************************************************************
+ * share - a view of unread bytes that shares the chunk rather than copying them. The bytes
+ *         never change afterward: the only writes are reads past _wpos and in-place changes
+ *         to unread bytes before they're shared, and a chunk that has handed out views is
+ *         never reused (even once they're gone - whoever held them last may have been
+ *         another thread, and dropping the view doesn't order its reads before our next
+ *         write)
+ *
+ *    Throws: out_of_range if the view runs past the unread bytes
+ *********************************************************************************************/
+
+SharedBuffer RecvBuffer::share(size_t offset, size_t len) {
+   if (offset + len > size())
+      throw std::out_of_range("RecvBuffer share past the end of the data.");
+   if (len == 0)
+      return SharedBuffer();
+
+   _shared = true;
+   return SharedBuffer(_chunk, _rpos + offset, len);
+}
+
+/*********************************************************************************************
+ * reserve - makes sure need bytes, starting with the unread ones, fit in the chunk from the
+ *           read position. Moves the unread bytes to the front if the chunk was never shared
+ *           and is big enough, otherwise into a new chunk (of at least need bytes)
+ *********************************************************************************************/
+
+void RecvBuffer::reserve(size_t need) {
+   if (_chunk->size() - _rpos >= need)
+      return;
+
+   size_t unread = size();
+   if (!_shared && (_chunk->size() >= need)) {
+      memmove(_chunk->data(), _chunk->data() + _rpos, unread);
+   } else {
+      auto fresh = std::make_shared<std::vector<uint8_t>>(std::max(_chunk_size, need));
+      memcpy(fresh->data(), _chunk->data() + _rpos, unread);
+      _chunk = fresh;
+      _shared = false;
+   }
+   _rpos = 0;
+   _wpos = unread;
+}
@@ -0,0 +1,163 @@
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include "ReplLog.h"
+#include "FileDesc.h"
+#include "strfuncts.h"
+
+ReplLog::ReplLog():
+               _flushed(0)
+{
+}
+
+ReplLog::~ReplLog() {
+}
+
+/*********************************************************************************************
+ * open - loads the journal and acked watermarks for this server. A missing file just means
+ *        we are starting fresh
+ *
+ *    Params:  sid - this server's ID, used to name the files
+ *
+ *    Throws: runtime_error if the journal is corrupt
+ *********************************************************************************************/
+
+void ReplLog::open(const char *sid) {
+   _journal_file = sid;
+   _journal_file += "repl.journal";
+   _state_file = sid;
+   _state_file += "repl.state";
+
+   _plots.clear();
+   _acked.clear();
+
+   FileFD journal(_journal_file.c_str());
+   if (journal.openFile(FileFD::readfd)) {
+      std::vector<uint8_t> buf;
+      ssize_t size = journal.readFile(buf);
+      journal.closeFD();
+
+      unsigned int ppsize = DronePlot::getDataSize();
+      if (size < 0)
+         throw std::runtime_error("Unable to read the replication journal.");
+      if (buf.size() % ppsize != 0)
+         throw std::runtime_error("Replication journal is corrupt (partial plot at the end).");
+
+      _plots.reserve(_plots.size() + buf.size() / ppsize);
+      for (size_t pos = 0; pos < buf.size(); pos += ppsize) {
+         _plots.emplace_back();
+         _plots.back().deserialize(buf, pos);
+      }
+   }
+   _flushed = _plots.size();
+
+   std::ifstream state(_state_file, std::ifstream::in);
+   std::string buf, left, right;
+   while (state.is_open() && std::getline(state, buf)) {
+      clrNewlines(buf);
+      if (!split(buf, left, right, ','))
+         continue;
+      clrSpaces(left);
+      clrSpaces(right);
+      _acked[left] = strtoull(right.c_str(), NULL, 10);
+   }
+}
+
+/*********************************************************************************************
+ * append - assigns the next sequence number to a plot and keeps a copy for catch-up
+ *********************************************************************************************/
+
+uint64_t ReplLog::append(DronePlot &plot) {
+   _plots.push_back(plot);
+   return _plots.size();
+}
+
+/*********************************************************************************************
+ * flush - appends any plots not yet on disk to the journal
+ *
+ *    Throws: runtime_error if the journal can't be written
+ *********************************************************************************************/
+
+void ReplLog::flush() {
+   if ((_flushed == _plots.size()) || _journal_file.empty())
+      return;
+
+   std::vector<uint8_t> buf;
+   for (size_t i=_flushed; i<_plots.size(); i++)
+      _plots[i].serialize(buf);
+
+   FileFD journal(_journal_file.c_str());
+   if (!journal.openFile(FileFD::appendfd, true))
+      throw std::runtime_error("Unable to open the replication journal for writing.");
+   if (journal.writeBytes<uint8_t>(buf) != (int) buf.size())
+      throw std::runtime_error("Write to the replication journal failed.");
+   journal.closeFD();
+
+   _flushed = _plots.size();
+}
+
+/*********************************************************************************************
+ * getRange - copies plots starting at a sequence number for a catch-up
+ *
+ *    Params:  from - first seq wanted (1 = the start of the log)
+ *             max - most plots to copy
+ *             plots - plots are added here
+ *
+ *    Returns: number of plots copied
+ *********************************************************************************************/
+
+unsigned int ReplLog::getRange(uint64_t from, unsigned int max, std::vector<DronePlot> &plots) {
+   if (from == 0)
+      from = 1;
+
+   unsigned int count = 0;
+   for (uint64_t seq = from; (seq <= _plots.size()) && (count < max); seq++, count++)
+      plots.push_back(_plots[seq-1]);
+   return count;
+}
+
+/*********************************************************************************************
+ * ack - moves a peer's watermark forward (never back) and saves the state file
+ *********************************************************************************************/
+
+void ReplLog::ack(const std::string &peer, uint64_t upto) {
+   if (upto > _plots.size())
+      upto = _plots.size();
+
+   uint64_t &acked = _acked[peer];
+   if (upto <= acked)
+      return;
+
+   acked = upto;
+   saveState();
+}
+
+uint64_t ReplLog::getAcked(const std::string &peer) {
+   auto it = _acked.find(peer);
+   return (it == _acked.end()) ? 0 : it->second;
+}
+
+/*********************************************************************************************
+ * saveState - writes the watermarks to a temp file and renames it over the old one, so a crash
+ *             mid-write leaves the previous state intact
+ *
+ *    Throws: runtime_error if the state file can't be written
+ *********************************************************************************************/
+
+void ReplLog::saveState() {
+   if (_state_file.empty())
+      return;
+
+   std::string tmpfile = _state_file + ".tmp";
+   std::ofstream state(tmpfile, std::ofstream::out | std::ofstream::trunc);
+   if (!state.is_open())
+      throw std::runtime_error("Unable to write the replication state file.");
+
+   for (auto &peer : _acked)
+      state << peer.first << "," << peer.second << "\n";
+   state.close();
+
+   if (state.fail() || (std::rename(tmpfile.c_str(), _state_file.c_str()) != 0))
+      throw std::runtime_error("Unable to save the replication state file.");
+}
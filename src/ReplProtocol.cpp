@@ -0,0 +1,51 @@
+#include <stdexcept>
+#include "ReplProtocol.h"
+
+/*********************************************************************************************
+ * appendReplMsg - adds a length/type header and the body to the end of the buffer
+ *
+ *    Params:  buf - the payload being built
+ *             type - a repl_msg_type
+ *             body/len - the message body
+ *********************************************************************************************/
+
+void appendReplMsg(std::vector<uint8_t> &buf, uint8_t type, const uint8_t *body, size_t len) {
+   packField<uint32_t>(buf, static_cast<uint32_t>(len + 1));
+   buf.push_back(type);
+   buf.insert(buf.end(), body, body + len);
+}
+
+void appendReplMsg(std::vector<uint8_t> &buf, uint8_t type, const std::vector<uint8_t> &body) {
+   appendReplMsg(buf, type, body.data(), body.size());
+}
+
+/*********************************************************************************************
+ * nextReplMsg - gets the next message out of a payload without copying it
+ *
+ *    Params:  buf/size - the payload
+ *             pos - where the next message starts, advanced past it on return
+ *             type/body/len - loaded with the message found (body points into buf)
+ *
+ *    Returns: true if a message was found, false if pos was at the end of the payload
+ *
+ *    Throws: runtime_error if the payload is truncated or malformed
+ *********************************************************************************************/
+
+bool nextReplMsg(const uint8_t *buf, size_t size, size_t &pos, uint8_t &type,
+                                                  const uint8_t *&body, size_t &len) {
+   if (pos >= size)
+      return false;
+
+   if (size - pos < sizeof(uint32_t) + 1)
+      throw std::runtime_error("Replication message header truncated");
+
+   uint32_t msglen = unpackField<uint32_t>(buf + pos);
+   if ((msglen < 1) || (msglen > size - pos - sizeof(uint32_t)))
+      throw std::runtime_error("Replication message length runs past the end of the payload");
+
+   type = buf[pos + sizeof(uint32_t)];
+   body = buf + pos + sizeof(uint32_t) + 1;
+   len = msglen - 1;
+   pos += sizeof(uint32_t) + msglen;
+   return true;
+}
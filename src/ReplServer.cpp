@@ -1,9 +1,15 @@
 #include <iostream>
 #include <exception>
+#include <cmath>
+#include <algorithm>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #include "ReplServer.h"
+#include "ReplProtocol.h"
 
 const time_t secs_between_repl = 20;
-const unsigned int max_servers = 10;
+const time_t secs_between_ae = 60;
 
 /*********************************************************************************************
  * ReplServer (constructor) - creates our ReplServer. Initializes:
@@ -18,7 +24,19 @@ ReplServer::ReplServer(DronePlotDB &plotdb, float time_mult)
                               :_queue(1),
                                _plotdb(plotdb),
                                _shutdown(false), 
+                               _rx_raw(stage_ring_size),
+                               _rx_plots(stage_ring_size),
+                               _tx_out(stage_ring_size),
+                               _gossip_fanout(0),
+                               _gossip_ttl(0),
+                               _rng(std::random_device{}()),
                                _time_mult(time_mult),
+                               _repl_mode(repl_batch),
+                               _max_delay_ms(default_stream_delay_ms),
+                               _max_batch(default_stream_batch),
+                               _pending_new(0),
+                               _pending_since(0),
+                               _last_flush(0),
                                _verbosity(1),
                                _ip_addr("127.0.0.1"),
                                _port(9999),
@@ -31,7 +49,19 @@ ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short
                                  :_queue(verbosity),
                                   _plotdb(plotdb),
                                   _shutdown(false), 
+                                  _rx_raw(stage_ring_size),
+                                  _rx_plots(stage_ring_size),
+                                  _tx_out(stage_ring_size),
+                                  _gossip_fanout(0),
+                                  _gossip_ttl(0),
+                                  _rng(std::random_device{}()),
                                   _time_mult(time_mult), 
+                                  _repl_mode(repl_batch),
+                                  _max_delay_ms(default_stream_delay_ms),
+                                  _max_batch(default_stream_batch),
+                                  _pending_new(0),
+                                  _pending_since(0),
+                                  _last_flush(0),
                                   _verbosity(verbosity),
                                   _ip_addr(ip_addr),
                                   _port(port),
@@ -41,7 +71,7 @@ ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short
 }
 
 ReplServer::~ReplServer() {
-
+   _plotdb.setNotifyFD(-1);
 }
 
 
@@ -54,6 +84,84 @@ double ReplServer::getAdjustedTime() {
    return static_cast<double>(time(nullptr) - _start_time) * _time_mult;
 }
 
+/**********************************************************************************************
+ * msUntilSimTime - how long the replication loop can sleep before getAdjustedTime() passes
+ *                  sim_time (e.g. when the next periodic replication is due). getAdjustedTime
+ *                  has one second resolution, so this finds the real second at which it will
+ *                  cross the threshold
+ **********************************************************************************************/
+
+int ReplServer::msUntilSimTime(double sim_time) {
+   timeval now;
+   gettimeofday(&now, NULL);
+
+   // First whole real-time second where getAdjustedTime() > sim_time
+   double due = std::floor(_start_time + sim_time / _time_mult) + 1.0;
+   double wait_ms = (due - (now.tv_sec + now.tv_usec / 1000000.0)) * 1000.0;
+
+   if (wait_ms <= 0.0)
+      return 0;
+   return static_cast<int>(std::ceil(wait_ms));
+}
+
+/**********************************************************************************************
+ * msUntilStreamFlush - how long until the pending micro-batch hits its max delay (-1 if there
+ *                      is nothing pending, or the network stage has no room for it yet and
+ *                      will wake us when it does)
+ **********************************************************************************************/
+
+int ReplServer::msUntilStreamFlush() {
+   if ((_pending_new == 0) || _tx_out.full())
+      return -1;
+
+   unsigned long long due = _pending_since + _max_delay_ms;
+   unsigned long long now = getMonoMs();
+   return (due > now) ? static_cast<int>(due - now) : 0;
+}
+
+// Monotonic clock in milliseconds for timing micro-batches
+unsigned long long ReplServer::getMonoMs() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return static_cast<unsigned long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**********************************************************************************************
+ * setReplMode - selects periodic batch replication or streaming replication
+ *
+ *    Params:  mode - repl_batch or repl_stream
+ *             max_delay_ms - streaming: longest a new plot waits for its micro-batch to fill
+ *             max_batch - streaming: most plots sent in one micro-batch
+ **********************************************************************************************/
+
+void ReplServer::setReplMode(repl_mode mode, unsigned int max_delay_ms, unsigned int max_batch) {
+   _repl_mode = mode;
+   _max_delay_ms = max_delay_ms;
+   _max_batch = (max_batch > 0) ? max_batch : 1;
+}
+
+/**********************************************************************************************
+ * setGossip - selects gossip dissemination (fanout > 0) or the full mesh (fanout = 0)
+ *
+ *    Params:  fanout - peers each round's batches are pushed to
+ *             ttl - hops a batch is forwarded (0 = enough to cover the cluster, worked out once
+ *                   the server list is loaded)
+ **********************************************************************************************/
+
+void ReplServer::setGossip(unsigned int fanout, unsigned int ttl) {
+   _gossip_fanout = fanout;
+   _gossip_ttl = (ttl > 255) ? 255 : ttl;
+}
+
+/**********************************************************************************************
+ * setDedupTolerances - sets the time window (secs) and lat/long distance (degrees) within which
+ *                      two plots of the same drone are deduplicated
+ **********************************************************************************************/
+
+void ReplServer::setDedupTolerances(time_t time_tol, float latlon_tol) {
+   _dedup.setTolerances(time_tol, latlon_tol, latlon_tol);
+}
+
 /**********************************************************************************************
  * replicate - the main function managing replication activities. Manages the QueueMgr and reads
  *             from the queue, deconflicting entries and populating the DronePlotDB object with
@@ -75,6 +183,7 @@ void ReplServer::replicate() {
    // Track when we started the server
    _start_time = time(NULL);
    _last_repl = 0;
+   _last_ae = 0;
 
    // Set up our queue's listening socket
    _queue.bindSvr(_ip_addr.c_str(), _port);
@@ -83,76 +192,542 @@ void ReplServer::replicate() {
    if (_verbosity >= 2)
       std::cout << "Server bound to " << _ip_addr << ", port: " << _port << " and listening\n";
 
-  
-   // Replicate until we get the shutdown signal
+   // send vital information to the Dedup object Voltz
+   // get the SID of the server 
+   std::string sidStr = _queue.getServerID();
+   mySID = std::stoi(sidStr.substr(2));
+   // get the leader 
+   election();
+   // send the vital information
+   _dedup.setValues(mySID, _leader, _numServers);
+
+   // Pick up our sequence log from the last run. Plots already logged count as sent, so a
+   // restart doesn't resend them, and anything a peer never acknowledged goes out again
+   _repl_log.open(_queue.getServerID());
+   for (auto &plot : _repl_log.getPlots())
+      _ae.addLocal(plot);
+
+   for (auto &server : _queue.getServerList())
+      _peer_ids.push_back(std::get<0>(server));
+
+   // Gossip mode doesn't ack (that would be a message to every origin), so peers pull what
+   // they're missing when the next batch shows them a gap
+   if (_gossip_fanout == 0) {
+      for (auto &peer : _peer_ids) {
+         uint64_t acked = _repl_log.getAcked(peer);
+         if (acked < _repl_log.getHead())
+            queueCatchup(peer, acked + 1);
+      }
+   } else {
+      if (_gossip_ttl == 0) {
+         // Enough hops for fanout^ttl to cover the cluster, plus some slack for overlap. A
+         // fanout of one is a random walk and only reaches one more peer per hop
+         _gossip_ttl = 2;
+         for (size_t reach = 1; reach < _peer_ids.size();
+              reach = (_gossip_fanout > 1) ? reach * _gossip_fanout : reach + 1)
+            _gossip_ttl++;
+      }
+      pickGossipTargets();
+   }
+
+   // New plots in the database wake the apply stage, as do decoded batches
+   _plotdb.setNotifyFD(_newplot_fd.getFD());
+   _apply_loop.addFD(_newplot_fd.getFD(), EPOLLIN);
+
+   // Launch the network and decode stages, this thread becomes the apply stage
+   _net_thread = std::thread(&ReplServer::networkStage, this);
+   _decode_thread = std::thread(&ReplServer::decodeStage, this);
+   pthread_setname_np(pthread_self(), "repl-apply");
+
+   applyStage();
+
+   // Wake the other stages so they see the shutdown and wait for them to exit
+   _queue.wakeup();
+   _decode_loop.wakeup();
+   _net_thread.join();
+   _decode_thread.join();
+   _plotdb.setNotifyFD(-1);
+
+   // do the final check Voltz
+   _dedup.removeDuplicates();  
+}
+
+/**********************************************************************************************
+ * networkStage - thread that owns the QueueMgr and all the sockets. Sleeps in the event loop
+ *                until there is network activity or a wakeup, hands outgoing batches from the
+ *                apply stage to the queue, and passes received replication data on to the
+ *                decode stage. Never touches the database, so a slow dedup can't stall reads or
+ *                acknowledgements
+ **********************************************************************************************/
+
+void ReplServer::networkStage() {
+   pthread_setname_np(pthread_self(), "repl-net");
+
    while (!_shutdown) {
 
-      // Check for new connections, process existing connections, and populate the queue as applicable
-      _queue.handleQueue();   
+      // If the decode stage is backed up, check back shortly instead of sleeping on sockets
+      _queue.handleQueue(_rx_raw.full() ? 1 : -1);
+
+      // Outgoing batches produced by the apply stage. If every peer's queue is full, leave them
+      // in _tx_out so the apply stage backs off and holds its new plots. A single backed-up peer
+      // just misses the batch and pulls it later with a catch-up request. Only the apply stage
+      // fills _tx_out, so if it's full here the apply stage may be holding a batch for the room
+      ReplMsg outgoing;
+      bool made_room = false;
+      while (!_queue.allBackedUp()) {
+         made_room = made_room || _tx_out.full();
+         if (!_tx_out.pop(outgoing))
+            break;
+
+         bool queued;
+         if (outgoing.sid.empty())
+            queued = (_queue.sendToAll(outgoing.data) == _queue.getNumServers());
+         else
+            queued = _queue.sendToServer(outgoing.sid.c_str(), outgoing.data);
+
+         if (!queued && (_verbosity >= 2))
+            std::cout << "Outbound queue full for a backed-up peer, batch dropped for it.\n";
+      }
+      if (made_room)
+         _apply_loop.wakeup();
+
+      // Check the queue for updates and pop them while the decode stage has room. The pop command only
+      // returns incoming replication information, outgoing data is sent from the per-peer queues
+      ReplMsg msg;
+      bool received = false;
+      while (!_rx_raw.full() && _queue.pop(msg.sid, msg.data)) {
+         _rx_raw.push(std::move(msg));
+         received = true;
+      }
+      if (received)
+         _decode_loop.wakeup();
+   }
+}
 
-      // send vital information to the Dedup object Voltz
-      if(sentInfo == 0)
-      {
-         // get the SID of the server 
-         std::string sidStr = _queue.getServerID();
-         //std::cout << sidStr.substr(2) << std::endl;
-         mySID = std::stoi(sidStr.substr(2));
-         // get the leader 
-         election();
-         // send the vital information
-         _dedup.setValues(mySID, _leader, _numServers);
-         // make sure don't do again
-         sentInfo = 1;
-      }  
+/**********************************************************************************************
+ * decodeStage - thread that takes raw replication data from the network stage, validates and
+ *               deserializes it into plots, and passes the plots to the apply stage
+ **********************************************************************************************/
+
+void ReplServer::decodeStage() {
+   pthread_setname_np(pthread_self(), "repl-decode");
+
+   while (!_shutdown) {
+      _decode_loop.wait(-1);
+
+      ReplMsg msg;
+      while (!_shutdown && _rx_raw.pop(msg)) {
+         PlotBatch batch;
+         batch.sid = msg.sid;
+
+         try {
+            decodeReplData(msg.data, batch);
+         } catch (std::runtime_error &e) {
+            std::cout << "Dropping replication data from " << msg.sid << ": " << e.what() << "\n";
+            continue;
+         }
+
+         // Apply stage is backed up--wait for it to make room
+         while (!_shutdown && !_rx_plots.push(std::move(batch)))
+            _decode_loop.wait(1);
+
+         _apply_loop.wakeup();
+      }
+   }
+}
+
+/**********************************************************************************************
+ * applyStage - runs in the replicate thread. The only stage that writes the database: adds
+ *              decoded plots, deduplicates, and finds new local plots to send out
+ **********************************************************************************************/
+
+void ReplServer::applyStage() {
+
+   // Replicate until we get the shutdown signal
+   while (!_shutdown) {
+
+      // Sleep until there's a decoded batch, a new plot, or replication is due
+      int timeout = std::min(msUntilSimTime(_last_repl + secs_between_repl),
+                             msUntilSimTime(_last_ae + secs_between_ae));
+      int stream_timeout = msUntilStreamFlush();
+      if ((stream_timeout >= 0) && (stream_timeout < timeout))
+         timeout = stream_timeout;
+      _apply_loop.wait(timeout);
+
+      uint64_t new_plots = 0;
+      if (_apply_loop.isReady(_newplot_fd.getFD()))
+         new_plots = _newplot_fd.drain();
+
+      // Incoming replication--add it all to this server's local database, then dedup once
+      PlotBatch batch;
+      bool added = false;
+      while (_rx_plots.pop(batch)) {
+         if (!batch.plots.empty()) {
+            addReplDronePlots(batch);
+            added = true;
+         }
+         handleControl(batch);
+      }
+      if (added) {
+         // check the data for duplicates Voltz
+         _dedup.removeDuplicates();
+      }
 
       // See if it's time to replicate and, if so, go through the database, identifying new plots
-      // that have not been replicated yet and adding them to the queue for replication
+      // that have not been replicated yet and adding them to the queue for replication. In
+      // streaming mode this is only a safety sweep for anything the micro-batches missed
       if (getAdjustedTime() - _last_repl > secs_between_repl) {
 
          queueNewPlots();
+         if (_gossip_fanout == 0) {
+            queueAcks();
+         } else {
+            // Gaps that outlasted the gossip are asked for, then on to the next round's peers
+            for (auto &cursor : _cursors)
+               requestCatchup(cursor.first, cursor.second);
+            pruneGossipSeen();
+            pickGossipTargets();
+         }
          _last_repl = getAdjustedTime();
+         _pending_new = 0;
+      }
+
+      if (_repl_mode == repl_stream)
+         streamNewPlots(new_plots);
+
+      // Periodically offer our Merkle root so peers can catch up on anything they missed
+      if (getAdjustedTime() - _last_ae > secs_between_ae) {
+         queueRootDigest();
+         _last_ae = getAdjustedTime();
       }
-      
-      // Check the queue for updates and pop them until the queue is empty. The pop command only returns
-      // incoming replication information--outgoing replication in the queue gets turned into a TCPConn
-      // object and automatically removed from the queue by pop
-      std::string sid;
-      std::vector<uint8_t> data;
-      while (_queue.pop(sid, data)) {
-
-         // Incoming replication--add it to this server's local database
-         addReplDronePlots(data);         
-      }       
-
-      usleep(1000);
    }   
 }
 
+/**********************************************************************************************
+ * updateCursor - moves the origin's receive watermark past the run of sequenced plots if it
+ *                continues it, and asks for any range we are missing
+ **********************************************************************************************/
+
+void ReplServer::updateCursor(PlotRun &run) {
+   if (run.first_seq == 0)
+      return;
+
+   PeerCursor &cursor = _cursors[run.origin];
+   if ((run.count > 0) && (run.first_seq <= cursor.recv_upto + 1))
+      cursor.recv_upto = std::max(cursor.recv_upto, run.first_seq + run.count - 1);
+   cursor.head = std::max(cursor.head, run.head);
+
+   requestCatchup(run.origin, cursor);
+}
+
+/**********************************************************************************************
+ * requestCatchup - if the origin has plots we haven't seen (a gap, or a catch-up that isn't done
+ *                  yet) asks it directly for the range starting at the watermark. In gossip mode
+ *                  batches arrive out of order by different paths, so a gap has to last a
+ *                  replication period before we ask
+ **********************************************************************************************/
+
+void ReplServer::requestCatchup(const std::string &origin, PeerCursor &cursor) {
+   if (cursor.recv_upto >= cursor.head) {
+      cursor.catchup_from = 0;
+      cursor.gap_since = -1.0;
+      return;
+   }
+
+   if (cursor.gap_since < 0.0)
+      cursor.gap_since = getAdjustedTime();
+   if ((_gossip_fanout > 0) && (getAdjustedTime() - cursor.gap_since < secs_between_repl))
+      return;
+
+   // One request outstanding at a time, re-asked if it made progress or went unanswered
+   uint64_t from = cursor.recv_upto + 1;
+   if ((cursor.catchup_from == from) && 
+                     (getAdjustedTime() - cursor.catchup_time <= secs_between_repl))
+      return;
+
+   std::vector<uint8_t> body, payload;
+   packField<uint64_t>(body, from);
+   appendReplMsg(payload, rm_catchup_req, body);
+   if (!queueOut(origin, payload))
+      return;
+
+   cursor.catchup_from = from;
+   cursor.catchup_time = getAdjustedTime();
+
+   if (_verbosity >= 2)
+      std::cout << "Requesting catch-up from " << origin << " starting at seq " << from << "\n";
+}
+
+/**********************************************************************************************
+ * queueCatchup - sends a peer a window of our sequenced plots starting at from. The message
+ *                carries our head so the peer knows to ask for the next window
+ **********************************************************************************************/
+
+void ReplServer::queueCatchup(const std::string &sid, uint64_t from) {
+   std::vector<DronePlot> plots;
+   unsigned int count = _repl_log.getRange(from, catchup_window, plots);
+   if (count == 0)
+      return;
+
+   std::vector<uint8_t> body, payload;
+   packField<uint64_t>(body, from);
+   packField<uint64_t>(body, _repl_log.getHead());
+   packField<uint32_t>(body, count);
+   for (auto &plot : plots)
+      plot.serialize(body);
+   appendReplMsg(payload, rm_seq_plots, body);
+   queueOut(sid, payload);
+
+   if (_verbosity >= 2)
+      std::cout << "Catching up " << sid << " with " << count << " plots from seq " << from << "\n";
+}
+
+/**********************************************************************************************
+ * queueAcks - tells each peer how far we have received its plots, if that moved
+ **********************************************************************************************/
+
+void ReplServer::queueAcks() {
+   for (auto &peer : _cursors) {
+      PeerCursor &cursor = peer.second;
+      if (cursor.recv_upto <= cursor.acked_sent)
+         continue;
+
+      std::vector<uint8_t> body, payload;
+      packField<uint64_t>(body, cursor.recv_upto);
+      appendReplMsg(payload, rm_ack, body);
+      if (queueOut(peer.first, payload))
+         cursor.acked_sent = cursor.recv_upto;
+   }
+}
+
+/**********************************************************************************************
+ * handleControl - answers the control messages that came in with a batch. A digest of the
+ *                 sender's tree gets a request for whatever differs from our mirror, a request
+ *                 for our tree gets the child digests or the plots, an ack moves the peer's
+ *                 watermark and a catch-up request gets the next window of plots
+ **********************************************************************************************/
+
+void ReplServer::handleControl(PlotBatch &batch) {
+   std::vector<uint8_t> reply;
+
+   for (auto &msg : batch.ctl_msgs) {
+      try {
+         switch (msg.first) {
+         case rm_ae_digest: {
+            std::vector<uint8_t> request;
+            if (_ae.handleDigest(batch.sid, msg.second.data(), msg.second.size(), request))
+               appendReplMsg(reply, rm_ae_request, request);
+            break;
+         }
+         case rm_ae_request:
+            _ae.handleRequest(msg.second.data(), msg.second.size(), reply);
+            break;
+         case rm_ack:
+         case rm_catchup_req:
+            if (msg.second.size() != sizeof(uint64_t))
+               throw std::runtime_error("Sequence message is the wrong size");
+            if (msg.first == rm_ack)
+               _repl_log.ack(batch.sid, unpackField<uint64_t>(msg.second.data()));
+            else
+               queueCatchup(batch.sid, unpackField<uint64_t>(msg.second.data()));
+            break;
+         }
+      } catch (std::runtime_error &e) {
+         std::cout << "Bad control message from " << batch.sid << ": " << e.what() << "\n";
+      }
+   }
+
+   // If the network stage is backed up this round is dropped, the next root digest retries
+   if (!reply.empty())
+      queueOut(batch.sid, reply);
+}
+
+/**********************************************************************************************
+ * queueRootDigest - sends the root of our local Merkle tree to all servers
+ **********************************************************************************************/
+
+void ReplServer::queueRootDigest() {
+   std::vector<uint8_t> body, payload;
+   _ae.getRootDigest(body);
+   appendReplMsg(payload, rm_ae_digest, body);
+
+   // Gossip compares with this round's peers, which rotate, rather than everyone
+   if (_gossip_fanout > 0)
+      queueGossip(payload);
+   else
+      queueOut("", payload);
+}
+
+/**********************************************************************************************
+ * pickGossipTargets - shuffles the peers for this round. Everything sent during the round goes
+ *                     to the first _gossip_fanout of them, so the QueueMgr can coalesce it into
+ *                     a few connections
+ **********************************************************************************************/
+
+void ReplServer::pickGossipTargets() {
+   _gossip_targets = _peer_ids;
+   std::shuffle(_gossip_targets.begin(), _gossip_targets.end(), _rng);
+}
+
+/**********************************************************************************************
+ * queueGossip - sends a payload to _gossip_fanout of this round's peers, skipping the servers
+ *               given (the one we got it from and its origin, who already have it) and taking
+ *               the next peer in the round's order in their place. The payload is taken over
+ *               and shared between the peers
+ **********************************************************************************************/
+
+void ReplServer::queueGossip(std::vector<uint8_t> &payload, const std::string &skip1,
+                                                            const std::string &skip2) {
+   SharedBuffer shared(std::move(payload));
+
+   unsigned int sent = 0;
+   for (auto &target : _gossip_targets) {
+      if (sent >= _gossip_fanout)
+         break;
+      if ((target == skip1) || (target == skip2))
+         continue;
+
+      queueOut(target, shared);
+      sent++;
+   }
+}
+
+/**********************************************************************************************
+ * markGossipSeen - records a gossiped batch by its ID (origin, first seq)
+ *
+ *    Returns: true if it's new, false if we've already seen it (or all of its plots)
+ **********************************************************************************************/
+
+bool ReplServer::markGossipSeen(PlotRun &run) {
+   if (run.first_seq + run.count - 1 <= _cursors[run.origin].recv_upto)
+      return false;
+
+   size_t &seen = _gossip_seen[std::make_pair(run.origin, run.first_seq)];
+   if (seen >= run.count)
+      return false;
+   seen = run.count;
+   return true;
+}
+
+/**********************************************************************************************
+ * pruneGossipSeen - forgets batch IDs that are behind their origin's watermark, since those
+ *                   are recognized from the watermark alone
+ **********************************************************************************************/
+
+void ReplServer::pruneGossipSeen() {
+   auto it = _gossip_seen.begin();
+   while (it != _gossip_seen.end()) {
+      if (it->first.second + it->second - 1 <= _cursors[it->first.first].recv_upto)
+         it = _gossip_seen.erase(it);
+      else
+         it++;
+   }
+}
+
+/**********************************************************************************************
+ * queueOut - hands a payload to the network stage for one server (or all if sid is empty).
+ *            A vector is taken over (left empty) and from then on shared, never copied
+ *
+ *    Returns: false if the network stage is backed up and the payload was not queued
+ **********************************************************************************************/
+
+bool ReplServer::queueOut(const std::string &sid, std::vector<uint8_t> &data) {
+   return queueOut(sid, SharedBuffer(std::move(data)));
+}
+
+bool ReplServer::queueOut(const std::string &sid, const SharedBuffer &data) {
+   ReplMsg msg;
+   msg.sid = sid;
+   msg.data = data;
+   if (!_tx_out.push(std::move(msg)))
+      return false;
+
+   _queue.wakeup();
+   return true;
+}
+
+/**********************************************************************************************
+ * streamNewPlots - streaming mode: adds newly signaled plots to the pending micro-batch and
+ *                  sends it once it reaches max_batch plots or max_delay_ms in age. Adapts to
+ *                  the load - after the link has been quiet for max_delay_ms the first new plot
+ *                  is sent right away, while under steady load plots are grouped into batches
+ *
+ *    Params:  new_plots - number of plots added to the database since the last call
+ **********************************************************************************************/
+
+void ReplServer::streamNewPlots(uint64_t new_plots) {
+   unsigned long long now = getMonoMs();
+
+   if (new_plots > 0) {
+      if (_pending_new == 0) {
+         _pending_since = now;
+
+         // Quiet link, no reason to make this one wait for company
+         if (now - _last_flush >= _max_delay_ms)
+            _pending_since = now - _max_delay_ms;
+      }
+      _pending_new += new_plots;
+   }
+
+   if (_pending_new == 0)
+      return;
+
+   if ((_pending_new < _max_batch) && (now - _pending_since < _max_delay_ms))
+      return;
+
+   // The network stage is backed up. Keep the batch and try again once it makes room (it wakes
+   // us), rather than leaving the plots for the next safety sweep
+   unsigned int sent = queueNewPlots(_max_batch);
+   if ((sent == 0) && _tx_out.full())
+      return;
+   _last_flush = now;
+
+   // If the batch filled up there may be more waiting, so send the rest on the next pass
+   if ((sent >= _max_batch) && (_pending_new > sent)) {
+      _pending_new -= sent;
+      _pending_since = now - _max_delay_ms;
+   } else {
+      _pending_new = 0;
+   }
+}
+
 /**********************************************************************************************
  * queueNewPlots - looks at the database and grabs the new plots, marshalling them and
  *                 sending them to the queue manager
  *
+ *    Params:  max_plots - stop after this many plots (0 = no limit)
+ *
  *    Returns: number of new plots sent to the QueueMgr
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
-unsigned int ReplServer::queueNewPlots() {
+unsigned int ReplServer::queueNewPlots(unsigned int max_plots) {
    std::vector<uint8_t> marshall_data;
    unsigned int count = 0;
 
+   // Network stage is backed up, leave the plots flagged new and try again later
+   if (_tx_out.full())
+      return 0;
+
    if (_verbosity >= 3)
       std::cout << "Replicating plots.\n";
 
+   uint64_t first_seq = _repl_log.getHead() + 1;
+
    // Loop through the drone plots, looking for new ones
    std::list<DronePlot>::iterator dpit = _plotdb.begin();
-   for ( ; dpit != _plotdb.end(); dpit++) {
+   for ( ; (dpit != _plotdb.end()) && ((max_plots == 0) || (count < max_plots)); dpit++) {
 
-      // If this is a new one, marshall it and clear the flag
+      // If this is a new one, marshall it and clear the flag. Plots we logged on an earlier
+      // run have already gone out
       if (dpit->isFlagSet(DBFLAG_NEW)) {
-         
-         dpit->serialize(marshall_data);
          dpit->clrFlags(DBFLAG_NEW);
+         if (!_ae.addLocal(*dpit))
+            continue;
+
+         dpit->serialize(marshall_data);
+         _repl_log.append(*dpit);
 
          count++;
       }
@@ -172,12 +747,29 @@ unsigned int ReplServer::queueNewPlots() {
    if (_verbosity >= 3)
       std::cout << "Adding in count: " << count << "\n";
 
-   uint8_t *ctptr_begin = (uint8_t *) &count;
-   marshall_data.insert(marshall_data.begin(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
-
-   // Send to the queue manager
-   if (marshall_data.size() > 0) {
-      _queue.sendToAll(marshall_data);
+   std::vector<uint8_t> header;
+   packField<uint64_t>(header, first_seq);
+   packField<uint64_t>(header, _repl_log.getHead());
+   packField<uint32_t>(header, count);
+   marshall_data.insert(marshall_data.begin(), header.begin(), header.end());
+
+   // Log them before they go out so a restart can resend anything unacknowledged
+   _repl_log.flush();
+
+   // Hand off to the network stage, which sends it through the queue manager
+   std::vector<uint8_t> payload;
+   if (_gossip_fanout > 0) {
+      std::vector<uint8_t> gossip;
+      std::string origin = _queue.getServerID();
+      packField<uint8_t>(gossip, _gossip_ttl);
+      packField<uint8_t>(gossip, origin.size());
+      gossip.insert(gossip.end(), origin.begin(), origin.end());
+      gossip.insert(gossip.end(), marshall_data.begin(), marshall_data.end());
+      appendReplMsg(payload, rm_gossip, gossip);
+      queueGossip(payload);
+   } else {
+      appendReplMsg(payload, rm_seq_plots, marshall_data);
+      queueOut("", payload);
    }
 
    if (_verbosity >= 2) 
@@ -187,74 +779,206 @@ unsigned int ReplServer::queueNewPlots() {
 }
 
 /**********************************************************************************************
- * addReplDronePlots - Adds drone plots to the database from data that was replicated in. 
- *                     Deconflicts issues between plot points.
+ * decodeReplData - Splits replicated data into its messages (decode stage). Plots are
+ *                  deserialized, control messages are passed on for the apply stage
+ * 
+ * Params:  data - a payload of one or more replication messages (see ReplProtocol.h)
+ *          batch - the plots and control messages are added here
+ *
+ * Throws: runtime_error if the data is malformed
+ *
+ **********************************************************************************************/
+
+void ReplServer::decodeReplData(const SharedBuffer &data, PlotBatch &batch) {
+   size_t pos = 0, len;
+   uint8_t type;
+   const uint8_t *body;
+
+   while (nextReplMsg(data.data(), data.size(), pos, type, body, len)) {
+      switch (type) {
+      case rm_plots: {
+         PlotRun run = {batch.sid, 0, 0, batch.plots.size(), 0, false, {}};
+         decodePlots(body, len, batch.plots);
+         run.count = batch.plots.size() - run.start;
+         batch.runs.push_back(run);
+         break;
+      }
+      case rm_seq_plots:
+         decodeSeqPlots(body, len, batch.sid, batch);
+         break;
+      case rm_gossip:
+         decodeGossip(body, len, batch);
+         break;
+      case rm_ae_digest:
+      case rm_ae_request:
+      case rm_ack:
+      case rm_catchup_req:
+         batch.ctl_msgs.emplace_back(type, std::vector<uint8_t>(body, body + len));
+         break;
+      default:
+         throw std::runtime_error("Unknown replication message type");
+      }
+   }
+}
+
+/**********************************************************************************************
+ * decodePlots - Deserializes the drone plots in an rm_plots message
  * 
- * Params:  data - should start with the number of data points in a 32 bit unsigned integer, 
- *                 then a series of drone plot points
+ * Params:  body/len - should start with the number of data points in a 32 bit unsigned
+ *                     integer, then a series of drone plot points
+ *          plots - the deserialized plots are added here
+ *
+ * Throws: runtime_error if the data is malformed
  *
  **********************************************************************************************/
 
-void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
-   if (data.size() < 4) {
-      throw std::runtime_error("Not enough data passed into addReplDronePlots");
+void ReplServer::decodePlots(const uint8_t *body, size_t len, std::vector<DronePlot> &plots) {
+   if (len < 4) {
+      throw std::runtime_error("Not enough data passed into decodePlots");
    }
 
-   if ((data.size() - 4) % DronePlot::getDataSize() != 0) {
-      throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
+   if ((len - 4) % DronePlot::getDataSize() != 0) {
+      throw std::runtime_error("Data passed into decodePlots was not the right multiple of DronePlot size");
    }
 
    // Get the number of plot points
-   unsigned int *numptr = (unsigned int *) data.data();
-   unsigned int count = *numptr;
+   unsigned int count = unpackField<unsigned int>(body);
 
-   // Store sub-vectors for efficiency
-   std::vector<uint8_t> plot;
-   auto dptr = data.begin() + sizeof(unsigned int);
+   if (count != (len - 4) / DronePlot::getDataSize()) {
+      throw std::runtime_error("Plot count in replication data does not match its size");
+   }
 
+   std::vector<uint8_t> data(body + sizeof(unsigned int), body + len);
+   size_t first = plots.size();
+   plots.resize(first + count);
+   unsigned int pos = 0;
    for (unsigned int i=0; i<count; i++) {
-      plot.clear();
-      plot.assign(dptr, dptr + DronePlot::getDataSize());
-      addSingleDronePlot(plot);
-      dptr += DronePlot::getDataSize();      
+      plots[first + i].deserialize(data, pos);
+      pos += DronePlot::getDataSize();      
    }
-   if (_verbosity >= 2)
-      std::cout << "Replicated in " << count << " plots\n";   
 }
 
+/**********************************************************************************************
+ * decodeSeqPlots - Deserializes an rm_seq_plots message, recording the origin's sequence
+ *                  numbers for the plots
+ * 
+ * Throws: runtime_error if the data is malformed
+ *
+ **********************************************************************************************/
+
+void ReplServer::decodeSeqPlots(const uint8_t *body, size_t len, const std::string &origin,
+                                                                        PlotBatch &batch) {
+   const size_t hdr_size = 2 * sizeof(uint64_t);
+   if (len < hdr_size)
+      throw std::runtime_error("Sequenced plot message header truncated");
+
+   PlotRun run;
+   run.origin = origin;
+   run.gossip = false;
+   run.first_seq = unpackField<uint64_t>(body);
+   run.head = unpackField<uint64_t>(body + sizeof(uint64_t));
+   run.start = batch.plots.size();
+
+   decodePlots(body + hdr_size, len - hdr_size, batch.plots);
+   run.count = batch.plots.size() - run.start;
+
+   if ((run.first_seq == 0) || (run.first_seq + run.count - 1 > run.head))
+      throw std::runtime_error("Sequenced plot message has bad sequence numbers");
+
+   batch.runs.push_back(run);
+}
 
 /**********************************************************************************************
- * addSingleDronePlot - Takes in binary serialized drone data and adds it to the database. 
+ * decodeGossip - Deserializes an rm_gossip message. If its TTL allows, keeps a copy with the
+ *                TTL counted down for the apply stage to forward
+ * 
+ * Throws: runtime_error if the data is malformed
  *
  **********************************************************************************************/
 
-void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
-   DronePlot tmp_plot;
+void ReplServer::decodeGossip(const uint8_t *body, size_t len, PlotBatch &batch) {
+   if ((len < 2) || (len < 2 + (size_t) body[1]))
+      throw std::runtime_error("Gossip message header truncated");
 
-   tmp_plot.deserialize(data);
+   uint8_t ttl = body[0];
+   std::string origin((const char *) body + 2, body[1]);
+   size_t hdr_size = 2 + origin.size();
 
+   decodeSeqPlots(body + hdr_size, len - hdr_size, origin, batch);
+   PlotRun &run = batch.runs.back();
+   run.gossip = true;
+
+   if (ttl > 1) {
+      std::vector<uint8_t> forward(body, body + len);
+      forward[0] = ttl - 1;
+      appendReplMsg(run.forward, rm_gossip, forward);
+   }
+}
+
+/**********************************************************************************************
+ * addReplDronePlots - Adds decoded drone plots to the database (apply stage). Plots we already
+ *                     received from their origin (anti-entropy resends) are skipped, as are
+ *                     gossiped batches we've seen, and new gossip is passed on.
+ *                     Deduplication is left to the caller so it runs once per group of batches.
+ *
+ **********************************************************************************************/
+
+void ReplServer::addReplDronePlots(PlotBatch &batch) {
+   unsigned int added = 0;
+   for (auto &run : batch.runs) {
+      if (run.gossip) {
+         // Our own plots coming back around, or a batch we already have
+         if ((run.origin == _queue.getServerID()) || !markGossipSeen(run))
+            continue;
+         if (!run.forward.empty())
+            queueGossip(run.forward, batch.sid, run.origin);
+      }
+
+      for (size_t i = run.start; i < run.start + run.count; i++) {
+         DronePlot &plot = batch.plots[i];
+         if (!_ae.addRemote(run.origin, plot))
+            continue;
+         addSingleDronePlot(plot);
+         added++;
+      }
+      updateCursor(run);
+   }
+
+   if (_verbosity >= 2)
+      std::cout << "Replicated in " << added << " plots\n";   
+}
+
+
+/**********************************************************************************************
+ * addSingleDronePlot - Takes in a replicated drone plot and adds it to the database. 
+ *
+ **********************************************************************************************/
+
+void ReplServer::addSingleDronePlot(DronePlot &tmp_plot) {
    // adjest for time skew (if known)
-   //std::cout << "PRE TRANSFORM TIMESTAMP: " << 	tmp_plot.timestamp << std::endl;
    _dedup.fixTimeSkew(tmp_plot);
-   //std::cout << "!!POST TRANSFORM TIMESTAMP: " << 	tmp_plot.timestamp << std::endl;
 
    _plotdb.addPlot(tmp_plot.drone_id, tmp_plot.node_id, tmp_plot.timestamp, tmp_plot.latitude,
                                                          tmp_plot.longitude);
-
-   // check the data for duplicates Voltz
-   _dedup.removeDuplicates();   
-   
 }
 
+/**********************************************************************************************
+ * shutdown - Signals the replication stages to stop. The final dedup runs on the replicate
+ *            thread once the stages exit, so it can't race the apply stage
+ *
+ **********************************************************************************************/
 
 void ReplServer::shutdown() {
-   // do the final check Voltz
-   _dedup.removeDuplicates();  
    //_dedup.printValues();
    // redo time stamps according to "leader" time
    //_dedup.correctToLeader();
    
    _shutdown = true;
+
+   // Kick every stage out of its wait so it sees the shutdown
+   _apply_loop.wakeup();
+   _decode_loop.wakeup();
+   _queue.wakeup();
 }
 
 /**********************************************************************************************
@@ -0,0 +1,102 @@
+#include <cstring>
+#include <stdexcept>
+#include <endian.h>
+#include <crypto++/sha.h>
+#include <crypto++/hkdf.h>
+#include "ResumeTicket.h"
+#include "SessionCipher.h"
+#include "Handshake.h"
+
+using namespace CryptoPP;
+
+namespace {
+   const char resume_info[] = "repl resumption secret";
+   const char ticket_info[] = "repl ticket key";
+
+   /******************************************************************************************
+    * ticketCipher - keys a cipher for sealing and opening tickets, with a key derived from the
+    *                shared key (so it's the same on every server and never sent anywhere)
+    ******************************************************************************************/
+
+   void ticketCipher(const SecByteBlock &shared_key, SessionCipher &cipher) {
+      HKDF<SHA256> hkdf;
+      SecByteBlock key(session_key_size);
+      hkdf.DeriveKey(key, key.size(), shared_key, shared_key.size(), nullptr, 0,
+                     (const byte *) ticket_info, sizeof(ticket_info) - 1);
+      cipher.setKey(key, key.size());
+   }
+}
+
+/*********************************************************************************************
+ * deriveResumeSecret - HKDF-SHA256 of the session's secret, salted with its challenges
+ *
+ *    Params:  session_secret - what the session's keys came from
+ *             salt/salt_len - the session's challenges
+ *             secret - loaded with the resumption secret (resume_secret_size bytes)
+ *********************************************************************************************/
+
+void deriveResumeSecret(const SecByteBlock &session_secret, const uint8_t *salt, size_t salt_len,
+                        SecByteBlock &secret) {
+   HKDF<SHA256> hkdf;
+   secret.resize(resume_secret_size);
+   hkdf.DeriveKey(secret, secret.size(), session_secret, session_secret.size(), salt, salt_len,
+                  (const byte *) resume_info, sizeof(resume_info) - 1);
+}
+
+/*********************************************************************************************
+ * sealTicket - lays out [uint64 expiry][secret][dialer SID][acceptor SID] and seals it. Only a
+ *              server holding the shared key can open it; the dialer just presents it
+ *
+ *    Params:  shared_key - the key from sharedkey.bin
+ *             secret - the resumption secret
+ *             dialer/acceptor - the SIDs of the two ends of the session
+ *             blob - loaded with the sealed ticket
+ *
+ *    Throws: runtime_error if a SID is too long to store
+ *********************************************************************************************/
+
+void sealTicket(const SecByteBlock &shared_key, const SecByteBlock &secret,
+                const std::string &dialer, const std::string &acceptor,
+                std::vector<uint8_t> &blob) {
+   uint64_t expiry = htobe64(time(NULL) + ticket_lifetime);
+
+   blob.assign((uint8_t *) &expiry, (uint8_t *) &expiry + sizeof(expiry));
+   blob.insert(blob.end(), secret.begin(), secret.end());
+   if (!putShortString(blob, dialer) || !putShortString(blob, acceptor))
+      throw std::runtime_error("Server ID too long to put in a resumption ticket.");
+
+   SessionCipher cipher;
+   ticketCipher(shared_key, cipher);
+   cipher.seal(blob);
+}
+
+/*********************************************************************************************
+ * openTicket - opens a ticket a dialer presented and checks it hasn't expired
+ *
+ *    Params:  shared_key - the key from sharedkey.bin
+ *             blob - the sealed ticket
+ *             dialer/acceptor - loaded with the SIDs the ticket was issued for
+ *             secret - loaded with the resumption secret
+ *
+ *    Returns: false if the ticket isn't one of ours, was changed, is malformed or has expired
+ *********************************************************************************************/
+
+bool openTicket(const SecByteBlock &shared_key, const std::vector<uint8_t> &blob,
+                std::string &dialer, std::string &acceptor, SecByteBlock &secret) {
+   SessionCipher cipher;
+   ticketCipher(shared_key, cipher);
+
+   std::vector<uint8_t> ticket(blob);
+   if (!cipher.open(ticket) || (ticket.size() < sizeof(uint64_t) + resume_secret_size))
+      return false;
+
+   uint64_t expiry;
+   memcpy(&expiry, ticket.data(), sizeof(expiry));
+   if ((time_t) be64toh(expiry) < time(NULL))
+      return false;
+
+   size_t pos = sizeof(expiry);
+   secret.Assign(ticket.data() + pos, resume_secret_size);
+   pos += resume_secret_size;
+   return getShortString(ticket, pos, dialer) && getShortString(ticket, pos, acceptor);
+}
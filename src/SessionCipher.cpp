@@ -0,0 +1,172 @@
+#include <cstring>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <crypto++/sha.h>
+#include <crypto++/hkdf.h>
+#include "SessionCipher.h"
+#include "RandPool.h"
+
+using namespace CryptoPP;
+
+/*********************************************************************************************
+ * SessionCipher (constructor) - has no key until setKey is called
+ *********************************************************************************************/
+
+SessionCipher::SessionCipher():
+                  _counter(0)
+{
+   memset(_prefix, 0, sizeof(_prefix));
+}
+
+/*********************************************************************************************
+ * setKey - keys both directions. GCM wants a nonce with its key, but every message brings its
+ *          own, so this one (all zeros) is never used to encrypt anything
+ *
+ *    Params:  key/len - an AES key (16, 24 or 32 bytes)
+ *
+ *    Throws: runtime_error (a Crypto++ InvalidKeyLength) if the key is the wrong size
+ *********************************************************************************************/
+
+void SessionCipher::setKey(const uint8_t *key, size_t len) {
+   setKeys(key, key, len);
+}
+
+void SessionCipher::setKeys(const uint8_t *send_key, const uint8_t *recv_key, size_t len) {
+   uint8_t unused[seal_iv_size] = {0};
+
+   _enc.SetKeyWithIV(send_key, len, unused, seal_iv_size);
+   _dec.SetKeyWithIV(recv_key, len, unused, seal_iv_size);
+   newPrefix();
+}
+
+/*********************************************************************************************
+ * deriveSessionKeys - expands the shared secret into a key for each direction of this session.
+ *                     The salt makes them unique to the session; the info string labels which
+ *                     direction each is for
+ *
+ *    Params:  secret/secret_len - the shared key
+ *             salt/salt_len - fresh from this session's handshake (both sides' challenges)
+ *             dialer - true on the side that opened the connection
+ *********************************************************************************************/
+
+void SessionCipher::deriveSessionKeys(const uint8_t *secret, size_t secret_len,
+                                      const uint8_t *salt, size_t salt_len, bool dialer) {
+   static const char dialer_info[] = "repl session dialer->acceptor";
+   static const char acceptor_info[] = "repl session acceptor->dialer";
+
+   HKDF<SHA256> hkdf;
+   SecByteBlock dialer_key(session_key_size), acceptor_key(session_key_size);
+   hkdf.DeriveKey(dialer_key, dialer_key.size(), secret, secret_len, salt, salt_len,
+                  (const byte *) dialer_info, sizeof(dialer_info) - 1);
+   hkdf.DeriveKey(acceptor_key, acceptor_key.size(), secret, secret_len, salt, salt_len,
+                  (const byte *) acceptor_info, sizeof(acceptor_info) - 1);
+
+   if (dialer)
+      setKeys(dialer_key, acceptor_key, session_key_size);
+   else
+      setKeys(acceptor_key, dialer_key, session_key_size);
+}
+
+/*********************************************************************************************
+ * seal - encrypts len bytes at buf + seal_iv_size in place and authenticates them, writing the
+ *        nonce in front of them and the tag behind them
+ *
+ *    Params:  buf - [room for the nonce][plaintext][room for the tag]
+ *             len - length of the plaintext
+ *             aad/aad_len - data sent in the clear alongside that the tag also covers
+ *********************************************************************************************/
+
+void SessionCipher::seal(uint8_t *buf, size_t len, const uint8_t *aad, size_t aad_len) {
+   uint8_t *text = buf + seal_iv_size;
+
+   nextNonce(buf);
+   _enc.EncryptAndAuthenticate(text, text + len, seal_tag_size, buf, seal_iv_size,
+                               aad, aad_len, text, len);
+}
+
+/*********************************************************************************************
+ * seal (chain) - encrypts the payload's buffers straight from where they are into out, one
+ *                after another, so a payload shared with other peers' queues is read once and
+ *                never copied in the clear first
+ *
+ *    Params:  out - where the sealed message goes: [nonce][ciphertext][tag]
+ *             payload - the plaintext buffers
+ *             aad/aad_len - data sent in the clear alongside that the tag also covers
+ *********************************************************************************************/
+
+void SessionCipher::seal(uint8_t *out, const BufferChain &payload, const uint8_t *aad,
+                         size_t aad_len) {
+   uint8_t *text = out + seal_iv_size;
+
+   nextNonce(out);
+   _enc.Resynchronize(out, seal_iv_size);
+   if (aad_len > 0)
+      _enc.Update(aad, aad_len);
+
+   for (auto &part : payload) {
+      if (part.empty())
+         continue;
+      _enc.ProcessData(text, part.data(), part.size());
+      text += part.size();
+   }
+   _enc.TruncatedFinal(text, seal_tag_size);
+}
+
+/*********************************************************************************************
+ * open - checks a sealed message's tag and decrypts it in place
+ *
+ *    Params:  buf/len - the sealed message, [nonce][ciphertext][tag]
+ *             aad/aad_len - the data that was sealed alongside it
+ *
+ *    Returns: false if the message is too short or isn't authentic (buf is left as it was)
+ *********************************************************************************************/
+
+bool SessionCipher::open(uint8_t *buf, size_t len, const uint8_t *aad, size_t aad_len) {
+   if (len < seal_overhead)
+      return false;
+
+   uint8_t *text = buf + seal_iv_size;
+   size_t text_len = len - seal_overhead;
+   return _dec.DecryptAndVerify(text, text + text_len, seal_tag_size, buf, seal_iv_size,
+                                aad, aad_len, text, text_len);
+}
+
+/*********************************************************************************************
+ * seal/open (vector) - for small messages, like the handshake's, where moving the bytes to
+ *                      make room for the nonce doesn't matter
+ *********************************************************************************************/
+
+void SessionCipher::seal(std::vector<uint8_t> &buf) {
+   size_t len = buf.size();
+   buf.insert(buf.begin(), seal_iv_size, 0);
+   buf.resize(len + seal_overhead);
+   seal(buf.data(), len);
+}
+
+bool SessionCipher::open(std::vector<uint8_t> &buf) {
+   if (!open(buf.data(), buf.size()))
+      return false;
+
+   buf.resize(buf.size() - seal_tag_size);
+   buf.erase(buf.begin(), buf.begin() + seal_iv_size);
+   return true;
+}
+
+/*********************************************************************************************
+ * nextNonce - writes the prefix and the next counter value (network order) into nonce,
+ *             starting a new prefix when the counter runs out
+ *********************************************************************************************/
+
+void SessionCipher::nextNonce(uint8_t *nonce) {
+   if (_counter == UINT32_MAX)
+      newPrefix();
+
+   uint32_t count = htonl(_counter++);
+   memcpy(nonce, _prefix, sizeof(_prefix));
+   memcpy(nonce + sizeof(_prefix), &count, sizeof(count));
+}
+
+void SessionCipher::newPrefix() {
+   randomBytes(_prefix, sizeof(_prefix));
+   _counter = 0;
+}
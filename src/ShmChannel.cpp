@@ -0,0 +1,222 @@
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ShmChannel.h"
+
+// Marks a memfd as one of our channels, laid out as below
+const uint64_t shm_magic = 0x314d485350455252ULL;    // "RREPSHM1"
+
+// The memfd is a header page (magic, ring size, the two rings' indexes) and then each ring's
+// data. Ring 0 carries the dialer's bytes to the acceptor, ring 1 the other way
+const size_t shm_header_size = 4096;
+const size_t shm_ctl_offset = 64;
+const size_t shm_total_size = shm_header_size + 2 * shm_ring_size;
+
+/*********************************************************************************************
+ * ring_ctl - one ring's indexes, in the shared header. Bytes written and read so far (the
+ *            ring position is these mod shm_ring_size), and whether the writer is waiting for
+ *            room. Each on its own cache line, as the two processes each write one
+ *********************************************************************************************/
+
+struct ShmChannel::ring_ctl {
+   alignas(64) std::atomic<uint64_t> head;            // Read up to (reader)
+   alignas(64) std::atomic<uint64_t> tail;            // Written up to (writer)
+   alignas(64) std::atomic<uint32_t> writer_waiting;  // Signal the writer when there's room
+};
+
+ShmChannel::ShmChannel() {
+}
+
+ShmChannel::~ShmChannel() {
+   if (_map != nullptr)
+      munmap(_map, _map_len);
+   if (_memfd >= 0)
+      close(_memfd);
+}
+
+/*********************************************************************************************
+ * create - Dialer: makes a new channel. The memfd is sealed at its size so the acceptor can't
+ *          shrink it out from under us (and we know it can't be shrunk out from under it)
+ *
+ *    Params:  fds - loaded with the FDs to send the acceptor: the memfd, the eventfd it waits
+ *                   on and the one it signals us on
+ *
+ *    Returns: the channel, or nullptr if the memfd couldn't be set up
+ *
+ *    Throws: socket_error if an eventfd couldn't be created
+ *********************************************************************************************/
+
+std::unique_ptr<ShmChannel> ShmChannel::create(int fds[3]) {
+   std::unique_ptr<ShmChannel> chan(new ShmChannel());
+
+   chan->_memfd = memfd_create("repl-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (chan->_memfd == -1)
+      return nullptr;
+
+   if ((ftruncate(chan->_memfd, shm_total_size) != 0) ||
+       (fcntl(chan->_memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) ||
+       !chan->map(chan->_memfd))
+      return nullptr;
+
+   uint8_t *base = (uint8_t *) chan->_map;
+   memcpy(base, &shm_magic, sizeof(shm_magic));
+   uint64_t ring_size = shm_ring_size;
+   memcpy(base + sizeof(shm_magic), &ring_size, sizeof(ring_size));
+
+   ring_ctl *rings = new (base + shm_ctl_offset) ring_ctl[2];
+   for (unsigned int i=0; i<2; i++) {
+      rings[i].head.store(0);
+      rings[i].tail.store(0);
+      rings[i].writer_waiting.store(0);
+   }
+   chan->_tx = &rings[0];
+   chan->_rx = &rings[1];
+   chan->_tx_data = base + shm_header_size;
+   chan->_rx_data = base + shm_header_size + shm_ring_size;
+
+   chan->_wait.reset(new EventFD());
+   chan->_peer.reset(new EventFD());
+
+   fds[0] = chan->_memfd;
+   fds[1] = chan->_peer->getFD();
+   fds[2] = chan->_wait->getFD();
+   return chan;
+}
+
+/*********************************************************************************************
+ * attach - Acceptor: maps a channel the dialer sent, after checking it's one we understand
+ *          (the right size, sealed so it stays that size, and our layout)
+ *
+ *    Params:  fds - the memfd, the eventfd we wait on and the one we signal the dialer on,
+ *                   which the channel takes over
+ *
+ *    Returns: the channel, or nullptr if it isn't usable (the FDs are closed)
+ *********************************************************************************************/
+
+std::unique_ptr<ShmChannel> ShmChannel::attach(const int fds[3]) {
+   std::unique_ptr<ShmChannel> chan(new ShmChannel());
+   chan->_memfd = fds[0];
+   chan->_wait.reset(new EventFD(fds[1]));
+   chan->_peer.reset(new EventFD(fds[2]));
+
+   struct stat st;
+   if ((fstat(chan->_memfd, &st) != 0) || ((size_t) st.st_size != shm_total_size))
+      return nullptr;
+
+   int seals = fcntl(chan->_memfd, F_GET_SEALS);
+   if ((seals == -1) || !(seals & F_SEAL_SHRINK))
+      return nullptr;
+
+   if (!chan->map(chan->_memfd))
+      return nullptr;
+
+   uint8_t *base = (uint8_t *) chan->_map;
+   uint64_t magic, ring_size;
+   memcpy(&magic, base, sizeof(magic));
+   memcpy(&ring_size, base + sizeof(magic), sizeof(ring_size));
+   if ((magic != shm_magic) || (ring_size != shm_ring_size))
+      return nullptr;
+
+   ring_ctl *rings = (ring_ctl *) (base + shm_ctl_offset);
+   chan->_tx = &rings[1];
+   chan->_rx = &rings[0];
+   chan->_tx_data = base + shm_header_size + shm_ring_size;
+   chan->_rx_data = base + shm_header_size;
+   return chan;
+}
+
+/*********************************************************************************************
+ * map - maps the whole memfd, shared with the peer
+ *********************************************************************************************/
+
+bool ShmChannel::map(int memfd) {
+   void *addr = mmap(NULL, shm_total_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+   if (addr == MAP_FAILED)
+      return false;
+
+   _map = addr;
+   _map_len = shm_total_size;
+   return true;
+}
+
+/*********************************************************************************************
+ * write - copies the buffers into the peer's ring, as much as fits, and signals the peer. If
+ *         they didn't all fit, flags that we're waiting for room. The reader checks the flag
+ *         after it moves head and we check head after setting the flag, so one of us always
+ *         sees the other
+ *
+ *    Params:  iov/iovcnt - the buffers to write, in order
+ *
+ *    Returns: the bytes written
+ *********************************************************************************************/
+
+size_t ShmChannel::write(const struct iovec *iov, int iovcnt) {
+   uint64_t tail = _tx->tail.load(std::memory_order_relaxed);
+   uint64_t head = _tx->head.load(std::memory_order_acquire);
+   size_t space = (tail - head > shm_ring_size) ? 0 : shm_ring_size - (tail - head);
+
+   size_t written = 0, asked = 0;
+   for (int i=0; i<iovcnt; i++) {
+      asked += iov[i].iov_len;
+
+      const uint8_t *src = (const uint8_t *) iov[i].iov_base;
+      size_t len = std::min(iov[i].iov_len, space - written);
+      while (len > 0) {
+         size_t pos = (tail + written) & (shm_ring_size - 1);
+         size_t n = std::min(len, shm_ring_size - pos);
+         memcpy(_tx_data + pos, src, n);
+         src += n;
+         len -= n;
+         written += n;
+      }
+   }
+
+   if (written > 0) {
+      _tx->tail.store(tail + written, std::memory_order_release);
+      _peer->signal();
+   }
+
+   if (written < asked) {
+      _tx->writer_waiting.store(1, std::memory_order_seq_cst);
+
+      // It made room before it saw the flag, so try again on the next pass
+      if (_tx->head.load(std::memory_order_seq_cst) != head)
+         _wait->signal();
+   }
+   return written;
+}
+
+/*********************************************************************************************
+ * read - copies what the peer has written into buf, up to len bytes, and signals it if it was
+ *        waiting for the room that made
+ *
+ *    Returns: bytes read, or -1 if the indexes are impossible (the peer is broken)
+ *********************************************************************************************/
+
+ssize_t ShmChannel::read(uint8_t *buf, size_t len) {
+   uint64_t head = _rx->head.load(std::memory_order_relaxed);
+   uint64_t tail = _rx->tail.load(std::memory_order_acquire);
+   if (tail - head > shm_ring_size)
+      return -1;
+
+   size_t avail = std::min(len, (size_t) (tail - head));
+   size_t done = 0;
+   while (done < avail) {
+      size_t pos = (head + done) & (shm_ring_size - 1);
+      size_t n = std::min(avail - done, shm_ring_size - pos);
+      memcpy(buf + done, _rx_data + pos, n);
+      done += n;
+   }
+
+   if (done > 0) {
+      _rx->head.store(head + done, std::memory_order_seq_cst);
+      if (_rx->writer_waiting.load(std::memory_order_seq_cst) &&
+          _rx->writer_waiting.exchange(0))
+         _peer->signal();
+   }
+   return done;
+}
@@ -2,31 +2,34 @@
 #include <strings.h>
 #include <unistd.h>
 #include <cstring>
+#include <cerrno>
+#include <climits>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
 #include "TCPConn.h"
+#include "FrameProtocol.h"
 #include "strfuncts.h"
+#include "RandPool.h"
 #include <crypto++/secblock.h>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
 #include <crypto++/rijndael.h>
 #include <crypto++/gcm.h>
 #include <crypto++/aes.h>
-// Voltz include 
-#include <random>
-
 
 using namespace CryptoPP;
 
 // Common defines for this TCPConn
-const unsigned int iv_size = AES::BLOCKSIZE;
 const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
 const unsigned int auth_size = 16;
 
+// Labels on each side's handshake proof
+const char dialer_proof[] = "repl handshake dialer";
+const char acceptor_proof[] = "repl handshake acceptor";
+
 /**********************************************************************************************
- * TCPConn (constructor) - creates the connector and initializes - creates the command strings
- *                         to wrap around network commands
+ * TCPConn (constructor) - creates the connector and initializes
  *
  *    Params: key - reference to the pre-loaded AES key
  *            verbosity - stdout verbosity - 3 = max
@@ -34,46 +37,16 @@ const unsigned int auth_size = 16;
  **********************************************************************************************/
 
 TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity):
-                                    _data_ready(false),
+                                    _readable(false),
+                                    _writable(false),
+                                    _rx_frames(rx_frame_ring_size),
+                                    _tx_payloads(tx_payload_ring_size),
                                     _aes_key(key),
+                                    _session_secret(key),
                                     _verbosity(verbosity),
                                     _server_log(server_log)
 {
-   // prep some tools to search for command sequences in data
-   uint8_t slash = (uint8_t) '/';
-   c_rep.push_back((uint8_t) '<');
-   c_rep.push_back((uint8_t) 'R');
-   c_rep.push_back((uint8_t) 'E');
-   c_rep.push_back((uint8_t) 'P');
-   c_rep.push_back((uint8_t) '>');
-
-   c_endrep = c_rep;
-   c_endrep.insert(c_endrep.begin()+1, 1, slash);
-
-   c_ack.push_back((uint8_t) '<');
-   c_ack.push_back((uint8_t) 'A');
-   c_ack.push_back((uint8_t) 'C');
-   c_ack.push_back((uint8_t) 'K');
-   c_ack.push_back((uint8_t) '>');
-
-   c_auth.push_back((uint8_t) '<');
-   c_auth.push_back((uint8_t) 'A');
-   c_auth.push_back((uint8_t) 'U');
-   c_auth.push_back((uint8_t) 'T');
-   c_auth.push_back((uint8_t) '>');
-
-   c_endauth = c_auth;
-   c_endauth.insert(c_endauth.begin()+1, 1, slash);
-
-   c_sid.push_back((uint8_t) '<');
-   c_sid.push_back((uint8_t) 'S');
-   c_sid.push_back((uint8_t) 'I');
-   c_sid.push_back((uint8_t) 'D');
-   c_sid.push_back((uint8_t) '>');
-
-   c_endsid = c_sid;
-   c_endsid.insert(c_endsid.begin()+1, 1, slash);
-
+   _cipher.setKey(_aes_key, _aes_key.size());
 }
 
 
@@ -94,76 +67,159 @@ bool TCPConn::accept(SocketFD &server) {
    bool results = _connfd.acceptFD(server);
 
 
-   // Set the state as waiting for the authorization packet
-   // Voltz change 
-   //_status = s_connected;
-   _status = s_schallenge;
+   // A dialer on this host may move us onto shared memory with its first message
+   _shm_accept = _connfd.isUnix();
+
+   // Set the state as waiting for the client's hello
+   _status = s_waithello;
    _connected = true;
    return results;
 }
 
 /**********************************************************************************************
- * sendData - sends the data in the parameter to the socket
+ * sendFrame - queues one frame: a header (see FrameProtocol.h) followed by the payload
+ *             buffers. Everything queued in a pass goes out together after handleConnection,
+ *             in one writev, as much as the socket takes; the rest waits for the event loop to
+ *             say the socket is writable, so a slow peer never stalls us
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
- *
- *    Throws: runtime_error for unrecoverable errors
+ *    Params:  type - frame_type
+ *             payload - the payload buffers, queued as they are (shared, not copied)
+ *             seq - sequence number for the header
+ *             buf - or a single payload buffer, which is copied
  **********************************************************************************************/
 
-bool TCPConn::sendData(std::vector<uint8_t> &buf) {
-   
-   _connfd.writeBytes<uint8_t>(buf);
-   
+bool TCPConn::sendFrame(uint8_t type, const BufferChain &payload, uint64_t seq) {
+   FrameHeader hdr;
+   hdr.type = type;
+   hdr.seq = seq;
+   for (auto &part : payload) {
+      hdr.length += part.size();
+      hdr.crc = crc32(part.data(), part.size(), hdr.crc);
+   }
+
+   std::vector<uint8_t> header(frame_header_size);
+   packFrameHeader(hdr, header.data());
+
+   _txq.emplace_back(std::move(header));
+   for (auto &part : payload) {
+      if (!part.empty())
+         _txq.push_back(part);
+   }
+   _tx_bytes += frame_header_size + hdr.length;
    return true;
 }
 
+bool TCPConn::sendFrame(uint8_t type, const std::vector<uint8_t> &buf, uint64_t seq) {
+   BufferChain payload;
+   if (!buf.empty())
+      payload.emplace_back(std::vector<uint8_t>(buf));
+   return sendFrame(type, payload, seq);
+}
+
 /**********************************************************************************************
- * sendEncryptedData - sends the data in the parameter to the socket after block encrypting it
+ * sendSealedFrame - queues one frame whose payload is sealed with the session cipher. The
+ *                   payload buffers are shared with other peers' queues and can't be
+ *                   encrypted where they are, so they're encrypted straight into the frame's
+ *                   own buffer right behind the header, in one pass. The header goes in as
+ *                   associated data, so the tag covers the sequence number and type too
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
- *
- *    Throws: runtime_error for unrecoverable errors
+ *    Params:  type - frame_type
+ *             payload - the payload buffers
+ *             seq - sequence number for the header
  **********************************************************************************************/
 
-bool TCPConn::sendEncryptedData(std::vector<uint8_t> &buf) {
+bool TCPConn::sendSealedFrame(uint8_t type, const BufferChain &payload, uint64_t seq) {
+   size_t len = 0;
+   for (auto &part : payload)
+      len += part.size();
+
+   FrameHeader hdr;
+   hdr.type = type;
+   hdr.seq = seq;
+   hdr.flags = ff_sealed;
+   hdr.length = len + seal_overhead;
 
-   // Encrypt
-   encryptData(buf);
+   std::vector<uint8_t> frame(frame_header_size + hdr.length);
+   packFrameHeader(hdr, frame.data());
 
-   // And send!
-   return sendData(buf);
+   _cipher.seal(frame.data() + frame_header_size, payload, frame.data(), frame_header_size);
+
+   _tx_bytes += frame.size();
+   _txq.emplace_back(std::move(frame));
+   return true;
 }
 
 /**********************************************************************************************
- * encryptData - block encrypts data and places the results in the buffer in <ID><Data> format
- *
- *    Params:  buf - where to place the <IV><Data> stream
+ * wantsFlush - true if there's output queued and the socket may take some: the last write
+ *              didn't find it full, or the event loop has since said it's writable
+ **********************************************************************************************/
+
+bool TCPConn::wantsFlush() {
+   return _connected && (_status != s_dialing) && !_txq.empty() && (!_tx_full || _writable);
+}
+
+/**********************************************************************************************
+ * prepareFlush - lays the queued buffers out for one writev (up to IOV_MAX of them), picking
+ *                up mid-buffer after a short write. The iovecs stay put until finishFlush
+ **********************************************************************************************/
+
+const std::vector<struct iovec> &TCPConn::prepareFlush() {
+   _tx_iov.clear();
+   _tx_asked = 0;
+   for (auto it = _txq.begin(); (it != _txq.end()) && (_tx_iov.size() < IOV_MAX); it++) {
+      size_t skip = (it == _txq.begin()) ? _tx_offset : 0;
+      _tx_iov.push_back({(void *) (it->data() + skip), it->size() - skip});
+      _tx_asked += it->size() - skip;
+   }
+   return _tx_iov;
+}
+
+/**********************************************************************************************
+ * finishFlush - drops what the writev got out, remembering how far it got into the buffer it
+ *               stopped in. A short write means the socket is full, and the rest waits until
+ *               the event loop says it's writable
  *
- *    Throws: runtime_error for unrecoverable errors
+ *    Params:  results - bytes written, or -errno (-EAGAIN if the socket was already full)
  **********************************************************************************************/
 
-void TCPConn::encryptData(std::vector<uint8_t> &buf) {
-   // For the initialization vector
-   SecByteBlock init_vector(iv_size);
-   AutoSeededRandomPool rnd;
+void TCPConn::finishFlush(ssize_t results) {
+   _writable = false;
+   if ((results == -EAGAIN) || (results == -EWOULDBLOCK) || (results == -EINTR))
+      results = 0;
 
-   // Generate our random init vector
-   rnd.GenerateBlock(init_vector, init_vector.size());
+   if (results < 0) {
+      std::cout << "Socket error, disconnecting.\n";
+      disconnect();
+      return;
+   }
+   _tx_bytes -= results;
 
-   // Encrypt the data
-   CFB_Mode<AES>::Encryption encryptor;
-   encryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+   size_t written = _tx_offset + results;
+   while (!_txq.empty() && (written >= _txq.front().size())) {
+      written -= _txq.front().size();
+      _txq.pop_front();
+   }
+   _tx_offset = written;
+   _tx_full = ((size_t) results < _tx_asked);
+}
 
-   std::string cipher;
-   ArraySource as(buf.data(), buf.size(), true,
-            new StreamTransformationFilter(encryptor, new StringSink(cipher)));
+/**********************************************************************************************
+ * flushOutput - writes queued buffers with writev until they're all gone or the socket is
+ *               full
+ **********************************************************************************************/
 
-   // Now add the IV to the stream we will be sending out
-   std::vector<uint8_t> enc_data(init_vector.begin(), init_vector.end());
-   enc_data.insert(enc_data.end(), cipher.begin(), cipher.end());
-   buf = enc_data;
+void TCPConn::flushOutput() {
+   while (wantsFlush()) {
+      const std::vector<struct iovec> &iov = prepareFlush();
+      if (_shm) {
+         finishFlush(_shm->write(iov.data(), iov.size()));
+      } else {
+         ssize_t results = _connfd.tryWriteVec(iov.data(), iov.size());
+         finishFlush((results < 0) ? -errno : results);
+      }
+      if (_tx_full)
+         break;
+   }
 }
 
 /**********************************************************************************************
@@ -176,77 +232,47 @@ void TCPConn::encryptData(std::vector<uint8_t> &buf) {
 void TCPConn::handleConnection() {
 
    try {
+      // The queue manager dropped the session
+      if (_close_req) {
+         disconnect();
+         return;
+      }
+
+      // Client: the socket turns writable (or flags an error) when the connect finishes
+      if (_status == s_dialing) {
+         if ((!_readable && !_writable) || !finishConnect())
+            return;
+      }
+
       switch (_status) {
 
-         // Client: Just connected, send our SID
+         // Client: Connected, send our hello
          case s_connecting:
-            //std::cout << "Client SENDING SID" << std::endl;
-            sendSID();
+            sendHello();
             break;
 
-	 // Server: Send first challenge Voltz
-	 case s_schallenge:
-            //std::cout << "Server Sending Challenge" << std::endl;
-            sAuthChallenge(_auth_challenge_s);
+         // Client: Check the server's answer and prove ourselves, which opens the session
+         case s_waitauth:
+            cAuthCheck();
             break;
 
-         // Client: Encrypt first challenge and send it back Voltz
-         case s_cproof:
-            //std::cout << "Client Proving itself" << std::endl;
-            cAuthResponse();
-            break;
-            
-	 // Server: Verifies the encrypted response from client Voltz
-	 case s_scheck:
-            //std::cout << "Server Verifying Client" << std::endl;
-            sAuthCheck();
-            break;
-	    
-         // Client: Sends challenge to server Voltz
-         case s_cchallenge:
-            //std::cout << "Client sending Challenge" << std::endl;
-            cAuthChallenge(_auth_challenge_c);
+         // Server: Answer the client's hello with our challenge and proof
+         case s_waithello:
+            sAuthAnswer();
             break;
 
-         // Server: respond with encrypted challenge and send it back Voltz
-         case s_sproof:
-            //std::cout << "Server Proving itself" << std::endl;
-            sAuthResponse();
+         // Server: Check the client's proof, which opens the session
+         case s_waitproof:
+            sProofCheck();
             break;
 
-         // Client: Verify the encrypted response from server Voltz
-         case s_ccheck:
-            //std::cout << "Client Verifying Server" << std::endl;
-            cAuthCheck();
-	    break;
-
-         // Server: Wait for the SID from a newly-connected client, then send our SID
-         case s_connected:
-            //std::cout << "Server Recieve SID" << std::endl;
-            waitForSID();
-            break;
-   
-         // Client: connecting user - replicate data
-         case s_datatx:
-            transmitData();
-            break;
-
-         // Server: Receive data from the client
-         case s_datarx:
-            waitForData();
-            break;
-   
-         // Client: Wait for acknowledgement that data sent was received before disconnecting
-         case s_waitack:
-            awaitAck();
-            break;
-         
-         // Server: Data received and conn disconnected, but waiting for the data to be retrieved
-         case s_hasdata:
+         // Both: Session open, exchange replication frames and acks
+         case s_session:
+            handleSession();
             break;
 
          default:
-            std::cout << _status << std::endl;
+            std::cout << _status.load() << std::endl;
             throw std::runtime_error("Invalid connection status in connection!");
             break;
       }
@@ -259,590 +285,709 @@ void TCPConn::handleConnection() {
 }
 
 /**********************************************************************************************
- * sendSID()  - Client: after a connection, client sends its Server ID to the server
+ * sendHello - Client: opens the handshake (see Handshake.h) with our challenge, our SID and
+ *             the ticket from our last session with the server, if we have one
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::sendSID() {
-   std::vector<uint8_t> buf(_svr_id.begin(), _svr_id.end());
-   wrapCmd(buf, c_sid, c_endsid);
-   sendData(buf);
+void TCPConn::sendHello() {
+   ClientHello hello;
+   randomBytes(_auth_challenge_c, challenge_size);
+   hello.challenge = _auth_challenge_c;
+   hello.sid = _svr_id;
+   hello.ticket = _ticket.blob;
 
-   _status = s_datatx; 
+   std::vector<uint8_t> buf;
+   packClientHello(hello, buf);
+   sendFrame(ft_hello, buf);
+
+   _status = s_waitauth;
 }
 
 /**********************************************************************************************
- * getRandBits  - Creates random bits useful for sending challenges. Voltz
- * 
- *		This method is based on generating bits from a discussion with LT Josh Larson
- *              and a reference from cplusplus.com/reference/random/
- *              and a reference from en.cppreference.com/w/cpp/numeric/random
- *    
+ * sAuthAnswer - Server: answers a client's hello with our challenge, our proof, our SID and a
+ *               ticket for next time, all in one frame. We resume with the client's ticket if
+ *               we can open it, otherwise prove ourselves with the shared key
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::getRandBits(std::vector<uint8_t> &dest) {
-   int size = 16;
-   // initialize c++ way of creating random numbers 
-   std::default_random_engine byteGen{std::random_device{}()};
-   std::uniform_int_distribution<uint8_t> dist(0,255);
-
-   // ensure the vector is the right size 
-   dest.reserve(size);
-   while(dest.size() < size)
-   {
-      dest.emplace_back(0);
-   }   
+void TCPConn::sAuthAnswer() {
+   std::vector<uint8_t> buf;
+   ClientHello hello;
+   int results = getFrame(ft_hello, buf);
+   if ((results > 0) && !parseClientHello(buf, hello))
+      results = -1;
+   if (results < 0) {
+      std::stringstream msg;
+      msg << "Hello from connecting client invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+   }
+   if (results <= 0)
+      return;
 
-   // assign the random characters 
-   for(auto & r : dest){
-	r = dist(byteGen);
+   setNodeID(hello.sid.c_str());
+   _auth_challenge_c = hello.challenge;
+
+   ServerAuth auth;
+   _session_secret = _aes_key;
+   if (!hello.ticket.empty()) {
+      std::string dialer, acceptor;
+      CryptoPP::SecByteBlock secret;
+      if (openTicket(_aes_key, hello.ticket, dialer, acceptor, secret) &&
+          (dialer == hello.sid) && (acceptor == _svr_id)) {
+         _session_secret = secret;
+         auth.flags |= auth_resumed;
+      } else {
+         std::stringstream msg;
+         msg << "Resumption ticket from " << hello.sid << " invalid or expired, doing the " <<
+                "full handshake.";
+         _server_log.writeLog(msg.str().c_str());
+      }
    }
 
+   randomBytes(_auth_challenge_s, challenge_size);
+   auth.challenge = _auth_challenge_s;
+   auth.sid = _svr_id;
+   auth.proof.resize(proof_size);
+   handshakeProof(_session_secret, acceptor_proof, handshakeTranscript(false), auth.proof.data());
+   issueTicket(auth.ticket);
+
+   packServerAuth(auth, buf);
+   sendFrame(ft_auth, buf);
+
+   _status = s_waitproof;
 }
 
 /**********************************************************************************************
- * sAuthChallenge  - create a challenge and send it to other side of connection Voltz
- * 
- *             dest: the vector that the challenge will be stored in (server challenge)
- *    
+ * cAuthCheck - Client: checks the server's answer to our hello and, if its proof checks out,
+ *              sends ours and opens the session without waiting any longer
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::sAuthChallenge(std::vector<uint8_t> &dest) {
-   // clear buffer if anything is there
-   if (_connfd.hasData()) {
-   std::vector<uint8_t> holder;   
-   getData(holder);
+void TCPConn::cAuthCheck() {
+   std::vector<uint8_t> buf;
+   ServerAuth auth;
+   int results = getFrame(ft_auth, buf);
+   if ((results > 0) && !parseServerAuth(buf, auth))
+      results = -1;
+   if (results < 0) {
+      std::stringstream msg;
+      msg << "Handshake answer from server invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+   }
+   if (results <= 0)
+      return;
+
+   // We dialed this server by SID, so it had better be the one that answered
+   if (auth.sid != _node_id) {
+      std::stringstream msg;
+      msg << "Server dialed as " << _node_id << " answered as '" << auth.sid << "'. Disconnecting.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
    }
-   //  put random bits into challenge 
-   getRandBits(dest);
-   std::vector<uint8_t> buf(dest.begin(), dest.end()); 
-   
-   // send the info to the attempted connection, not encrypted 
-   wrapCmd(buf, c_auth, c_endauth);
-   sendData(buf);
-
-/*
-         std::cout << "_auth_challenge_s IS: " << std::endl;
-         for(auto i : _auth_challenge_s)
-         {
-            std::cout << i;// << std::endl;
-         }
-         std::cout << std::endl;
-*/
 
-   // set the status to the next step
-   _status = s_scheck;
+   // The server either resumed with our ticket or turned it down and used the shared key
+   bool resumed = (auth.flags & auth_resumed);
+   if (!resumed && !_ticket.empty()) {
+      std::stringstream msg;
+      msg << "Server " << _node_id << " turned down our resumption ticket, doing the full " <<
+             "handshake.";
+      _server_log.writeLog(msg.str().c_str());
+   }
+   if (resumed && !_ticket.empty())
+      _session_secret = _ticket.secret;
+   else
+      _session_secret = _aes_key;
+
+   _auth_challenge_s = auth.challenge;
+   std::vector<uint8_t> transcript = handshakeTranscript(true);
+   if ((resumed && _ticket.empty()) ||
+       !checkHandshakeProof(_session_secret, acceptor_proof, transcript, auth.proof.data())) {
+      std::cout << "Failed a authorization check. Exiting" << std::endl;
+      disconnect();
+      return;
+   }
+
+   if (!auth.ticket.empty())
+      keepTicket(auth.ticket);
+
+   std::vector<uint8_t> proof(proof_size);
+   handshakeProof(_session_secret, dialer_proof, transcript, proof.data());
+   sendFrame(ft_proof, proof);
 
+   if (_verbosity >= 3)
+      std::cout << "Successfully authenticated connection with " << getNodeID() <<
+                   ", session open.\n";
+   startSession(true);
 }
 
 /**********************************************************************************************
- * cAuthChallenge  - create a challenge and send it to the server Voltz
- * 
- *             dest: the vector that the challenge will be stored in (client challenge)
- *    
+ * sProofCheck - Server: checks the client's proof, which opens the session. The client may
+ *               send frames right behind it, so anything after it is left in the stream
+ *               buffer for the session
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::cAuthChallenge(std::vector<uint8_t> &dest) {
-   // wait for information
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> holder;
-      getData(holder);
-   
-      //  put random bits into challenge 
-      getRandBits(dest);
-      std::vector<uint8_t> buf(dest.begin(), dest.end()); 
-   
-      // send the info to the attempted connection, not encrypted 
-      wrapCmd(buf, c_auth, c_endauth);
-      sendData(buf);
+void TCPConn::sProofCheck() {
+   std::vector<uint8_t> buf;
+   int results = getFrame(ft_proof, buf);
+   if ((results > 0) && (buf.size() != proof_size))
+      results = -1;
+   if (results < 0) {
+      std::stringstream msg;
+      msg << "Proof from connecting client invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+   }
+   if (results <= 0)
+      return;
 
-      // set the status to the next step
-      _status = s_ccheck;
+   if (!checkHandshakeProof(_session_secret, dialer_proof, handshakeTranscript(false),
+                            buf.data())) {
+      std::cout << "Failed the server authorization check. Exiting" << std::endl;
+      disconnect();
+      return;
    }
 
+   startSession(false);
+   parseStream();
 }
 
 /**********************************************************************************************
- * sAuthResponse  - Gets the Client challenge from the socket and responds to challenge 
- * 
- *    
+ * startSession - opens the session, switching the cipher from the shared key to keys derived
+ *                from the session's secret and both sides' challenges, so they're fresh for
+ *                every session. Both sides switch once the proofs are checked, before any
+ *                replication frame
+ *
+ *    Params: dialer - true if we opened the connection
  **********************************************************************************************/
 
-void TCPConn::sAuthResponse() {
-   // If data on the socket, should be challenge from server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+void TCPConn::startSession(bool dialer) {
+   std::vector<uint8_t> salt = sessionSalt();
+   _cipher.deriveSessionKeys(_session_secret, _session_secret.size(), salt.data(), salt.size(),
+                             dialer);
 
-      // quit if getting the data fails
-      if (!getData(buf)){
-         std::cout << "FAILED TO GET DATA" << std::endl;
-         return;   
-      }                           
+   _status = s_session;
+   _news = true;
+}
 
-      // if the command is in an unexpected format 
-      if (!getCmdData(buf, c_auth, c_endauth)) {
-         std::stringstream msg;
-         msg << "Challenge String from server invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
+// Both challenges, the client's first - fresh for every session
+std::vector<uint8_t> TCPConn::sessionSalt() {
+   std::vector<uint8_t> salt(_auth_challenge_c);
+   salt.insert(salt.end(), _auth_challenge_s.begin(), _auth_challenge_s.end());
+   return salt;
+}
 
-      // send encrypted data
-      wrapCmd(buf, c_auth, c_endauth);
-      sendEncryptedData(buf);
-      // set status to next step
-      _status = s_connected;
-   }
+// What both proofs cover - the challenges and SIDs
+std::vector<uint8_t> TCPConn::handshakeTranscript(bool dialer) {
+   std::vector<uint8_t> transcript;
+   if (dialer)
+      ::handshakeTranscript(_auth_challenge_c, _auth_challenge_s, _svr_id, _node_id, transcript);
+   else
+      ::handshakeTranscript(_auth_challenge_c, _auth_challenge_s, _node_id, _svr_id, transcript);
+   return transcript;
 }
 
 /**********************************************************************************************
- * cAuthResponse  - Gets the Server challenge from the socket and responds to challenge 
- * 
- *    
+ * issueTicket - Server: seals a ticket holding this session's resumption secret for the client
+ *
+ *    Params: blob - loaded with the ticket
  **********************************************************************************************/
 
-void TCPConn::cAuthResponse() {
-   // If data on the socket, should be challenge from server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-
-      // quit if getting the data fails
-      if (!getData(buf)){
-         std::cout << "FAILED TO GET DATA" << std::endl;
-         return;   
-      }                           
-
-      // if the command is in an unexpected format 
-      if (!getCmdData(buf, c_auth, c_endauth)) {
-         std::stringstream msg;
-         msg << "Challenge String from server invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         std::cout << msg.str() << std::endl; //Voltz
-         disconnect();
-         return;
-      }
-
-      // send encrypted data
-      wrapCmd(buf, c_auth, c_endauth);
-      sendEncryptedData(buf);
-      // set status to next step
-      _status = s_cchallenge;
-   }
+void TCPConn::issueTicket(std::vector<uint8_t> &blob) {
+   std::vector<uint8_t> salt = sessionSalt();
+   CryptoPP::SecByteBlock secret;
+   deriveResumeSecret(_session_secret, salt.data(), salt.size(), secret);
+   sealTicket(_aes_key, secret, _node_id, _svr_id, blob);
 }
 
 /**********************************************************************************************
- * sAuthCheck  - Check response to challenge 
- * 
- *    
+ * keepTicket - Client: keeps the ticket the server issued, with our own copy of the secret in
+ *              it, for the queue manager to pick up once the session is open
  **********************************************************************************************/
 
-void TCPConn::sAuthCheck() {
-   // If data on the socket, should be response from client
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-      // quit if getting the data fails
-      if (!getEncryptedData(buf))
-         return;
-      // if the command is in an unexpected format 
-      if (!getCmdData(buf, c_auth, c_endauth)) {
-         std::stringstream msg;
-         msg << "Challenge String in invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      // Check against saved variable and move on or disconnect 
-      if(buf == _auth_challenge_s){ // case that the client response to challenge is valid
-         // set status to allow client to send challenge
-         _status = s_sproof;
-         // send something across so client knows to continue
-         std::vector <uint8_t> buff;
-         buff.emplace_back(1);
-         wrapCmd(buff, c_auth, c_endauth);
-         sendData(buff);
-      }
-      else{
-        std::cout << "Failed the server authorization check. Exiting" << std::endl;
-	disconnect();
-        return;
-      }
-
-   }
+void TCPConn::keepTicket(const std::vector<uint8_t> &blob) {
+   std::vector<uint8_t> salt = sessionSalt();
+   deriveResumeSecret(_session_secret, salt.data(), salt.size(), _new_ticket.secret);
+   _new_ticket.blob = blob;
+   _has_new_ticket = true;
 }
 
 /**********************************************************************************************
- * cAuthCheck  - Check response to challenge 
- * 
- *    
+ * takeTicket - gets the ticket issued on this session, once. Called by the queue manager once
+ *              the session is open (the ticket is set before it opens and never after)
+ *
+ *    Returns: false if there isn't one (or it was already taken)
  **********************************************************************************************/
 
-void TCPConn::cAuthCheck() {
-   // If data on the socket, should be challenge from server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-      // quit if getting the data fails
-      if (!getEncryptedData(buf))
-         return;
-      // if the command is in an unexpected format 
-      if (!getCmdData(buf, c_auth, c_endauth)) {
-         std::stringstream msg;
-         msg << "Challenge String in invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      // Check against saved variable and move on or disconnect 
-      if(buf == _auth_challenge_c){ // case that server response to challenge is valid
-	 // switch status to carry on since both sides have validated 
-         _status = s_connecting;
-      }
-      else{
-        std::cout << "Failed a authorization check. Exiting" << std::endl;
-	disconnect();
-        return;
-      }
+bool TCPConn::takeTicket(ResumeTicket &ticket) {
+   if (!_has_new_ticket)
+      return false;
 
-   }
+   ticket = std::move(_new_ticket);
+   _has_new_ticket = false;
+   return true;
 }
 
 /**********************************************************************************************
- * waitForSID()  - receives the SID and sends our SID
+ * handleSession - sends the payloads the queue manager handed over, then reads replication
+ *                 frames and acks off an open session
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::waitForSID() {
-
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+void TCPConn::handleSession() {
 
-      if (!getData(buf))
-         return;
+   // Payloads the queue manager handed over since the last pass
+   BufferChain payload;
+   while (_connected && _tx_payloads.pop(payload))
+      sendSealedFrame(ft_rep, payload, ++_sent_seq);
 
-      if (!getCmdData(buf, c_sid, c_endsid)) {
-         std::stringstream msg;
-         msg << "SID string from connecting client invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      std::string node(buf.begin(), buf.end());
-      setNodeID(node.c_str());
+   passFrames();
+   if (_readable && readStream())
+      parseStream();
+}
 
+/**********************************************************************************************
+ * wantsRead - true if epoll flagged the socket and handleConnection will read it this pass
+ *             (not while connecting or sending our hello, which don't read, and not if it's
+ *             on shared memory or its first read may bring the channel, which a recv loses)
+ **********************************************************************************************/
 
-      // Send our Node ID
-      buf.assign(_svr_id.begin(), _svr_id.end());
-      wrapCmd(buf, c_sid, c_endsid);
-      sendData(buf);
+bool TCPConn::wantsRead() {
+   return _connected && _readable && !_close_req && !_rx_done && (_status != s_none) &&
+          (_status != s_dialing) && (_status != s_connecting) && !_shm && !_shm_accept;
+}
 
-      _status = s_datarx;
+/**********************************************************************************************
+ * prepareRead/finishRead - where a recv for us should go (the free space in the receive
+ *                          buffer, len bytes of it), and what it returned (bytes or -errno),
+ *                          which readStream takes as its first read
+ **********************************************************************************************/
 
-   }
+uint8_t *TCPConn::prepareRead(size_t &len) {
+   uint8_t *buf = _rxbuf.space();
+   len = _rxbuf.spaceSize();
+   _rx_asked = len;
+   return buf;
 }
 
+void TCPConn::finishRead(ssize_t results) {
+   _rx_done = true;
+   _rx_result = results;
+}
 
 /**********************************************************************************************
- * transmitData()  - receives the SID from the server and transmits data
+ * readStream - reads everything waiting on the (nonblocking) socket straight into the receive
+ *              buffer, stopping when the socket has nothing left (EAGAIN). If our server
+ *              already read it (finishRead), that read comes first, and if it didn't fill the
+ *              space it had, it got everything there was
  *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ *    Returns: true if anything was read, false if not (or the connection was lost)
  **********************************************************************************************/
 
-void TCPConn::transmitData() {
-
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-
-      if (!getData(buf))
-         return;
-
-      if (!getCmdData(buf, c_sid, c_endsid)) {
-         std::stringstream msg;
-         msg << "SID string from connected server invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
+bool TCPConn::readStream() {
+   if (_shm)
+      return readShm();
+
+   // Whatever epoll flagged is consumed here, so don't read again until it flags more
+   _readable = false;
+
+   bool got_data = false;
+   while (true) {
+      ssize_t results;
+      bool drained = false;
+      if (_rx_done) {
+         _rx_done = false;
+         results = _rx_result;
+         if (results < 0) {
+            errno = -results;
+            results = -1;
+         }
+         drained = ((size_t) results < _rx_asked);
+      } else if (_shm_accept) {
+         // The dialer's first message may carry a shared memory channel, and the rest of
+         // the connection is on that
+         uint8_t *space = _rxbuf.space();
+         int fds[3];
+         int nfds = 3;
+         results = _connfd.recvFDs(space, _rxbuf.spaceSize(), fds, nfds);
+         if (results >= 0)
+            _shm_accept = false;
+         if (nfds > 0)
+            return takeSharedMemory(space, results, fds, nfds) && readShm();
+      } else {
+         uint8_t *space = _rxbuf.space();
+         results = _connfd.readFD(space, _rxbuf.spaceSize());
       }
 
-      std::string node(buf.begin(), buf.end());
-      setNodeID(node.c_str());
+      if ((results < 0) && (errno == EINTR))
+         continue;
+
+      // drained everything that was waiting (spurious wakeup if there was nothing at all)
+      if ((results < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+         return got_data;
 
-      // Send the replication data
-      sendData(_outputbuf);
+      // A closed socket with data already read gets noticed on the next read
+      if ((results == 0) && got_data)
+         return true;
 
-      if (_verbosity >= 3)
-         std::cout << "Successfully authenticated connection with " << getNodeID() <<
-                      " and sending replication data.\n";
+      if (results <= 0) {
+         connectionLost();
+         return false;
+      }
 
-      // Wait for their response
-      _status = s_waitack;
+      _rxbuf.commit(results);
+      got_data = true;
+      if (drained)
+         return true;
    }
 }
 
-
 /**********************************************************************************************
- * waitForData - receiving server, authentication complete, wait for replication datai
-               Also sends a plaintext random auth string of our own
+ * readShm - readStream for a connection on shared memory: copies everything the peer has
+ *           written to us into the receive buffer. Once the socket flags the peer leaving,
+ *           what it wrote before it went is read first
  *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ *    Returns: true if anything was read, false if not (or the connection was lost)
  **********************************************************************************************/
 
-void TCPConn::waitForData() {
-
-   // If data on the socket, should be replication data
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-
-      if (!getData(buf))
-         return;
+bool TCPConn::readShm() {
+   _readable = false;
 
-      if (!getCmdData(buf, c_rep, c_endrep)) {
+   bool got_data = false;
+   while (true) {
+      uint8_t *space = _rxbuf.space();
+      size_t size = _rxbuf.spaceSize();
+      ssize_t results = _shm->read(space, size);
+      if (results < 0) {
          std::stringstream msg;
-         msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
+         msg << "Shared memory from " << getNodeID() << " corrupted, dropping session.";
          _server_log.writeLog(msg.str().c_str());
          disconnect();
-         return;
+         return false;
       }
 
-      // Got the data, save it
-      _inputbuf = buf;
-      _data_ready = true;
-
-      // Send the acknowledgement and disconnect
-      sendData(c_ack);
-
-      if (_verbosity >= 2)
-         std::cout << "Successfully received replication data from " << getNodeID() << "\n";
-
+      _rxbuf.commit(results);
+      if (results > 0)
+         got_data = true;
+      if ((size_t) results < size)
+         break;
+   }
 
-      disconnect();
-      _status = s_hasdata;
+   if (!got_data && _shm_hup) {
+      connectionLost();
+      return false;
    }
+   return got_data;
 }
 
-
 /**********************************************************************************************
- * awaitAwk - waits for the awk that data was received and disconnects
- *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ * connectionLost - logs that the peer went away and closes our end
  **********************************************************************************************/
 
-void TCPConn::awaitAck() {
-
-   // Should have the awk message
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+void TCPConn::connectionLost() {
+   std::stringstream msg;
+   std::string ip_addr;
+   msg << "Connection from server " << _node_id << " lost (IP: " << 
+                                                   getIPAddrStr(ip_addr) << ")"; 
+   _server_log.writeLog(msg.str().c_str());
+   disconnect();
+}
 
-      if (!getData(buf))
-         return;
+/**********************************************************************************************
+ * startSharedMemory - Dialer: sets up a shared memory channel and sends it to the acceptor,
+ *                     with the offer message, over the Unix socket we just connected. If the
+ *                     channel can't be set up, the connection carries on over the socket
+ *
+ *    Returns: false if sending the offer failed (the connection is closed)
+ **********************************************************************************************/
 
-      if (findCmd(buf, c_ack) == buf.end())
-      {
-         std::stringstream msg;
-         msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
-         _server_log.writeLog(msg.str().c_str());
-      }
-  
-      if (_verbosity >= 3)
-         std::cout << "Data ack received from " << getNodeID() << ". Disconnecting.\n";
+bool TCPConn::startSharedMemory() {
+   int fds[3];
+   std::unique_ptr<ShmChannel> chan = ShmChannel::create(fds);
+   if (!chan) {
+      std::stringstream msg;
+      msg << "Unable to set up shared memory for SID " << _node_id << ": " << strerror(errno) <<
+             ". Staying on the socket.";
+      _server_log.writeLog(msg.str().c_str());
+      return true;
+   }
 
- 
+   if (_connfd.sendFDs(shm_offer, shm_offer_size, fds, 3) != (ssize_t) shm_offer_size) {
+      std::stringstream msg;
+      msg << "Sending shared memory to SID " << _node_id << " failed: " << strerror(errno);
+      _server_log.writeLog(msg.str().c_str());
       disconnect();
+      return false;
    }
+
+   attachChannel(std::move(chan));
+   return true;
 }
 
 /**********************************************************************************************
- * getData - Reads in data from the socket and checks to see if there's an end command to the
- *           message to confirm we got it all
- *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
+ * takeSharedMemory - Acceptor: the dialer's first message came with file descriptors, which
+ *                    must be the offer and a channel we can map
  *
- *    Returns: true if the data is ready to be read, false if they lost connection
+ *    Params:  buf/len - the message
+ *             fds/nfds - the descriptors that came with it
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Returns: true if the connection is now on shared memory, false if it was closed
  **********************************************************************************************/
 
-bool TCPConn::getData(std::vector<uint8_t> &buf) {
-
-   std::vector<uint8_t> readbuf;
-   size_t count = 0;
-
-   buf.clear();
-
-   while (_connfd.hasData()) {
-      // read the data on the socket up to 1024
-      count += _connfd.readBytes<uint8_t>(readbuf, 1024);
-
-      // check if we lost connection
-      if (readbuf.size() == 0) {
-         std::stringstream msg;
-         std::string ip_addr;
-         msg << "Connection from server " << _node_id << " lost (IP: " << 
-                                                         getIPAddrStr(ip_addr) << ")"; 
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return false;
-      }
-
-      buf.insert(buf.end(), readbuf.begin(), readbuf.end());
+bool TCPConn::takeSharedMemory(const uint8_t *buf, ssize_t len, int *fds, int nfds) {
+   std::unique_ptr<ShmChannel> chan;
+   if ((nfds == 3) && (len == (ssize_t) shm_offer_size) && (memcmp(buf, shm_offer, len) == 0)) {
+      chan = ShmChannel::attach(fds);
+   } else {
+      for (int i=0; i<nfds; i++)
+         close(fds[i]);
+   }
 
-      // concat the data onto anything we've read before
-//      _inputbuf.insert(_inputbuf.end(), readbuf.begin(), readbuf.end());
+   if (!chan) {
+      std::stringstream msg;
+      std::string ip_addr;
+      msg << "Unusable shared memory offered on " << getIPAddrStr(ip_addr) << ", disconnecting.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return false;
    }
+
+   attachChannel(std::move(chan));
    return true;
 }
 
 /**********************************************************************************************
- * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
- *               buf with the decrypted info (destroys IV string>
- *
- *    Params: buf - the encrypted string and holds the decrypted data (minus IV)
- *
+ * attachChannel - moves the connection onto the channel, and has the event loop wake us when
+ *                 the peer signals its eventfd
  **********************************************************************************************/
-void TCPConn::decryptData(std::vector<uint8_t> &buf) {
-   // For the initialization vector
-   SecByteBlock init_vector(iv_size);
 
-   // Copy the IV from the incoming stream of data
-   init_vector.Assign(buf.data(), iv_size);
-   buf.erase(buf.begin(), buf.begin() + iv_size);
+void TCPConn::attachChannel(std::unique_ptr<ShmChannel> chan) {
+   _shm = std::move(chan);
+   if (_loop != nullptr)
+      _loop->addFD(_shm->getWaitFD(), EPOLLIN);
 
-   // Decrypt the data
-   CFB_Mode<AES>::Decryption decryptor;
-   decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+   if (_verbosity >= 2) {
+      std::string ip_addr;
+      std::cout << "Connection on " << getIPAddrStr(ip_addr) << " moved to shared memory.\n";
+   }
+}
 
-   std::string recovered;
-   ArraySource as(buf.data(), buf.size(), true,
-            new StreamTransformationFilter(decryptor, new StringSink(recovered)));
+/**********************************************************************************************
+ * setShmEvents - takes what the event loop flagged for a connection on shared memory. The
+ *                peer signals its eventfd when it writes to us or makes room for us, and
+ *                nothing comes on the socket once the channel is up, so it flagging means the
+ *                peer has gone
+ **********************************************************************************************/
 
-   buf.assign(recovered.begin(), recovered.end());
+void TCPConn::setShmEvents(bool sock_ready, bool shm_ready) {
+   if (shm_ready)
+      _shm->drainWakeups();
+   if (sock_ready)
+      _shm_hup = true;
 
+   _readable = sock_ready || shm_ready;
+   _writable = shm_ready;
 }
 
-
 /**********************************************************************************************
- * getEncryptedData - Reads in data from the socket and decrypts it, passing the decrypted
- *                    data back in buf
- *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
- *
- *    Returns: true if the data is ready to be read, false otherwise
+ * parseStream - pulls complete frames out of the receive buffer. A replication frame is
+ *               opened (decrypted in place), passed to the queue manager (as a view of the
+ *               receive buffer, not a copy) and acked, an ack is opened the same way and
+ *               counted. A frame cut off by the end of the buffer waits for the rest to
+ *               arrive, and frame types we don't know (from a newer version) are skipped
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-bool TCPConn::getEncryptedData(std::vector<uint8_t> &buf) {
-   // Get the data from the socket
-   if (!getData(buf))
-      return false;
+void TCPConn::parseStream() {
 
-   decryptData(buf);
+   while (_connected && !_rxbuf.empty()) {
+      FrameHeader hdr;
+      int results = nextFrame(hdr);
+      if (results == 0)
+         break;
+
+      if (results < 0) {
+         std::stringstream msg;
+         msg << "Replication data possibly corrupted from " << getNodeID() << ", dropping session.";
+         _server_log.writeLog(msg.str().c_str());
+         disconnect();
+         return;
+      }
 
-   return true; 
+      if (hdr.type == ft_ack) {
+         // An ack releases payloads for good, so it has to be sealed like the frame it acks
+         if (!(hdr.flags & ff_sealed) || !_cipher.open(_rxbuf.mutableData() + hdr.header_len,
+                                                       hdr.length, _rxbuf.data(), hdr.header_len)) {
+            std::stringstream msg;
+            msg << "Ack for frame " << hdr.seq << " from " << getNodeID() <<
+                   " failed authentication, dropping session.";
+            _server_log.writeLog(msg.str().c_str());
+            disconnect();
+            return;
+         }
+
+         // Acks come back in the order we sent
+         if (hdr.seq != _acked_seq + 1) {
+            std::stringstream msg;
+            msg << "Ack for frame " << hdr.seq << " from " << getNodeID() << " out of order (expected " <<
+                   _acked_seq + 1 << "), dropping session.";
+            _server_log.writeLog(msg.str().c_str());
+            disconnect();
+            return;
+         }
+         _acked_seq = hdr.seq;
+         _acks++;
+         _news = true;
+
+      } else if (hdr.type == ft_rep) {
+         // Decrypted in place in the receive buffer, then shared from there
+         if (!(hdr.flags & ff_sealed) || !_cipher.open(_rxbuf.mutableData() + hdr.header_len,
+                                                       hdr.length, _rxbuf.data(), hdr.header_len)) {
+            std::stringstream msg;
+            msg << "Replication frame " << hdr.seq << " from " << getNodeID() <<
+                   " failed authentication, dropping session.";
+            _server_log.writeLog(msg.str().c_str());
+            disconnect();
+            return;
+         }
+         _rx_waiting.emplace_back(hdr.seq, _rxbuf.share(hdr.header_len + seal_iv_size,
+                                                        hdr.length - seal_overhead));
+
+         if (_verbosity >= 2)
+            std::cout << "Successfully received replication data from " << getNodeID() << "\n";
+      }
+
+      _rxbuf.consume(hdr.header_len + hdr.length);
+   }
+
+   passFrames();
 }
 
 /**********************************************************************************************
- * findCmd - returns an iterator to the location of a string where a command starts
- * hasCmd - returns true if command was found, false otherwise
- *
- *    Params: buf = the data buffer to look for the command within
- *            cmd - the command string to search for in the data
- *
- *    Returns: iterator - points to cmd position if found, end() if not found
+ * passFrames - moves received frames into the ring the queue manager reads, in order, while it
+ *              has room. Each is acked once it's there, so the sender holds on to (and resends
+ *              after a failure) anything that never made it to the queue manager. Acks are
+ *              sealed (an empty payload, the header as associated data) so they can't be forged
  *
+ *    Throws: socket_error if sending an ack fails
  **********************************************************************************************/
 
-std::vector<uint8_t>::iterator TCPConn::findCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
-   return std::search(buf.begin(), buf.end(), cmd.begin(), cmd.end());
-}
+void TCPConn::passFrames() {
+   while (_connected && !_rx_waiting.empty()) {
+      if (!_rx_frames.push(std::move(_rx_waiting.front().second)))
+         return;
 
-bool TCPConn::hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
-   return !(findCmd(buf, cmd) == buf.end());
+      sendSealedFrame(ft_ack, BufferChain(), _rx_waiting.front().first);
+      _rx_waiting.pop_front();
+      _news = true;
+   }
 }
 
 /**********************************************************************************************
- * getCmdData - looks for a startcmd and endcmd and returns the data between the two 
- *
- *    Params: buf = the string to search for the tags
- *            startcmd - the command at the beginning of the data sought
- *            endcmd - the command at the end of the data sought
+ * nextFrame - reads the header of the frame at the front of the receive buffer in place and,
+ *             once the whole frame is there, checks its CRC (unless it's sealed). If only part
+ *             of a big frame is there, makes room for the rest so it arrives in one piece. The
+ *             caller consumes the frame when done with it
  *
- *    Returns: true if both start and end commands were found, false otherwisei
+ *    Params: hdr - loaded with the frame's header
  *
+ *    Returns: 1 if the whole frame is there, 0 if it hasn't all arrived, -1 if the stream is
+ *             corrupt
  **********************************************************************************************/
 
-bool TCPConn::getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd, 
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = buf;
-   auto start = findCmd(temp, startcmd);
-   auto end = findCmd(temp, endcmd);
+int TCPConn::nextFrame(FrameHeader &hdr) {
+   int results = parseFrameHeader(_rxbuf.data(), _rxbuf.size(), hdr);
+   if (results <= 0)
+      return results;
 
-   if ((start == temp.end()) || (end == temp.end()) || (start == end))
-      return false;
+   size_t frame_size = hdr.header_len + hdr.length;
+   if (_rxbuf.size() < frame_size) {
+      _rxbuf.reserve(frame_size);
+      return 0;
+   }
 
-   buf.assign(start + startcmd.size(), end);
-   return true;
+   // A sealed frame's tag is checked when it's opened instead
+   if (!(hdr.flags & ff_sealed) && (crc32(_rxbuf.data() + hdr.header_len, hdr.length) != hdr.crc))
+      return -1;
+   return 1;
 }
 
 /**********************************************************************************************
- * wrapCmd - wraps the command brackets around the passed-in data
+ * getFrame - handshake steps: reads the socket if it has data and takes the next frame, which
+ *            must be of the type given
  *
- *    Params: buf = the string to wrap around
- *            startcmd - the command at the beginning of the data
- *            endcmd - the command at the end of the data
+ *    Params: type - the frame_type expected
+ *            buf - loaded with the frame's payload
  *
+ *    Returns: 1 if the frame was read, 0 if it hasn't arrived yet, -1 if the stream is corrupt
+ *             or the frame is the wrong type
  **********************************************************************************************/
 
-void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = startcmd;
-   temp.insert(temp.end(), buf.begin(), buf.end());
-   temp.insert(temp.end(), endcmd.begin(), endcmd.end());
-
-   buf = temp;
+int TCPConn::getFrame(uint8_t type, std::vector<uint8_t> &buf) {
+   if (_readable)
+      readStream();
+   if (!_connected)
+      return 0;
+
+   FrameHeader hdr;
+   int results = nextFrame(hdr);
+   if (results <= 0)
+      return results;
+   if (hdr.type != type)
+      return -1;
+
+   const uint8_t *payload = _rxbuf.data() + hdr.header_len;
+   buf.assign(payload, payload + hdr.length);
+   _rxbuf.consume(hdr.header_len + hdr.length);
+   return 1;
 }
 
-
 /**********************************************************************************************
- * getReplData - Returns the data received on the socket and marks the socket as done
+ * getInputData - Returns the oldest replication frame received on the session. Called by the
+ *                queue manager, from any thread
  *
- *    Params: buf = the data received
+ *    Params: buf = loaded with the frame's payload, a view into the receive chunk it
+ *                  arrived in (no copy)
  *
+ *    Returns: false if there were no frames waiting
  *
- *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::getInputData(std::vector<uint8_t> &buf) {
-
-   // Returns the replication data off this connection, then prepares it to be removed
-   buf = _inputbuf;
+bool TCPConn::getInputData(SharedBuffer &buf) {
 
-   _data_ready = false;
-   _status = s_none;
+   // Returns the oldest replication frame off this session
+   return _rx_frames.pop(buf);
 }
 
 /**********************************************************************************************
- * connect - Opens the socket FD, attempting to connect to the remote server
+ * connect - Opens the socket FD and starts connecting to the remote server without waiting for
+ *           it. The event loop flags the socket once the connect finishes, and handleConnection
+ *           picks up from there (see finishConnect)
  *
  *    Params:  ip_addr - ip address string to connect to
  *             port - port in host format to connect to
  *
- *    Throws: socket_error exception if failed. socket_error is a child class of runtime_error
+ *    Throws: socket_error exception if the connect failed right away. socket_error is a child
+ *            class of runtime_error
  **********************************************************************************************/
 
 void TCPConn::connect(const char *ip_addr, unsigned short port) {
 
-   // Set the status to initial client proof Voltz
-   _status = s_cproof;
+   // Wait for the connect, then send our hello
+   _status = s_dialing;
 
    // Try to connect
-   if (!_connfd.connectTo(ip_addr, port))
+   if (!_connfd.connectTo(ip_addr, port, false))
       throw socket_error("TCP Connection failed!");
 
    _connected = true;
@@ -850,32 +995,133 @@ void TCPConn::connect(const char *ip_addr, unsigned short port) {
 
 // Same as above, but ip_addr and port are in network (big endian) format
 void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
-   // Set the status to initial client proof Voltz
-   _status = s_cproof;
+   // Wait for the connect, then send our hello
+   _status = s_dialing;
 
-   if (!_connfd.connectTo(ip_addr, port))
+   if (!_connfd.connectTo(ip_addr, port, false))
       throw socket_error("TCP Connection failed!");
 
    _connected = true;
 }
 
+// Same as above, but to a server on this host listening on a Unix domain socket
+void TCPConn::connectUnix(const char *path) {
+   _status = s_dialing;
+
+   if (!_connfd.connectUnix(path, false))
+      throw socket_error("Unix socket connection failed!");
+
+   _connected = true;
+}
+
 /**********************************************************************************************
- * assignOutgoingData - sets up the connection so that, at the next handleConnection, the data
- *                      is sent to the target server
+ * finishConnect - Client: the event loop flagged the socket of a connect in progress, see
+ *                 whether it went through. If it did we move on to sending our hello, if not
+ *                 the connection is closed and the queue manager dials again later
  *
- *    Params:  data - the data stream to send to the server
+ *    Returns: true if the connection is ready for the handshake
+ **********************************************************************************************/
+
+bool TCPConn::finishConnect() {
+   int err = _connfd.getConnectError();
+   if (err == 0) {
+      _status = s_connecting;
+      if (_shm_offer && _connfd.isUnix())
+         return startSharedMemory();
+      return true;
+   }
+
+   std::stringstream msg;
+   msg << "Connect to SID " << _node_id << " failed: " << strerror(err);
+   _server_log.writeLog(msg.str().c_str());
+   if (_verbosity >= 2)
+      std::cout << msg.str() << "\n";
+
+   disconnect();
+   return false;
+}
+
+/**********************************************************************************************
+ * sendPayload - hands one replication payload to the thread driving the session, which sends
+ *               it as a frame on its next pass. The payload's buffers are written straight
+ *               behind the frame header with writev, never copied. Called by the queue manager,
+ *               from any thread; a failed write closes the connection and shows up as the
+ *               session going away
  *
+ *    Params:  data - the payload to send
+ *
+ *    Returns: true if it was handed over, false if the session isn't open or has too many
+ *             payloads waiting already
+ **********************************************************************************************/
+
+bool TCPConn::sendPayload(const BufferChain &data) {
+   if (!isSession() || !_tx_payloads.push(data))
+      return false;
+
+   if (_owner_loop != nullptr)
+      _owner_loop->wakeup();
+   return true;
+}
+
+/**********************************************************************************************
+ * takeAcks - returns how many of our frames the peer has acked since the last call
+ **********************************************************************************************/
+
+unsigned int TCPConn::takeAcks() {
+   return _acks.exchange(0);
+}
+
+/**********************************************************************************************
+ * requestClose - has the thread driving the connection close it on its next pass. The session
+ *                stops counting as one right away
  **********************************************************************************************/
 
-void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
+void TCPConn::requestClose() {
+   _close_req = true;
+   if (_owner_loop != nullptr)
+      _owner_loop->wakeup();
+}
 
-   _outputbuf.clear();
-   _outputbuf = c_rep;
-   _outputbuf.insert(_outputbuf.end(), data.begin(), data.end());
-   _outputbuf.insert(_outputbuf.end(), c_endrep.begin(), c_endrep.end());
+/**********************************************************************************************
+ * takeNews - true if anything the queue manager should look at (frames, acks, the session
+ *            opening or closing) happened since the last call
+ **********************************************************************************************/
+
+bool TCPConn::takeNews() {
+   bool news = _news;
+   _news = false;
+   return news;
 }
  
 
+/**********************************************************************************************
+ * hasPendingWork - true if the connection has something to do on the next handleConnection
+ *                  that doesn't wait on socket input (sending our hello, payloads the queue
+ *                  manager handed over, a close request, output the last write couldn't fit in
+ *                  one writev). Frames waiting for room in its ring, and a closed connection
+ *                  waiting to be drained, wait on the queue manager, which wakes us once it has
+ *                  taken frames (see wakeOwner)
+ **********************************************************************************************/
+bool TCPConn::hasPendingWork() {
+   if (!_connected)
+      return false;
+   if (_close_req || wantsFlush())
+      return true;
+   if (_status == s_session)
+      return !_tx_payloads.empty();
+   return (_status == s_connecting);
+}
+
+/**********************************************************************************************
+ * wakeOwner - wakes the thread driving the connection, if it isn't the queue manager's, so it
+ *             passes on frames it held back for room in the ring, or lets go of the connection
+ *             once it's closed and drained. Called by the queue manager after taking frames
+ **********************************************************************************************/
+void TCPConn::wakeOwner() {
+   if (_owner_loop != nullptr)
+      _owner_loop->wakeup();
+}
+
 /**********************************************************************************************
  * disconnect - cleans up the socket as required and closes the FD
  *
@@ -884,6 +1130,28 @@ void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
 void TCPConn::disconnect() {
    _connfd.closeFD();
    _connected = false;
+
+   // The peer holds the channel's eventfds too, so ours stays in the event loop until taken out
+   if (_shm) {
+      if (_loop != nullptr)
+         _loop->removeFD(_shm->getWaitFD());
+      _shm.reset();
+   }
+   _shm_accept = false;
+   _shm_hup = false;
+
+   // Unsent output goes with the socket (closing it also took it out of the event loop)
+   _txq.clear();
+   _tx_offset = 0;
+   _tx_bytes = 0;
+   _tx_full = false;
+   _writable = false;
+   watch_writes = false;
+
+   // Frames not yet passed on were never acked, the peer sends them again
+   _rx_waiting.clear();
+   _rx_done = false;
+   _news = true;
 }
 
 
@@ -4,12 +4,14 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <cerrno>
 #include <stdexcept>
 #include <strings.h>
 #include <vector>
 #include <iostream>
 #include <memory>
 #include <sstream>
+#include <algorithm>
 #include <crypto++/secblock.h>
 #include <crypto++/osrng.h>
 #include <crypto++/files.h>
@@ -41,12 +43,27 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
    _sockfd.setNonBlocking();
 
    _sockfd.setReusable();
+   if (_reuse_port)
+      _sockfd.setReusePort();
 
    // Load the socket information to prep for binding
    _sockfd.bindFD(ip_addr, port);
  
 }
 
+/**********************************************************************************************
+ * bindUnix - Also binds a Unix domain socket at path, so servers on this host can connect
+ *            without going through the TCP stack. Call before listenSvr
+ *
+ *    Throws: socket_error if the socket can't be bound
+ **********************************************************************************************/
+
+void TCPServer::bindUnix(const char *path) {
+   _unixfd.reset(new SocketFD());
+   _unixfd->bindUnix(path);
+   _unixfd->setNonBlocking();
+}
+
 /**********************************************************************************************
  * listenSvr - Starts the server socket listening for incoming connections
  *
@@ -55,13 +72,23 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 
 // Simple function that simply starts the server listening
 void TCPServer::listenSvr() {
-   _sockfd.listenFD(5);
+   _sockfd.listenFD(listen_backlog);
+   _evloop.addFD(_sockfd.getFD(), EPOLLIN);
 
    std::string ipaddr_str;
    std::stringstream msg;
    _sockfd.getIPAddrStr(ipaddr_str);
    msg << "Server listening on IP " << ipaddr_str << "' port '" << _sockfd.getPort() << "'";
    _server_log.writeLog(msg.str().c_str());
+
+   if (_unixfd) {
+      _unixfd->listenFD(listen_backlog);
+      _evloop.addFD(_unixfd->getFD(), EPOLLIN);
+
+      msg.str("");
+      msg << "Server listening on Unix socket '" << _unixfd->getUnixPath() << "'";
+      _server_log.writeLog(msg.str().c_str());
+   }
 }
 
 /**********************************************************************************************
@@ -74,20 +101,17 @@ void TCPServer::listenSvr() {
 
 void TCPServer::runServer() {
    bool online = true;
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
 
    // Start the server socket listening
    listenSvr();
 
    while (online) {
+      // Sleeps until there's socket activity so we're not chewing up CPU cycles
+      waitForEvents(-1);
+
       handleSocket();
 
       handleConnections();
-
-      // So we're not chewing up CPU cycles unnecessarily
-      nanosleep(&sleeptime, NULL);
    } 
 
 
@@ -95,37 +119,68 @@ void TCPServer::runServer() {
 }
 
 /**********************************************************************************************
- * handleSocket - Checks the socket for incoming connections and validates against the whitelist.
- *                Accepts valid connections and adds them to the connection list.
+ * handleSocket - Checks the server sockets (TCP, and Unix if there is one) for incoming
+ *                connections
  *
- *    Returns: pointer to a new connection if one was found, otherwise NULL
+ *    Returns: number of new connections accepted
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
-TCPConn *TCPServer::handleSocket() {
-  
-   // The socket has data, means a new connection 
-   if (_sockfd.hasData()) {
+unsigned int TCPServer::handleSocket() {
+   unsigned int count = acceptConns(_sockfd);
+   if (_unixfd)
+      count += acceptConns(*_unixfd);
+   return count;
+}
+
+/**********************************************************************************************
+ * acceptConns - Checks a server socket for incoming connections and validates them against the
+ *               whitelist (for Unix sockets, that they come from a process running as our user).
+ *               Accepts every valid connection waiting (not just one per pass, so a burst of
+ *               peers connecting at once doesn't wait on the event loop) and adds them to the
+ *               connection list.
+ *
+ *    Returns: number of new connections accepted
+ **********************************************************************************************/
+
+unsigned int TCPServer::acceptConns(SocketFD &listener) {
+   unsigned int count = 0;
+
+   // The socket has data, means new connections
+   if (!_evloop.isReady(listener.getFD()))
+      return 0;
+
+   while (true) {
 
-      // Try to accept the connection
-      TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
-      if (!new_conn->accept(_sockfd)) {
-         _server_log.strerrLog("Data received on socket but failed to accept.");
-         return NULL;
+      // Try to accept the next connection, until the (nonblocking) socket runs out
+      std::shared_ptr<TCPConn> new_conn(new TCPConn(_server_log, _aes_key, _verbosity));
+      if (!new_conn->accept(listener)) {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            _server_log.strerrLog("Data received on socket but failed to accept.");
+         return count;
       }
       std::cout << "***Got a connection***\n";
 
-      _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
+      _connlist.push_back(new_conn);
+      watchConn(new_conn.get());
 
       // Get their IP Address string to use in logging
       std::string ipaddr_str;
       new_conn->getIPAddrStr(ipaddr_str);
 
 
-      // Check the whitelist
-      ALMgr al("whitelist");
-      if (!al.isAllowed(new_conn->getIPAddr()))
+      // Check the whitelist. Unix sockets have no IP to check, but the peer must be running as us
+      bool allowed;
+      if (new_conn->isUnix()) {
+         uid_t uid;
+         allowed = new_conn->getPeerUID(uid) && (uid == geteuid());
+      } else {
+         ALMgr al("whitelist");
+         allowed = al.isAllowed(new_conn->getIPAddr());
+      }
+
+      if (!allowed)
       {
          // Disconnect the user
          new_conn->disconnect();
@@ -133,10 +188,11 @@ TCPConn *TCPServer::handleSocket() {
          // Log their attempted connection
          std::string msg = "Connection by IP address '";
          msg += ipaddr_str;
-         msg += "' not on whitelist. Disconnecting.";
+         msg += new_conn->isUnix() ? "' from another user. Disconnecting." :
+                                     "' not on whitelist. Disconnecting.";
          _server_log.writeLog(msg);
 
-         return NULL;
+         continue;
       }
 
       std::string msg = "Connection from IP address '";
@@ -144,60 +200,31 @@ TCPConn *TCPServer::handleSocket() {
       msg += "'.";
       _server_log.writeLog(msg);
 
-      // Send an authentication string in cleartext
-      //new_conn->handleAuthentication();
-            
-
-      return new_conn;
+      setupConn(new_conn.get());
+      count++;
    }
-   return NULL;
 }
 
 /**********************************************************************************************
  * handleConnections - Loops through the list of clients, running their functions to handle the
- *                     clients input/output.
- *
- *    Returns: number of new connections accepted
+ *                     clients input/output. With an io_uring (see IoRing), every socket epoll
+ *                     flagged is read in one batch first, and every connection's output goes
+ *                     out in one batch after, so the pass costs two syscalls however many
+ *                     connections there are. Without one, each connection reads for itself
+ *                     and its output is written with one writev
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 void TCPServer::handleConnections() {
-   // Loop through our connections, handling them
-   std::list<std::unique_ptr<TCPConn>>::iterator tptr = _connlist.begin();
+   // Loop through our connections, dropping the closed ones and flagging what epoll saw
+   auto tptr = _connlist.begin();
    while (tptr != _connlist.end())
    {
-      // If the client is not connected, then either reconnect or drop 
+      // If the client is not connected, drop it once its data has been taken. Dialed
+      // connections that failed are dialed again by their owner (see QueueMgr), not here
       if ((!(*tptr)->isConnected()) || ((*tptr)->getStatus() == TCPConn::s_none)) {
-         // Might be trying to connect
-         if ((*tptr)->getStatus() == TCPConn::s_connecting) {
-
-            // If our retry timer hasn't expired....skip
-            if ((*tptr)->reconnect > time(NULL)) {
-               tptr++;
-               continue;
-            }
-
-            unsigned long ip_addr = (*tptr)->getIPAddr();
-            unsigned short port = (*tptr)->getPort();
-            
-            // Try to connect and handle failure
-            try {
-               (*tptr)->connect(ip_addr, port);
-            } catch (socket_error &e) {
-               std::stringstream msg;
-               msg << "Connect to SID " << (*tptr)->getNodeID() << 
-                        " failed when trying to send data. Msg: " << e.what();
-               if (_verbosity >= 2)
-                  std::cout << msg.str() << "\n";
-               _server_log.writeLog(msg.str().c_str());
-               (*tptr)->disconnect();
-               (*tptr)->reconnect = time(NULL) + reconnect_delay;
-               tptr++;
-               continue;
-            }
-         // Else we're in a different state and there's not data waiting to be read
-         } else if (!(*tptr)->isInputDataReady()) {
+         if (!(*tptr)->isInputDataReady()) {
          // Log it
             std::string msg = "Node ID '";
             msg += (*tptr)->getNodeID();
@@ -213,13 +240,157 @@ void TCPServer::handleConnections() {
          continue;
       } 
 
-      // Process any user inputs
-      (*tptr)->handleConnection();
+      // Let the connection know if epoll flagged its socket (and on shared memory, the
+      // eventfd its peer signals)
+      int fd = (*tptr)->getFD();
+      int shmfd = (*tptr)->getShmFD();
+      if (shmfd < 0) {
+         (*tptr)->setReadable(_evloop.isReady(fd));
+         (*tptr)->setWritable((_evloop.getEvents(fd) & EPOLLOUT) != 0);
+      } else {
+         (*tptr)->setShmEvents(_evloop.isReady(fd), _evloop.isReady(shmfd));
+      }
 
       // Increment our iterator
       tptr++;
    }
 
+   IoRing *ring = IoRing::get();
+   if (ring != nullptr)
+      readConnections(*ring);
+
+   // Process any user inputs
+   for (auto &conn : _connlist) {
+      if (conn->isConnected() && (conn->getStatus() != TCPConn::s_none))
+         conn->handleConnection();
+   }
+
+   if (ring != nullptr) {
+      flushConnections(*ring);
+   } else {
+      for (auto &conn : _connlist)
+         conn->flushOutput();
+   }
+}
+
+/**********************************************************************************************
+ * readConnections - Reads every socket a connection will read this pass into its receive
+ *                   buffer, all in one submission to the ring
+ **********************************************************************************************/
+
+void TCPServer::readConnections(IoRing &ring) {
+   std::vector<TCPConn *> conns;
+   for (auto &conn : _connlist) {
+      if (conn->wantsRead())
+         conns.push_back(conn.get());
+   }
+
+   std::vector<std::pair<uint64_t, int>> results;
+   for (size_t first = 0; first < conns.size(); first += io_ring_entries) {
+      size_t last = std::min<size_t>(conns.size(), first + io_ring_entries);
+      for (size_t i = first; i < last; i++) {
+         size_t len;
+         uint8_t *buf = conns[i]->prepareRead(len);
+         ring.queueRecv(conns[i]->getFD(), buf, len, i);
+      }
+
+      ring.submitAndWait(results);
+      for (auto &result : results)
+         conns[result.first]->finishRead(result.second);
+   }
+}
+
+/**********************************************************************************************
+ * flushConnections - Writes the output every connection queued this pass (one writev each),
+ *                    all in one submission to the ring. Connections on shared memory copy
+ *                    theirs straight to the peer instead
+ **********************************************************************************************/
+
+void TCPServer::flushConnections(IoRing &ring) {
+   std::vector<TCPConn *> conns;
+   for (auto &conn : _connlist) {
+      if (!conn->wantsFlush())
+         continue;
+
+      if (conn->getShmFD() >= 0)
+         conn->flushOutput();
+      else
+         conns.push_back(conn.get());
+   }
+
+   std::vector<std::pair<uint64_t, int>> results;
+   for (size_t first = 0; first < conns.size(); first += io_ring_entries) {
+      size_t last = std::min<size_t>(conns.size(), first + io_ring_entries);
+      for (size_t i = first; i < last; i++) {
+         const std::vector<struct iovec> &iov = conns[i]->prepareFlush();
+         ring.queueWritev(conns[i]->getFD(), iov.data(), iov.size(), i);
+      }
+
+      ring.submitAndWait(results);
+      for (auto &result : results)
+         conns[result.first]->finishFlush(result.second);
+   }
+}
+
+/**********************************************************************************************
+ * waitForEvents - Sleeps in the event loop until the server socket or a connection has data,
+ *                 a connection with queued output can write again, the timeout expires,
+ *                 wakeup is called, or a connection has work to do that doesn't depend on
+ *                 socket input (sending)
+ *
+ *    Params:  timeout_ms - longest to sleep, -1 for no limit
+ *
+ *    Throws: socket_error if the event loop fails
+ **********************************************************************************************/
+
+void TCPServer::waitForEvents(int timeout_ms) {
+   watchWrites();
+   _evloop.wait(getConnTimeout(timeout_ms));
+}
+
+/**********************************************************************************************
+ * watchWrites - Asks the event loop to flag a connection's socket writable (EPOLLOUT) while it
+ *               has output waiting for room, and stops asking once the output is gone, so
+ *               sockets that are always writable don't keep waking us
+ *
+ *    Throws: socket_error if the event loop refuses the change
+ **********************************************************************************************/
+
+void TCPServer::watchWrites() {
+   for (auto &conn : _connlist) {
+      if (!conn->isConnected())
+         continue;
+
+      bool want = conn->hasPendingOutput();
+      if (want != conn->watch_writes) {
+         _evloop.addFD(conn->getFD(), want ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+         conn->watch_writes = want;
+      }
+   }
+}
+
+/**********************************************************************************************
+ * getConnTimeout - Caps the timeout at 0 if a connection has pending work
+ **********************************************************************************************/
+
+int TCPServer::getConnTimeout(int timeout_ms) {
+   for (auto &conn : _connlist) {
+      if (conn->hasPendingWork())
+         return 0;
+   }
+   return timeout_ms;
+}
+
+/**********************************************************************************************
+ * watchConn - Sets a connection's socket nonblocking (reads drain it until EAGAIN) and
+ *             registers it with the event loop
+ **********************************************************************************************/
+
+void TCPServer::watchConn(TCPConn *conn) {
+   conn->setNonBlocking();
+   _evloop.addFD(conn->getFD(), EPOLLIN);
+   conn->setEventLoop(&_evloop);
+   conn->watch_writes = false;
 }
 
 /*********************************************************************************************
@@ -241,6 +412,10 @@ void TCPServer::shutdown() {
    _server_log.writeLog("Server shutting down.");
 
    _sockfd.closeFD();
+   if (_unixfd) {
+      _unixfd->closeFD();
+      unlink(_unixfd->getUnixPath().c_str());
+   }
 }
 
 void TCPServer::changeLogfile(const char *filename) {
@@ -18,6 +18,7 @@
 #include "AntennaSim.h"
 #include "strfuncts.h"
 #include "ReplServer.h"
+#include "IoRing.h"
 
 using namespace std; 
 
@@ -65,6 +66,14 @@ void displayHelp(const char *execname) {
    std::cout << "   o: the file to write the DB dump CSV to (default: replication_db.cv)\n";
    std::cout << "   d: duration - seconds in \"sim time\" to run the sim\n";
    std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
+   std::cout << "   w: dedup time window - max secs between duplicate plots (default: 20)\n";
+   std::cout << "   m: dedup match tolerance - max lat/long degrees between duplicate plots (default: 0.00001)\n";
+   std::cout << "   r: replication mode - batch (every 20 sim secs, default) or stream (push as plots arrive)\n";
+   std::cout << "   l: stream mode max delay - ms a new plot can wait for its batch to fill (default: 100)\n";
+   std::cout << "   b: stream mode max batch - most plots sent in one batch (default: 256)\n";
+   std::cout << "   g: gossip fanout - send batches to this many random peers per round instead of all (default: 0, full mesh)\n";
+   std::cout << "   n: network threads - threads sharing the listening port and peer connections (default: 1)\n";
+   std::cout << "   u: io_uring - batch socket I/O through io_uring where the kernel has it (on, default) or use plain syscalls (off)\n";
 }
 
 
@@ -75,6 +84,13 @@ int main(int argc, char *argv[]) {
    float time_mult = 1.0;
    unsigned int verbosity = 0;
    int sim_time = 900; // Default 900 seconds
+   time_t dedup_window = default_time_tol;
+   float dedup_tol = default_latlon_tol;
+   ReplServer::repl_mode repl_mode = ReplServer::repl_batch;
+   unsigned int stream_delay = default_stream_delay_ms;
+   unsigned int stream_batch = default_stream_batch;
+   unsigned int gossip_fanout = 0;
+   unsigned int net_threads = 1;
    std::string ip_addr = "127.0.0.1";
    unsigned short port = 9999;
 
@@ -87,7 +103,7 @@ int main(int argc, char *argv[]) {
    // will appear in case 1
    unsigned long portval;
    int c = 0;
-   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:")) != -1) {
+   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:w:m:r:l:b:g:n:u:")) != -1) {
       switch (c) {
 
       // The inject database file specified in the command line
@@ -138,6 +154,74 @@ int main(int argc, char *argv[]) {
          }
          break;
 
+      // Time window for two plots to be duplicates
+      case 'w':
+         dedup_window = (time_t) strtol(optarg, NULL, 10);
+         if (dedup_window < 0) {
+            std::cerr << "Invalid dedup time window. Must be >= 0.\n";
+            exit(0);
+         }
+         break;
+
+      // Lat/long distance for two plots to be duplicates
+      case 'm':
+         dedup_tol = strtof(optarg, NULL);
+         if (dedup_tol < 0.0) {
+            std::cerr << "Invalid dedup match tolerance. Must be >= 0.\n";
+            exit(0);
+         }
+         break;
+
+      // Batch or streaming replication
+      case 'r':
+         if (std::string(optarg) == "stream")
+            repl_mode = ReplServer::repl_stream;
+         else if (std::string(optarg) == "batch")
+            repl_mode = ReplServer::repl_batch;
+         else {
+            std::cerr << "Invalid replication mode. Must be batch or stream.\n";
+            exit(0);
+         }
+         break;
+
+      // Streaming max delay
+      case 'l':
+         stream_delay = (unsigned int) strtol(optarg, NULL, 10);
+         break;
+
+      // Streaming max batch size
+      case 'b':
+         stream_batch = (unsigned int) strtol(optarg, NULL, 10);
+         if (stream_batch < 1) {
+            std::cerr << "Invalid stream batch size. Must be >= 1.\n";
+            exit(0);
+         }
+         break;
+
+      // Gossip fanout (0 = full mesh)
+      case 'g':
+         gossip_fanout = (unsigned int) strtol(optarg, NULL, 10);
+         break;
+
+      // Network threads
+      case 'n':
+         net_threads = (unsigned int) strtol(optarg, NULL, 10);
+         if (net_threads < 1) {
+            std::cerr << "Invalid number of network threads. Must be >= 1.\n";
+            exit(0);
+         }
+         break;
+
+      // io_uring on or off
+      case 'u':
+         if (std::string(optarg) == "off")
+            IoRing::setEnabled(false);
+         else if (std::string(optarg) != "on") {
+            std::cerr << "Invalid io_uring setting. Must be on or off.\n";
+            exit(0);
+         }
+         break;
+
       // IP address to attempt to bind to
       case 'o':
          outfile = optarg;
@@ -174,6 +258,10 @@ int main(int argc, char *argv[]) {
 
    // Start the replication server
    ReplServer repl_server(db, ip_addr.c_str(), port, time_mult, verbosity); 
+   repl_server.setDedupTolerances(dedup_window, dedup_tol);
+   repl_server.setReplMode(repl_mode, stream_delay, stream_batch);
+   repl_server.setGossip(gossip_fanout);
+   repl_server.setNetThreads(net_threads);
 
    pthread_t replthread;
    if (pthread_create(&replthread, NULL, t_replserver, (void *) &repl_server) != 0)